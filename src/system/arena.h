@@ -0,0 +1,241 @@
+﻿/*!
+*	@file
+*	@brief タスク用メモリアリーナ
+*/
+#pragma once
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief サイズ別フリーリストを持つメモリアリーナ
+    *
+    *	一定サイズのチャンクから小さなブロックを切り出して配る。
+    *	解放されたブロックはサイズごとのフリーリストに戻り、同じサイズの確保で再利用される。
+    *	チャンクはアリーナの破棄時にまとめて解放される。
+    *
+    *	アリーナを作ったスレッド（マネージャのスレッド）からの確保・解放はロックしない。
+    *	他のスレッドで解放されたブロックはロックなしのリストに積まれ、作ったスレッドが次に確保するときにまとめて引き取る。
+    *	他のスレッドからの確保だけはロックして行う。
+    *
+    *	Retireされた後は、返されたブロックをフリーリストに戻さず数えるだけにして、チャンクごとまとめて解放する。
+    *	大きすぎるブロックや、アラインメントの厳しい型は通常のoperator newに任せる（アラインメントは守る）。
+    */
+    class TaskArena
+    {
+    public:
+        static const std::size_t Alignment = 16;			//!< ブロックの最小単位・アラインメント
+        static const std::size_t MaxBlockSize = 1024;		//!< アリーナから確保する最大サイズ
+        static const std::size_t ChunkSize = 64 * 1024;		//!< 一度に確保するチャンクのサイズ
+
+        TaskArena() NOEXCEPT : owner(std::this_thread::get_id()) {}
+        ~TaskArena()
+        {
+            for (void* p : chunks) ::operator delete(p);
+        }
+
+        TaskArena(const TaskArena&) = delete;
+        TaskArena& operator=(const TaskArena&) = delete;
+
+        void* Allocate(std::size_t size, std::size_t align)
+        {
+            if (size > MaxBlockSize || align > Alignment)
+                return allocateLarge(size, align);
+
+            const std::size_t c = ClassOf(size);
+            if (std::this_thread::get_id() != owner){
+                std::lock_guard<std::mutex> lock(mutex);
+                otherBlocks.fetch_add(1, std::memory_order_relaxed);
+                return takeBlock(shared, c);
+            }
+            ownerBlocks.store(ownerBlocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return takeBlock(local, c);
+        }
+
+        void Deallocate(void* p, std::size_t size, std::size_t align) NOEXCEPT
+        {
+            if (size > MaxBlockSize || align > Alignment){
+                deallocateLarge(p, align);
+                return;
+            }
+
+            const std::size_t c = ClassOf(size);
+            FreeBlock* b = static_cast<FreeBlock*>(p);
+            if (std::this_thread::get_id() != owner){
+                otherBlocks.fetch_sub(1, std::memory_order_relaxed);
+                if (retired.load(std::memory_order_relaxed))
+                    return;
+                b->next = remoteFree[c].load(std::memory_order_relaxed);
+                while (!remoteFree[c].compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed)){}
+                return;
+            }
+            ownerBlocks.store(ownerBlocks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+            if (retired.load(std::memory_order_relaxed))
+                return;
+            b->next = local.freeLists[c];
+            local.freeLists[c] = b;
+        }
+
+        //! 使い終わったことを知らせる（排他タスクの階層がpopされたとき）。以後に返されたブロックは再利用しない
+        void Retire() NOEXCEPT
+        {
+            retired.store(true, std::memory_order_relaxed);
+        }
+
+        //! アリーナから確保されて、まだ解放されていないブロック数（通常のoperator newに任せたものは数えない）
+        std::size_t GetBlockCount() const NOEXCEPT
+        {
+            return static_cast<std::size_t>(ownerBlocks.load(std::memory_order_relaxed) + otherBlocks.load(std::memory_order_relaxed));
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        //! 切り出し中のチャンクとフリーリスト。作ったスレッド用と、他のスレッドがロックして使う用がある
+        struct Pool {
+            char* chunkCur = nullptr;						//!< 現在のチャンクの未使用領域の先頭
+            std::size_t chunkRest = 0;						//!< 現在のチャンクの残りサイズ
+            FreeBlock* freeLists[MaxBlockSize / Alignment] = {};
+        };
+
+        static std::size_t ClassOf(std::size_t size) NOEXCEPT
+        {
+            return size == 0 ? 0 : (size - 1) / Alignment;
+        }
+
+        //! poolから大きさの種類cのブロックを1つ取り出す（sharedならロックした状態で呼ぶ）
+        void* takeBlock(Pool& pool, std::size_t c)
+        {
+            FreeBlock* b = pool.freeLists[c];
+            if (!b && remoteFree[c].load(std::memory_order_relaxed))
+                b = remoteFree[c].exchange(nullptr, std::memory_order_acquire);
+            if (!b && &pool == &local && sharedHasFree[c].load(std::memory_order_relaxed)){
+                // 他のスレッドが引き取ったまま使っていないブロックを引き取る
+                std::lock_guard<std::mutex> lock(mutex);
+                b = shared.freeLists[c];
+                shared.freeLists[c] = nullptr;
+                sharedHasFree[c].store(false, std::memory_order_relaxed);
+            }
+            if (b){
+                pool.freeLists[c] = b->next;
+                if (&pool == &shared)
+                    sharedHasFree[c].store(b->next != nullptr, std::memory_order_relaxed);
+                return b;
+            }
+
+            const std::size_t blockSize = (c + 1) * Alignment;
+            if (pool.chunkRest < blockSize){
+                char* chunk = static_cast<char*>(::operator new(ChunkSize));
+                try{
+                    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+                    if (&pool == &local)
+                        lock.lock();
+                    chunks.push_back(chunk);
+                }
+                catch (...){
+                    ::operator delete(chunk);
+                    throw;
+                }
+                pool.chunkCur = chunk;
+                pool.chunkRest = ChunkSize;
+            }
+            void* p = pool.chunkCur;
+            pool.chunkCur += blockSize;
+            pool.chunkRest -= blockSize;
+            return p;
+        }
+
+        //! アリーナに入らないブロックを、アラインメントを守って確保する
+        static void* allocateLarge(std::size_t size, std::size_t align)
+        {
+#ifdef __cpp_aligned_new
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                return ::operator new(size, std::align_val_t(align));
+#else
+            if (align > alignof(std::max_align_t)){
+                // 確保した先頭を、揃えた位置の直前に覚えておく
+                char* const raw = static_cast<char*>(::operator new(size + align + sizeof(void*)));
+                const std::uintptr_t pos = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+                void* const p = reinterpret_cast<void*>(pos);
+                static_cast<void**>(p)[-1] = raw;
+                return p;
+            }
+#endif
+            return ::operator new(size);
+        }
+        static void deallocateLarge(void* p, std::size_t align) NOEXCEPT
+        {
+#ifdef __cpp_aligned_new
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__){
+                ::operator delete(p, std::align_val_t(align));
+                return;
+            }
+#else
+            if (align > alignof(std::max_align_t)){
+                ::operator delete(static_cast<void**>(p)[-1]);
+                return;
+            }
+#endif
+            ::operator delete(p);
+        }
+
+        const std::thread::id owner;						//!< アリーナを作ったスレッド
+        Pool local;											//!< ownerだけが使う
+        std::atomic<std::ptrdiff_t> ownerBlocks{ 0 };		//!< ownerが確保したブロック数からownerが解放したブロック数を引いたもの。ownerだけが書き込む
+        alignas(64) std::atomic<FreeBlock*> remoteFree[MaxBlockSize / Alignment] = {};	//!< 他のスレッドで解放されたブロック
+        std::atomic<bool> sharedHasFree[MaxBlockSize / Alignment] = {};	//!< sharedのフリーリストが空でないか
+        std::atomic<std::ptrdiff_t> otherBlocks{ 0 };		//!< 他のスレッドが確保したブロック数から他のスレッドが解放したブロック数を引いたもの
+        std::atomic<bool> retired{ false };					//!< Retireされたか
+        mutable std::mutex mutex;							//!< sharedとchunksを守る
+        Pool shared;										//!< owner以外のスレッドがロックして使う
+        std::vector<void*> chunks;							//!< 確保済みチャンク
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskArenaから確保するアロケータ
+    *
+    *	アリーナへの参照を共有して持つので、このアロケータで確保されたオブジェクトが
+    *	残っている間はアリーナも破棄されない。
+    */
+    template<class T>
+    class ArenaAllocator
+    {
+    public:
+        using value_type = T;
+
+        explicit ArenaAllocator(std::shared_ptr<TaskArena> source) NOEXCEPT : arena(std::move(source)) {}
+        template<class U> ArenaAllocator(const ArenaAllocator<U>& other) NOEXCEPT : arena(other.arena) {}
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+        }
+        void deallocate(T* p, std::size_t n) NOEXCEPT
+        {
+            arena->Deallocate(p, n * sizeof(T), alignof(T));
+        }
+
+        template<class U> bool operator==(const ArenaAllocator<U>& other) const NOEXCEPT { return arena == other.arena; }
+        template<class U> bool operator!=(const ArenaAllocator<U>& other) const NOEXCEPT { return arena != other.arena; }
+
+    private:
+        template<class U> friend class ArenaAllocator;
+
+        std::shared_ptr<TaskArena> arena;
+    };
+}
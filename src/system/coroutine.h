@@ -0,0 +1,175 @@
+﻿/*!
+*	@file
+*	@brief コルーチンで書くタスク（C++20）
+*
+*	コルーチンが使えない環境では何も定義しない。使える場合はGTF_COROUTINEが定義される。
+*/
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#   if __has_include(<coroutine>)
+#       define GTF_COROUTINE
+#   endif
+#endif
+
+#ifdef GTF_COROUTINE
+#include <coroutine>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <utility>
+#include "arena.h"
+
+namespace gtf
+{
+    /*!
+    *	@ingroup Tasks
+    *	@brief コルーチンで書く通常タスク
+    *
+    *	演出や攻撃の流れのような、状態遷移をExecuteに書いていた処理を、Runの中に上から順に書ける。
+    *	RunはCoroutineTask::Routineを返すコルーチンで、最初のExecuteで開始される。Runが終わるとタスクは破棄される。
+    *
+    *	・co_await NextFrame()		: 次のフレームまで待つ
+    *	・co_await WaitSeconds(t)	: 経過時間の合計がt秒になるまで待つ
+    *	・co_await WaitTerminate(p)	: 他のタスクがTerminateされるまで待つ
+    *
+    *	待っている間はTaskManagerがExecuteを呼ばない（コルーチンを再開しない）。
+    *	再開したフレームのGetElapsedTimeには、前回の再開からの経過時間の合計が返る。
+    *	コルーチンのフレームは共有のTaskArenaから確保される。
+    *	並列実行はしない。
+    */
+    class CoroutineTask : public TaskBase
+    {
+    public:
+        //! Runの戻り値。コルーチンのフレームを所有する
+        class Routine
+        {
+        public:
+            struct promise_type {
+                std::exception_ptr error;
+
+                Routine get_return_object() NOEXCEPT { return Routine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                std::suspend_always initial_suspend() NOEXCEPT { return {}; }
+                std::suspend_always final_suspend() NOEXCEPT { return {}; }
+                void return_void() NOEXCEPT {}
+                void unhandled_exception() NOEXCEPT { error = std::current_exception(); }
+
+                // 短命なコルーチンが大量に作られても、グローバルなヒープを使わないようにする
+                static void* operator new(std::size_t size) { return FrameArena().Allocate(size, TaskArena::Alignment); }
+                static void operator delete(void* p, std::size_t size) NOEXCEPT { FrameArena().Deallocate(p, size, TaskArena::Alignment); }
+            };
+
+            Routine() NOEXCEPT {}
+            Routine(Routine&& other) NOEXCEPT : handle(std::exchange(other.handle, nullptr)) {}
+            Routine& operator=(Routine&& other) NOEXCEPT
+            {
+                if (this != &other){
+                    Reset();
+                    handle = std::exchange(other.handle, nullptr);
+                }
+                return *this;
+            }
+            ~Routine(){ Reset(); }
+
+            Routine(const Routine&) = delete;
+            Routine& operator=(const Routine&) = delete;
+
+        private:
+            friend class CoroutineTask;
+
+            explicit Routine(std::coroutine_handle<promise_type> h) NOEXCEPT : handle(h) {}
+            void Reset() NOEXCEPT
+            {
+                if (handle)
+                    handle.destroy();
+                handle = nullptr;
+            }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        CoroutineTask() NOEXCEPT { sleepable = true; }
+        virtual ~CoroutineTask(){}
+
+        //! コルーチンを再開する。Runが終わったらfalse
+        bool Execute(double elapsedTime) final
+        {
+            if (!started){
+                started = true;
+                routine = Run();
+            }
+            // 例外で終わった後にExecuteされた場合も、再開せずに終わる
+            if (!routine.handle || routine.handle.done())
+                return false;
+            resumeElapsed = elapsedTime;
+            wakeTime = 0;
+            routine.handle.resume();
+            if (routine.handle.promise().error){
+                // 最後の中断位置にあるコルーチンは再開できないので、フレームを破棄してから送出する
+                const std::exception_ptr error = std::exchange(routine.handle.promise().error, nullptr);
+                routine.Reset();
+                std::rethrow_exception(error);
+            }
+            return !routine.handle.done();
+        }
+        bool IsParallelExecutable() const final { return false; }
+
+    protected:
+        virtual Routine Run() = 0;											//!< タスクの処理本体。最初のExecuteで開始される
+        double GetElapsedTime() const NOEXCEPT { return resumeElapsed; }		//!< 直前の再開で渡された経過時間
+
+        //! 次のフレームまで待つ
+        std::suspend_always NextFrame() const NOEXCEPT { return {}; }
+
+        //! 指定秒数が経つまで待つ
+        struct SecondsAwaiter {
+            CoroutineTask* task;
+            double seconds;
+
+            bool await_ready() const NOEXCEPT { return false; }
+            void await_suspend(std::coroutine_handle<>) const NOEXCEPT { task->wakeTime = task->lastTickTime + seconds; }
+            void await_resume() const NOEXCEPT {}
+        };
+        SecondsAwaiter WaitSeconds(double seconds) NOEXCEPT { return SecondsAwaiter{ this, seconds }; }
+
+        //! 他のタスクがTerminateされるまで待つ。既に破棄・Terminateされていれば待たない
+        struct TerminateAwaiter {
+            CoroutineTask* task;
+            std::shared_ptr<TaskBase> target;
+
+            bool await_ready() const NOEXCEPT { return !target || target->terminated || target.get() == task; }
+            void await_suspend(std::coroutine_handle<>) NOEXCEPT
+            {
+                task->wakeTime = std::numeric_limits<double>::infinity();
+                task->cold->wait.waitingFor = target.get();
+                task->cold->wait.nextWaiter = target->cold->wait.firstWaiter;
+                target->cold->wait.firstWaiter = task;
+                target = nullptr;
+            }
+            void await_resume() const NOEXCEPT {}
+        };
+        TerminateAwaiter WaitTerminate(const std::weak_ptr<TaskBase>& target)
+        {
+            std::shared_ptr<TaskBase> locked = target.lock();
+            // 待ち始めた後は確保できないので、ここで用意しておく
+            if (locked){
+                Cold();
+                locked->Cold();
+            }
+            return TerminateAwaiter{ this, std::move(locked) };
+        }
+
+    private:
+        //! コルーチンのフレームの確保先。破棄されたマネージャのタスクからも使えるよう、破棄はしない
+        static TaskArena& FrameArena()
+        {
+            static TaskArena* const arena = new TaskArena();
+            return *arena;
+        }
+
+        Routine routine;
+        bool started = false;			//!< Runを開始したか
+        double resumeElapsed = 0;
+    };
+}
+#endif
@@ -0,0 +1,207 @@
+﻿/*!
+*	@file
+*	@brief 描画順管理
+*/
+#pragma once
+#include <vector>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+namespace gtf
+{
+    class TaskBase;
+
+    /*!
+    *	@ingroup System
+    *	@brief 描画プライオリティ別のバケットに分けた描画キュー
+    *
+    *	プライオリティごとにバケットを持ち、プライオリティの大きい順に並べる。
+    *	バケットは登録順（seqの昇順）に並んだ、ChunkSize個までの項目を持つチャンクの列で、
+    *	(priority, seq)をキーにして二分探索で除去できる。
+    *	除去された項目はnullptrの墓標として残り、Compactでまとめて詰められる。
+    *	Compactは墓標のあるチャンクだけを詰めるので、手間は変わった項目数に比例し、バケットの大きさによらない。
+    *	空になったチャンクは、バケットのチャンクの半分を超えたときにまとめて取り除く。
+    */
+    class DrawQueue
+    {
+    public:
+        static const std::size_t ChunkSize = 64;			//!< 1つのチャンクに入る項目数の上限
+
+        //! 登録された項目のキー。タスク側に覚えておき、除去に使う
+        struct Key {
+            int priority = -1;		//!< 描画プライオリティ。マイナスなら未登録
+            std::uint64_t seq = 0;	//!< 登録順
+        };
+
+        struct Entry {
+            TaskBase* task;
+            std::uint64_t seq;
+        };
+        //! バケットの一部。項目は後ろに足されるか墓標になるだけなので、受け持つseqの範囲は変わらない
+        struct Chunk {
+            std::uint64_t firstSeq = 0;		//!< 作られたときの最初の項目のseq。次のチャンクのfirstSeqまでを受け持つ
+            bool dirty = false;				//!< 墓標があるか
+            std::vector<Entry> entries;
+        };
+        struct Bucket {
+            std::vector<Chunk> chunks;
+            std::vector<std::size_t> dirtyChunks;	//!< 墓標のあるチャンクの位置
+            std::size_t emptyChunks = 0;			//!< 詰めた結果、空になったチャンクの数
+            std::size_t live = 0;					//!< 有効な項目数
+        };
+        using BucketMap = std::map<int, Bucket, std::greater<int>>;
+
+        DrawQueue() {}
+        DrawQueue(DrawQueue&&) = default;
+        DrawQueue& operator=(DrawQueue&&) = default;
+        DrawQueue(const DrawQueue&) = delete;				//!< 墓標のあるバケットを指す反復子を持つので、コピーしない
+        DrawQueue& operator=(const DrawQueue&) = delete;
+
+        //! 登録。seqは登録のたびに増える値であること
+        void Add(const Key& key, TaskBase* task)
+        {
+            assert(key.priority >= 0);
+            Bucket& b = buckets[key.priority];
+            assert(b.chunks.empty() || b.chunks.back().entries.empty() || b.chunks.back().entries.back().seq < key.seq);
+            if (b.chunks.empty() || b.chunks.back().entries.size() == ChunkSize){
+                b.chunks.emplace_back();
+                b.chunks.back().firstSeq = key.seq;
+                b.chunks.back().entries.reserve(ChunkSize);
+            }
+            else if (b.chunks.back().entries.empty() && !b.chunks.back().dirty)
+                --b.emptyChunks;
+            b.chunks.back().entries.push_back(Entry{ task, key.seq });
+            ++b.live;
+            ++count;
+        }
+
+        //! 除去。見つからなければfalse
+        bool Remove(const Key& key)
+        {
+            const auto ib = buckets.find(key.priority);
+            if (ib == buckets.end())
+                return false;
+
+            // seqを受け持つのは、firstSeqがseq以下の最後のチャンク
+            Bucket& b = ib->second;
+            const auto ic = std::upper_bound(b.chunks.begin(), b.chunks.end(), key.seq,
+                [](std::uint64_t seq, const Chunk& c){ return seq < c.firstSeq; });
+            if (ic == b.chunks.begin())
+                return false;
+            Chunk& c = *(ic - 1);
+            const auto it = std::lower_bound(c.entries.begin(), c.entries.end(), key.seq,
+                [](const Entry& e, std::uint64_t seq){ return e.seq < seq; });
+            if (it == c.entries.end() || it->seq != key.seq || !it->task)
+                return false;
+
+            it->task = nullptr;
+            if (!c.dirty){
+                if (b.dirtyChunks.empty())
+                    dirty.push_back(ib);
+                c.dirty = true;
+                b.dirtyChunks.push_back(static_cast<std::size_t>(ic - 1 - b.chunks.begin()));
+            }
+            --b.live;
+            --count;
+            return true;
+        }
+
+        //! 墓標を詰める。描画の走査中に呼ばないこと
+        void Compact()
+        {
+            for (auto ib : dirty){
+                Bucket& b = ib->second;
+                if (b.live == 0){
+                    buckets.erase(ib);
+                    continue;
+                }
+                for (std::size_t i : b.dirtyChunks){
+                    Chunk& c = b.chunks[i];
+                    c.entries.erase(std::remove_if(c.entries.begin(), c.entries.end(),
+                        [](const Entry& e){ return e.task == nullptr; }), c.entries.end());
+                    c.dirty = false;
+                    if (c.entries.empty())
+                        ++b.emptyChunks;
+                }
+                b.dirtyChunks.clear();
+
+                // 取り除く手間はチャンク数に比例するが、それまでに半分のチャンクが空になっているので、均せば除去1回あたり定数
+                if (b.emptyChunks * 2 > b.chunks.size()){
+                    b.chunks.erase(std::remove_if(b.chunks.begin(), b.chunks.end(),
+                        [](const Chunk& c){ return c.entries.empty(); }), b.chunks.end());
+                    b.emptyChunks = 0;
+                }
+            }
+            dirty.clear();
+        }
+
+        //! 全て除去する。バケットは残す
+        void Clear()
+        {
+            for (auto&& b : buckets){
+                b.second.chunks.clear();
+                b.second.dirtyChunks.clear();
+                b.second.emptyChunks = 0;
+                b.second.live = 0;
+            }
+            count = 0;
+            dirty.clear();
+        }
+
+        std::size_t Size() const { return count; }
+
+        /*!
+        *	@brief 描画順に有効な項目をたどるカーソル
+        *
+        *	走査中に除去された項目は飛ばす。走査中の追加も安全だが、追加された項目をたどるかどうかは位置次第。
+        */
+        class Cursor
+        {
+        public:
+            explicit Cursor(BucketMap& buckets) : ib(buckets.begin()), ied(buckets.end())
+            {
+                Skip();
+            }
+
+            bool Valid() const { return ib != ied; }
+            int Priority() const { return ib->first; }
+            std::uint64_t Seq() const { return ib->second.chunks[c].entries[i].seq; }
+            TaskBase* Task() const { return ib->second.chunks[c].entries[i].task; }	//!< 位置を合わせた後に除去された場合はnullptr
+            void Next()
+            {
+                ++i;
+                Skip();
+            }
+
+        private:
+            void Skip()
+            {
+                for (; ib != ied; ++ib, c = 0, i = 0){
+                    const std::vector<Chunk>& chunks = ib->second.chunks;
+                    for (; c < chunks.size(); ++c, i = 0){
+                        const std::vector<Entry>& b = chunks[c].entries;
+                        while (i < b.size() && !b[i].task)
+                            ++i;
+                        if (i < b.size())
+                            return;
+                    }
+                }
+            }
+
+            BucketMap::iterator ib;
+            BucketMap::iterator ied;
+            std::size_t c = 0;
+            std::size_t i = 0;
+        };
+
+        Cursor Begin() { return Cursor(buckets); }
+
+    private:
+        BucketMap buckets;
+        std::size_t count = 0;			//!< 有効な項目数
+        std::vector<BucketMap::iterator> dirty;	//!< 墓標のあるバケット
+    };
+}
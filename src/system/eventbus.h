@@ -0,0 +1,222 @@
+﻿/*!
+*	@file
+*	@brief タスク間の型つきイベント配信
+*/
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <utility>
+#include <iterator>
+#include <initializer_list>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include "typeslot.h"
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    class TaskBase;
+
+    /*!
+    *	@ingroup System
+    *	@brief イベントの型ごとのキューと購読者を持つイベントバス
+    *
+    *	Publishされたイベントは型ごとの配列に溜められ、Dispatchで購読者にまとめて配られる。
+    *	型ごとの配列は、型ごとに静的に割り振られた番号で引くので、ハッシュ表は使わない。
+    *	Dispatchは配り始める前に全ての型のキューを取り出すので、Dispatchの中でPublishされたイベントは、型によらず次のDispatchで配られる。
+    *	購読の解除は、配信中でも安全に行える（解除された購読者には、それ以降配られない）。
+    */
+    class EventBus
+    {
+    public:
+        using Subscription = std::uint64_t;			//!< 購読の識別子。0は無効
+
+        EventBus() NOEXCEPT {}
+        EventBus(const EventBus&) = delete;
+        EventBus& operator=(const EventBus&) = delete;
+
+        //! イベントを積む。concurrentなら、他のスレッドと同時に呼ばれてもよいようにロックする
+        template<class E>
+        void Publish(E&& event, bool concurrent)
+        {
+            using Event = typename std::decay<E>::type;
+            if (concurrent){
+                std::lock_guard<std::mutex> lock(mutex);
+                ChannelOf<Event>().queue.push_back(std::forward<E>(event));
+            }
+            else
+                ChannelOf<Event>().queue.push_back(std::forward<E>(event));
+        }
+
+        //! 型Eのイベントを購読する。ownerがTerminateされると、RemoveOwnerで解除される
+        template<class E, class F>
+        Subscription Subscribe(const TaskBase* owner, F&& handler)
+        {
+            const Subscription id = ++lastSubscription;
+            ChannelOf<E>().Add(typename Channel<E>::Subscriber{ id, owner, std::forward<F>(handler) });
+            return id;
+        }
+
+        //! 購読を解除する
+        void Unsubscribe(Subscription id) NOEXCEPT
+        {
+            for (auto&& c : channels){
+                if (c && c->Unsubscribe(id))
+                    return;
+            }
+        }
+
+        //! ownerの購読を全て解除する
+        void RemoveOwner(const TaskBase* owner) NOEXCEPT
+        {
+            for (auto&& c : channels){
+                if (c)
+                    c->RemoveOwner(owner);
+            }
+        }
+
+        //! 溜まっているイベントを、型の番号順・Publish順に購読者に配る
+        void Dispatch()
+        {
+            pending.clear();
+            for (auto&& c : channels){
+                if (c && c->Take())
+                    pending.push_back(c.get());
+            }
+
+            // 購読者が例外を送出したら、まだ配っていない型のイベントはキューに戻す
+            struct Guard {
+                std::vector<ChannelBase*>& pending;
+                std::size_t next;
+                ~Guard(){ for (; next < pending.size(); next++) pending[next]->Restore(); }
+            } guard{ pending, 0 };
+            while (guard.next < pending.size())
+                pending[guard.next++]->Deliver();
+        }
+
+        //! 溜まっているイベントと購読を全て捨てる
+        void Clear() NOEXCEPT
+        {
+            channels.clear();
+        }
+
+    private:
+        struct ChannelBase {
+            virtual ~ChannelBase(){}
+            virtual bool Take() = 0;					//!< 配るイベントをキューから取り出す。なければfalse
+            virtual void Deliver() = 0;					//!< 取り出したイベントを配る
+            virtual void Restore() NOEXCEPT = 0;		//!< 取り出したイベントを配らずにキューの先頭に戻す
+            virtual bool Unsubscribe(Subscription id) NOEXCEPT = 0;
+            virtual void RemoveOwner(const TaskBase* owner) NOEXCEPT = 0;
+        };
+
+        template<class E>
+        struct Channel : ChannelBase {
+            struct Subscriber {
+                Subscription id;						//!< 解除されたら0
+                const TaskBase* owner;
+                std::function<void(const E&)> handler;
+            };
+
+            std::vector<E> queue;						//!< 次のDispatchで配るイベント
+            std::vector<E> dispatching;					//!< 配信中のイベント。確保した領域を使い回す
+            std::vector<Subscriber> subscribers;		//!< 購読順
+            std::vector<Subscriber> added;				//!< 配信中に購読した者。次のDispatchでsubscribersに加える
+            bool dispatchingNow = false;				//!< 配信中か
+            bool removed = false;						//!< 解除された購読者が残っているか
+
+            void Add(Subscriber&& s)
+            {
+                // 配信中にsubscribersを伸ばすと、実行中のhandlerが移動してしまう
+                (dispatchingNow ? added : subscribers).push_back(std::move(s));
+            }
+
+            bool Take() override
+            {
+                if (removed){
+                    subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                        [](const Subscriber& s){ return s.id == 0; }), subscribers.end());
+                    removed = false;
+                }
+                std::move(added.begin(), added.end(), std::back_inserter(subscribers));
+                added.clear();
+                if (queue.empty())
+                    return false;
+                dispatching.swap(queue);
+                return true;
+            }
+
+            void Deliver() override
+            {
+                struct Guard {
+                    Channel& channel;
+                    ~Guard(){ channel.dispatching.clear(); channel.dispatchingNow = false; }
+                } guard{ *this };
+                dispatchingNow = true;
+
+                for (const E& e : dispatching){
+                    for (auto&& s : subscribers){
+                        if (s.id != 0)
+                            s.handler(e);
+                    }
+                }
+            }
+
+            void Restore() NOEXCEPT override
+            {
+                // 配っている間にPublishされたものは、後ろに続ける
+                std::move(queue.begin(), queue.end(), std::back_inserter(dispatching));
+                queue.swap(dispatching);
+                dispatching.clear();
+            }
+
+            bool Unsubscribe(Subscription id) NOEXCEPT override
+            {
+                for (auto* list : { &subscribers, &added }){
+                    for (auto&& s : *list){
+                        if (s.id == id){
+                            s.id = 0;
+                            removed = true;
+                            return true;
+                        }
+                    }
+                }
+                return false;
+            }
+
+            void RemoveOwner(const TaskBase* owner) NOEXCEPT override
+            {
+                for (auto* list : { &subscribers, &added }){
+                    for (auto&& s : *list){
+                        if (s.owner == owner && s.id != 0){
+                            s.id = 0;
+                            removed = true;
+                        }
+                    }
+                }
+            }
+        };
+
+        template<class E>
+        Channel<E>& ChannelOf()
+        {
+            const std::size_t slot = TypeSlot<EventBus>::Of<E>();
+            if (slot >= channels.size())
+                channels.resize(slot + 1);
+            if (!channels[slot])
+                channels[slot].reset(new Channel<E>());
+            return static_cast<Channel<E>&>(*channels[slot]);
+        }
+
+        std::vector<std::unique_ptr<ChannelBase>> channels;	//!< 型の番号→チャンネル
+        std::vector<ChannelBase*> pending;			//!< Dispatchで、イベントを取り出したチャンネル
+        Subscription lastSubscription = 0;
+        std::mutex mutex;							//!< 並列実行中のPublish用
+    };
+}
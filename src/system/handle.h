@@ -0,0 +1,124 @@
+﻿/*!
+*	@file
+*	@brief 世代つきのタスクハンドル
+*/
+#pragma once
+#include <vector>
+#include <type_traits>
+#include <cstdint>
+#include <cassert>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    class TaskBase;
+    class TaskManager;
+    template<class T> class TaskHandle;
+
+    /*!
+    *	@ingroup System
+    *	@brief タスクハンドルの番号→タスクの表
+    *
+    *	タスクがマネージャに登録されると番号が割り当てられ、Terminateされると番号の世代が進む。
+    *	番号は使い回されるが、世代が違うので古いハンドルからは引けない。
+    *	マネージャのスレッドからだけ使うこと（参照カウントのような原子的な操作はしない）。
+    */
+    class TaskHandleTable
+    {
+    public:
+        static const std::uint32_t None = ~static_cast<std::uint32_t>(0);	//!< 番号なし
+
+        TaskHandleTable() NOEXCEPT {}
+        TaskHandleTable(const TaskHandleTable&) = delete;
+        TaskHandleTable& operator=(const TaskHandleTable&) = delete;
+
+        //! 番号と世代からタスクを引く。無効ならnullptr
+        TaskBase* Resolve(std::uint32_t index, std::uint32_t generation) const NOEXCEPT
+        {
+            return index < slots.size() && slots[index].generation == generation ? slots[index].task : nullptr;
+        }
+
+        //! タスクに番号を割り当てる
+        std::uint32_t Acquire(TaskBase* task)
+        {
+            if (!freeSlots.empty()){
+                const std::uint32_t index = freeSlots.back();
+                freeSlots.pop_back();
+                slots[index].task = task;
+                return index;
+            }
+            slots.push_back(Slot{ task, 0 });
+            return static_cast<std::uint32_t>(slots.size() - 1);
+        }
+
+        //! 番号を返す。その番号の古いハンドルは無効になる
+        void Release(std::uint32_t index)
+        {
+            assert(index < slots.size() && slots[index].task);
+            slots[index].task = nullptr;
+            ++slots[index].generation;
+            freeSlots.push_back(index);
+        }
+
+        std::uint32_t GenerationOf(std::uint32_t index) const NOEXCEPT { return slots[index].generation; }
+        std::size_t Size() const NOEXCEPT { return slots.size() - freeSlots.size(); }	//!< 番号を割り当てているタスク数
+
+    private:
+        struct Slot {
+            TaskBase* task;
+            std::uint32_t generation;
+        };
+        std::vector<Slot> slots;
+        std::vector<std::uint32_t> freeSlots;
+    };
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief タスクへの世代つきハンドル
+    *
+    *	std::weak_ptrの代わりに使える。lockは参照カウントを増やさず、整数の比較だけで生のポインタを返す。
+    *	タスクがTerminateされると無効になる。ハンドルはマネージャより長く使わないこと。
+    *	TaskManager::GetHandle・FindHandleで取得する。
+    */
+    template<class T>
+    class TaskHandle
+    {
+    public:
+        TaskHandle() NOEXCEPT {}
+
+        //! 派生クラスのハンドルから、基底クラスのハンドルへ
+        template<class U, typename std::enable_if<std::is_convertible<U*, T*>::value, std::nullptr_t>::type = nullptr>
+        TaskHandle(const TaskHandle<U>& other) NOEXCEPT : table(other.table), index(other.index), generation(other.generation) {}
+
+        //! タスクを取得する。無効ならnullptr
+        T* lock() const NOEXCEPT
+        {
+            return table ? static_cast<T*>(table->Resolve(index, generation)) : nullptr;
+        }
+        T* get() const NOEXCEPT { return lock(); }
+        bool expired() const NOEXCEPT { return lock() == nullptr; }
+        void reset() NOEXCEPT { *this = TaskHandle(); }
+        explicit operator bool() const NOEXCEPT { return !expired(); }
+        T* operator->() const NOEXCEPT { T* const p = lock(); assert(p); return p; }
+        T& operator*() const NOEXCEPT { T* const p = lock(); assert(p); return *p; }
+
+        bool operator==(const TaskHandle& other) const NOEXCEPT
+        {
+            return table == other.table && index == other.index && generation == other.generation;
+        }
+        bool operator!=(const TaskHandle& other) const NOEXCEPT { return !(*this == other); }
+
+    private:
+        friend class TaskManager;
+        template<class U> friend class TaskHandle;
+
+        TaskHandle(const TaskHandleTable* t, std::uint32_t i, std::uint32_t g) NOEXCEPT : table(t), index(i), generation(g) {}
+
+        const TaskHandleTable* table = nullptr;
+        std::uint32_t index = TaskHandleTable::None;
+        std::uint32_t generation = 0;
+    };
+}
@@ -0,0 +1,29 @@
+﻿/*!
+*	@file
+*	@brief タスクマネージャへの入力と、タスクの増減の通知先
+*/
+#pragma once
+
+namespace gtf
+{
+    class TaskBase;
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskManager::SetJournalで設定する、マネージャへの入力とタスクの増減の通知先
+    *
+    *	externalな通知は、Executeやタスクの処理の外からマネージャに対して行われた操作（＝入力）。
+    *	それ以外は、入力の結果として起こったこと。同じ入力を同じ順に与えれば、同じ順に起こる。
+    *	通知は全てマネージャのスレッドで行われる。
+    */
+    class TaskJournal
+    {
+    public:
+        virtual ~TaskJournal(){}
+        virtual void OnExecute(double elapsedTime) = 0;				//!< Executeの開始（入力）
+        virtual void OnAdd(const TaskBase& task, bool external) = 0;	//!< タスクが追加された（Initializeの前）
+        virtual void OnTerminate(const TaskBase& task) = 0;			//!< タスクがTerminateされた（Terminateの前）
+        virtual void OnRemoveByID(unsigned int id) = 0;				//!< 外からRemoveTaskByIDが呼ばれた（入力）
+        virtual void OnRevertByID(unsigned int id) = 0;				//!< 外からRevertExclusiveTaskByIDが呼ばれた（入力）
+    };
+}
@@ -0,0 +1,386 @@
+﻿/*!
+*	@file
+*	@brief 非同期ログ出力
+*/
+#pragma once
+#include <memory>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <typeinfo>
+#include <type_traits>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#if defined(__GNUG__)
+#   include <cxxabi.h>
+#   include <cstdlib>
+#endif
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief 書式化とファイル出力を別スレッドで行うログ
+    *
+    *	Logは書式文字列と引数をそのままリングバッファに積むだけで、書式化と出力は専用のスレッドで行う。
+    *	リングバッファはロックフリーで、複数のスレッドから同時にLogしてよい。
+    *	バッファが一杯のときは、そのログは捨てられ、捨てた数が数えられる。
+    *	ログのスレッドはコンストラクタで起動し、積まれたログがない間は眠っている。
+    *	Logは、ログのスレッドが眠っているときだけ起こしに行く。
+    *
+    *	・書式文字列はprintfと同じ形式。文字列リテラルのように、プログラムの終了まで有効なものを渡すこと
+    *	・文字列の引数はバッファにコピーされる（長すぎる場合は切り詰められる）
+    *	・std::type_infoを渡すと、%sで型名として出力される
+    */
+    class AsyncLogger
+    {
+    public:
+        using Sink = std::function<void(const std::string& /* line */)>;	//!< 書式化された1行を出力する関数。ログのスレッドから呼ばれる
+
+        static const std::size_t MaxArgs = 6;			//!< 1回のLogに渡せる引数の数
+        static const std::size_t TextSize = 128;		//!< 文字列の引数をコピーする領域のサイズ
+
+        //! @param capacity リングバッファの大きさ（2の累乗に切り上げる）
+        explicit AsyncLogger(std::size_t capacity = 1024, Sink output = StderrSink())
+            : mask(RoundUp(capacity) - 1), slots(new Slot[mask + 1]), sink(std::move(output))
+        {
+            for (std::size_t i = 0; i <= mask; i++)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            thread = std::thread([this]{ ConsumerLoop(); });
+        }
+
+        ~AsyncLogger()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            cvWork.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+
+        AsyncLogger(const AsyncLogger&) = delete;
+        AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+        //! ログを積む。バッファが一杯ならfalse
+        template<typename... A>
+        bool Log(const char* format, const A&... args) NOEXCEPT
+        {
+            static_assert(sizeof...(A) <= MaxArgs, "too many log arguments");
+
+            std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            Slot* slot;
+            for (;;){
+                slot = &slots[pos & mask];
+                const std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+                const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+                if (diff == 0){
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0){
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                else
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+
+            Record& r = slot->record;
+            r.format = format;
+            r.count = 0;
+            r.textUsed = 0;
+            int expand[] = { 0, (Put(r, args), 0)... };
+            (void)expand;
+            // 積んだ後にログのスレッドが眠っていれば起こす。眠る側と同じくseq_cstにして、見落としを防ぐ
+            slot->sequence.store(pos + 1, std::memory_order_seq_cst);
+            if (sleeping.load(std::memory_order_seq_cst) && sleeping.exchange(false, std::memory_order_seq_cst)){
+                std::lock_guard<std::mutex> lock(mutex);
+                cvWork.notify_one();
+            }
+            return true;
+        }
+
+        //! これまでに積まれたログが全て出力されるまで待つ
+        void Flush()
+        {
+            const std::size_t target = enqueuePos.load(std::memory_order_acquire);
+            if (consumedPos.load(std::memory_order_acquire) >= target)
+                return;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            flushRequested = true;
+            cvWork.notify_all();
+            cvFlushed.wait(lock, [this, target]{ return consumedPos.load(std::memory_order_acquire) >= target; });
+        }
+
+        std::uint64_t GetDroppedCount() const NOEXCEPT { return dropped.load(std::memory_order_relaxed); }	//!< バッファが一杯で捨てたログの数
+
+        //! 標準エラー出力に書き出す
+        static Sink StderrSink()
+        {
+            return [](const std::string& line){
+                std::fputs(line.c_str(), stderr);
+                std::fputc('\n', stderr);
+            };
+        }
+
+        //! ファイルに追記する。ファイルは出力のたびにflushされる
+        static Sink FileSink(const std::string& path)
+        {
+            std::shared_ptr<std::FILE> file(std::fopen(path.c_str(), "a"), [](std::FILE* f){ if (f) std::fclose(f); });
+            return [file](const std::string& line){
+                if (!file)
+                    return;
+                std::fputs(line.c_str(), file.get());
+                std::fputc('\n', file.get());
+                std::fflush(file.get());
+            };
+        }
+
+        //! 既定のログ。標準エラー出力に書き出す
+        /*!
+        *	静的なオブジェクトのデストラクタからも使えるよう、破棄はしない。
+        */
+        static AsyncLogger& Default()
+        {
+            static AsyncLogger* const instance = new AsyncLogger();
+            return *instance;
+        }
+
+    private:
+        //! 引数1つ分
+        struct Arg {
+            enum class Type : unsigned char { Int, UInt, Double, Text, Pointer, TypeInfo };
+            Type type;
+            union {
+                long long i;
+                unsigned long long u;
+                double d;
+                std::size_t text;				// Record::textでの位置
+                const void* p;
+                const std::type_info* t;
+            };
+        };
+
+        //! 1回のLog分
+        struct Record {
+            const char* format;
+            std::size_t count;
+            std::size_t textUsed;
+            Arg args[MaxArgs];
+            char text[TextSize];
+        };
+
+        struct Slot {
+            std::atomic<std::size_t> sequence;
+            Record record;
+        };
+
+        static std::size_t RoundUp(std::size_t n) NOEXCEPT
+        {
+            std::size_t r = 2;
+            while (r < n)
+                r <<= 1;
+            return r;
+        }
+
+        //! 読み出していないログがあるか（ログのスレッドのみ使う）
+        bool HasPending() const NOEXCEPT
+        {
+            return slots[dequeuePos & mask].sequence.load(std::memory_order_seq_cst) == dequeuePos + 1;
+        }
+
+        static Arg& Next(Record& r) NOEXCEPT { return r.args[r.count++]; }
+
+        template<class T, typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && std::is_signed<T>::value, std::nullptr_t>::type = nullptr>
+        static void Put(Record& r, T v) NOEXCEPT { Arg& a = Next(r); a.type = Arg::Type::Int; a.i = static_cast<long long>(v); }
+        template<class T, typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && !std::is_signed<T>::value, std::nullptr_t>::type = nullptr>
+        static void Put(Record& r, T v) NOEXCEPT { Arg& a = Next(r); a.type = Arg::Type::UInt; a.u = static_cast<unsigned long long>(v); }
+        template<class T, typename std::enable_if<std::is_floating_point<T>::value, std::nullptr_t>::type = nullptr>
+        static void Put(Record& r, T v) NOEXCEPT { Arg& a = Next(r); a.type = Arg::Type::Double; a.d = static_cast<double>(v); }
+        template<class T>
+        static void Put(Record& r, T* v) NOEXCEPT { Arg& a = Next(r); a.type = Arg::Type::Pointer; a.p = v; }
+        template<class T>
+        static void Put(Record& r, const std::shared_ptr<T>& v) NOEXCEPT { Put(r, static_cast<const void*>(v.get())); }
+        static void Put(Record& r, const std::type_info& v) NOEXCEPT { Arg& a = Next(r); a.type = Arg::Type::TypeInfo; a.t = &v; }
+        static void Put(Record& r, const std::string& v) NOEXCEPT { PutText(r, v.data(), v.size()); }
+        static void Put(Record& r, const char* v) NOEXCEPT { PutText(r, v, v ? std::strlen(v) : 0); }
+        static void Put(Record& r, char* v) NOEXCEPT { Put(r, static_cast<const char*>(v)); }
+
+        static void PutText(Record& r, const char* s, std::size_t length) NOEXCEPT
+        {
+            Arg& a = Next(r);
+            a.type = Arg::Type::Text;
+            a.text = r.textUsed;
+            const std::size_t n = std::min(length, TextSize - 1 - r.textUsed);
+            if (n > 0)
+                std::memcpy(r.text + r.textUsed, s, n);
+            r.textUsed += n;
+            r.text[r.textUsed] = '\0';
+            if (r.textUsed < TextSize - 1)
+                r.textUsed++;
+        }
+
+        void ConsumerLoop()
+        {
+            std::string line;
+            for (;;){
+                std::size_t processed = 0;
+                for (;;){
+                    Slot& slot = slots[dequeuePos & mask];
+                    if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+                        break;
+                    Format(slot.record, line);
+                    slot.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+                    ++dequeuePos;
+                    ++processed;
+                    try{
+                        sink(line);
+                    }
+                    catch (...){
+                    }
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                consumedPos.store(dequeuePos, std::memory_order_release);
+                cvFlushed.notify_all();
+                if (processed > 0)
+                    continue;
+                if (quit && enqueuePos.load(std::memory_order_acquire) == dequeuePos)
+                    return;
+                // 眠ることを知らせてから、もう一度積まれたログを確かめる
+                sleeping.store(true, std::memory_order_seq_cst);
+                cvWork.wait(lock, [this]{ return quit || flushRequested || HasPending(); });
+                sleeping.store(false, std::memory_order_relaxed);
+                flushRequested = false;
+            }
+        }
+
+        //! printf形式の書式で1行にする
+        static void Format(const Record& r, std::string& out)
+        {
+            out.clear();
+            std::size_t argIndex = 0;
+            for (const char* f = r.format; *f; ++f){
+                if (*f != '%'){
+                    out += *f;
+                    continue;
+                }
+                if (f[1] == '%'){
+                    out += '%';
+                    ++f;
+                    continue;
+                }
+
+                // フラグ・幅・精度は残し、長さ指定は引数の型に合わせて付け直す
+                std::string spec = "%";
+                const char* p = f + 1;
+                while (*p && std::strchr("-+ #0123456789.", *p))
+                    spec += *p++;
+                while (*p && std::strchr("hlLqjzt", *p))
+                    ++p;
+                if (!*p)
+                    break;
+                const char conv = *p;
+                f = p;
+
+                if (argIndex >= r.count){
+                    out += "(?)";
+                    continue;
+                }
+                FormatArg(r, r.args[argIndex++], spec, conv, out);
+            }
+        }
+
+        static void FormatArg(const Record& r, const Arg& a, std::string spec, char conv, std::string& out)
+        {
+            char buf[64];
+            const bool integerConv = std::strchr("diouxXc", conv) != nullptr;
+            switch (a.type){
+            case Arg::Type::Int:
+                if (integerConv){
+                    spec += "ll";
+                    spec += conv;
+                    std::snprintf(buf, sizeof(buf), spec.c_str(), a.i);
+                    out += buf;
+                }
+                else
+                    out += std::to_string(a.i);
+                break;
+            case Arg::Type::UInt:
+                if (integerConv){
+                    spec += "ll";
+                    spec += conv;
+                    std::snprintf(buf, sizeof(buf), spec.c_str(), a.u);
+                    out += buf;
+                }
+                else
+                    out += std::to_string(a.u);
+                break;
+            case Arg::Type::Double:
+                spec += std::strchr("fFeEgGaA", conv) ? conv : 'g';
+                std::snprintf(buf, sizeof(buf), spec.c_str(), a.d);
+                out += buf;
+                break;
+            case Arg::Type::Text:
+                out += r.text + a.text;
+                break;
+            case Arg::Type::Pointer:
+                if (integerConv){
+                    spec += "ll";
+                    spec += conv;
+                    std::snprintf(buf, sizeof(buf), spec.c_str(), static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(a.p)));
+                }
+                else
+                    std::snprintf(buf, sizeof(buf), "%p", a.p);
+                out += buf;
+                break;
+            case Arg::Type::TypeInfo:
+                out += TypeName(*a.t);
+                break;
+            }
+        }
+
+        //! 可能ならデマングルした型名
+        static std::string TypeName(const std::type_info& type)
+        {
+#if defined(__GNUG__)
+            int status = 0;
+            char* p = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+            if (p){
+                std::string result(p);
+                std::free(p);
+                return result;
+            }
+#endif
+            return type.name();
+        }
+
+        const std::size_t mask;
+        std::unique_ptr<Slot[]> slots;					//!< リングバッファ
+        std::atomic<std::size_t> enqueuePos{ 0 };		//!< 次に書き込む位置
+        std::size_t dequeuePos = 0;						//!< 次に読み出す位置（ログのスレッドのみ使う）
+        std::atomic<std::size_t> consumedPos{ 0 };		//!< 出力済みの位置
+        std::atomic<std::uint64_t> dropped{ 0 };
+
+        Sink sink;
+        std::mutex mutex;
+        std::condition_variable cvWork;
+        std::condition_variable cvFlushed;
+        std::atomic<bool> sleeping{ false };			//!< ログのスレッドが、積まれるのを待って眠っているか
+        bool flushRequested = false;
+        bool quit = false;
+        std::thread thread;								//!< 他のメンバを使うので最後に置く
+    };
+}
@@ -0,0 +1,98 @@
+﻿/*!
+*	@file
+*	@brief スレッド間のメッセージ受け渡し
+*/
+#pragma once
+#include <atomic>
+#include <utility>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief 複数のスレッドから送り、1つのスレッドでまとめて受け取るロックフリーのメールボックス
+    *
+    *	Postはどのスレッドから呼んでもよい。Receiveは受け取り側のスレッドだけが呼ぶこと。
+    *	Receiveは、その時点までに届いたメッセージを全て取り出し、届いた順に渡す。
+    *	同じスレッドから送ったメッセージは、送った順に届く。
+    */
+    template<class T>
+    class Mailbox
+    {
+    public:
+        Mailbox() NOEXCEPT {}
+        ~Mailbox()
+        {
+            Free(head.exchange(nullptr, std::memory_order_acquire));
+        }
+
+        Mailbox(const Mailbox&) = delete;
+        Mailbox& operator=(const Mailbox&) = delete;
+
+        //! メッセージを送る
+        void Post(T message)
+        {
+            Node* node = new Node{ std::move(message), head.load(std::memory_order_relaxed) };
+            while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+                ;
+        }
+
+        //! 届いているメッセージを全て取り出し、届いた順にfuncに渡す。渡した数を返す
+        /*!
+        *	funcが例外を投げた場合、残りのメッセージは破棄される。
+        */
+        template<class F>
+        std::size_t Receive(F&& func)
+        {
+            // 送られた順と逆につながっているので、反転してから渡す
+            Node* reversed = nullptr;
+            for (Node* node = head.exchange(nullptr, std::memory_order_acquire); node; ){
+                Node* const next = node->next;
+                node->next = reversed;
+                reversed = node;
+                node = next;
+            }
+
+            std::size_t count = 0;
+            while (reversed){
+                Node* const node = reversed;
+                reversed = node->next;
+                try{
+                    func(node->value);
+                }
+                catch (...){
+                    delete node;
+                    Free(reversed);
+                    throw;
+                }
+                delete node;
+                ++count;
+            }
+            return count;
+        }
+
+        //! 届いているメッセージがあるか（目安）
+        bool Empty() const NOEXCEPT { return head.load(std::memory_order_relaxed) == nullptr; }
+
+    private:
+        struct Node {
+            T value;
+            Node* next;
+        };
+
+        static void Free(Node* node) NOEXCEPT
+        {
+            while (node){
+                Node* const next = node->next;
+                delete node;
+                node = next;
+            }
+        }
+
+        std::atomic<Node*> head{ nullptr };					//!< 最後に送られたメッセージ
+    };
+}
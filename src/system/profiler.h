@@ -0,0 +1,395 @@
+﻿/*!
+*	@file
+*	@brief タスクのプロファイラ
+*/
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+#include <typeinfo>
+#include <typeindex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__GNUG__)
+#   include <cxxabi.h>
+#endif
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief タスクのExecute・Draw等の所要時間を、型別・ID別に集計するプロファイラ
+    *
+    *	計測はスレッドごとのバッファに積むだけで、集計はNextFrameでまとめて行う。
+    *	NextFrameは並列実行中でないときに呼ぶこと（TaskManagerはExecuteの先頭で呼ぶ）。
+    *	集計結果はChromeのトレース形式(chrome://tracing)のJSONか、テキストの要約として出力できる。
+    *	トレースはEnableTraceで指定した件数だけ、新しいものを残す。
+    */
+    class TaskProfiler
+    {
+    public:
+        //! 計測する処理の種類。PrepareDrawまでがタスク単位の計測
+        enum class Event : unsigned char {
+            Execute,			//!< タスクのExecute
+            Draw,				//!< タスクのDraw
+            Spawn,				//!< タスク追加時のInitialize
+            Terminate,			//!< タスクのTerminate
+            PrepareDraw,		//!< タスクのPrepareDraw
+            ManagerExecute,		//!< TaskManager::Execute全体
+            ManagerDraw,		//!< TaskManager::Draw全体
+            ExclusivePush,		//!< 排他タスクの切り替え（push）
+            ExclusivePop,		//!< 排他タスクの切り替え（pop）
+        };
+        static const std::size_t TaskEventCount = 5;
+        static const std::size_t EventCount = 9;
+        static const std::size_t HistorySize = 120;			//!< 残しておくフレームの要約の数
+
+        //! タスク単位の集計
+        struct Stats {
+            const std::type_info* type = nullptr;
+            std::uint64_t calls[TaskEventCount] = {};
+            std::int64_t totalNs[TaskEventCount] = {};
+            std::int64_t maxNs[TaskEventCount] = {};
+        };
+
+        //! 1フレーム分の要約
+        struct FrameSummary {
+            std::uint64_t frame = 0;
+            std::uint64_t calls[EventCount] = {};
+            std::int64_t totalNs[EventCount] = {};
+        };
+
+        TaskProfiler() : instance(++instanceCounter()), epoch(std::chrono::steady_clock::now()) {}
+
+        TaskProfiler(const TaskProfiler&) = delete;
+        TaskProfiler& operator=(const TaskProfiler&) = delete;
+
+        bool IsEnabled() const NOEXCEPT { return enabled.load(std::memory_order_relaxed); }
+        void SetEnabled(bool enable) NOEXCEPT { enabled.store(enable, std::memory_order_relaxed); }
+
+        //! トレースを残す件数を設定する。0で残さない
+        void EnableTrace(std::size_t capacity)
+        {
+            trace.clear();
+            trace.shrink_to_fit();
+            trace.reserve(capacity);
+            traceCapacity = capacity;
+            traceNext = 0;
+        }
+
+        //! 計測を行うスコープ
+        class Scope
+        {
+        public:
+            Scope(TaskProfiler& p, Event e) NOEXCEPT
+                : profiler(p.IsEnabled() ? &p : nullptr), event(e)
+            {
+                if (profiler)
+                    start = profiler->Now();
+            }
+            template<class T>
+            Scope(TaskProfiler& p, Event e, const T& task)
+                : profiler(p.IsEnabled() ? &p : nullptr), event(e)
+            {
+                if (profiler){
+                    type = &typeid(task);
+                    id = task.GetID();
+                    start = profiler->Now();
+                }
+            }
+            ~Scope()
+            {
+                if (profiler)
+                    profiler->Record(event, type, id, start, profiler->Now() - start);
+            }
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+        private:
+            TaskProfiler* profiler;
+            Event event;
+            const std::type_info* type = nullptr;
+            unsigned int id = 0;
+            std::int64_t start = 0;
+        };
+
+        //! 前のフレームの計測を集計し、フレームの要約を残す
+        void NextFrame()
+        {
+            FrameSummary summary;
+            summary.frame = frame++;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto&& b : buffers){
+                for (const Sample& s : b->samples){
+                    const std::size_t e = static_cast<std::size_t>(s.event);
+                    summary.calls[e]++;
+                    summary.totalNs[e] += s.duration;
+                    if (e < TaskEventCount){
+                        Accumulate(typeStats[std::type_index(*s.type)], s);
+                        if (s.id != 0)
+                            Accumulate(idStats[s.id], s);
+                    }
+                    if (traceCapacity > 0)
+                        AddTrace(TraceEvent{ s.event, s.type, s.id, b->tid, s.start, s.duration });
+                }
+                b->samples.clear();
+                dropped += b->dropped;
+                b->dropped = 0;
+            }
+
+            history.push_back(summary);
+            if (history.size() > HistorySize)
+                history.pop_front();
+        }
+
+        //! 集計結果を消す
+        void ResetStats()
+        {
+            typeStats.clear();
+            idStats.clear();
+            history.clear();
+            trace.clear();
+            traceNext = 0;
+            dropped = 0;
+        }
+
+        //! 型別の集計。Executeの合計時間の長い順
+        std::vector<Stats> GetTypeStats() const
+        {
+            std::vector<Stats> result;
+            result.reserve(typeStats.size());
+            for (auto&& s : typeStats)
+                result.push_back(s.second);
+            std::sort(result.begin(), result.end(), [](const Stats& a, const Stats& b){
+                return a.totalNs[0] > b.totalNs[0];
+            });
+            return result;
+        }
+
+        //! 型別の集計を取得。なければnullptr
+        const Stats* FindTypeStats(const std::type_info& type) const
+        {
+            const auto it = typeStats.find(std::type_index(type));
+            return it != typeStats.end() ? &it->second : nullptr;
+        }
+
+        //! ID別の集計を取得。なければnullptr
+        const Stats* FindIDStats(unsigned int id) const
+        {
+            const auto it = idStats.find(id);
+            return it != idStats.end() ? &it->second : nullptr;
+        }
+
+        const std::deque<FrameSummary>& GetFrameHistory() const NOEXCEPT { return history; }	//!< 最近のフレームの要約。古い順
+        std::uint64_t GetDroppedCount() const NOEXCEPT { return dropped; }						//!< メモリ不足で捨てた計測の数
+
+        //! Chromeのトレース形式で出力する
+        void WriteChromeTrace(std::ostream& os) const
+        {
+            os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            const std::size_t n = trace.size();
+            const std::size_t first = n < traceCapacity ? 0 : traceNext;
+            for (std::size_t k = 0; k < n; k++){
+                const TraceEvent& t = trace[(first + k) % n];
+                if (k != 0)
+                    os << ',';
+                os << "{\"name\":\"";
+                WriteEscaped(os, t.type ? TypeName(*t.type) : EventName(t.event));
+                os << "\",\"cat\":\"" << EventName(t.event)
+                    << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << t.tid
+                    << ",\"ts\":" << t.start / 1000 << '.' << Digits3(t.start % 1000)
+                    << ",\"dur\":" << t.duration / 1000 << '.' << Digits3(t.duration % 1000);
+                if (t.id != 0)
+                    os << ",\"args\":{\"id\":" << t.id << '}';
+                os << '}';
+            }
+            os << "]}";
+        }
+
+        //! 型別の集計と、直近のフレームの要約をテキストで出力する
+        void WriteSummary(std::ostream& os) const
+        {
+            if (!history.empty()){
+                const FrameSummary& f = history.back();
+                os << "frame " << f.frame << '\n';
+                for (std::size_t e = 0; e < EventCount; e++){
+                    if (f.calls[e] != 0)
+                        os << "  " << EventName(static_cast<Event>(e)) << ": " << f.calls[e] << " calls, " << f.totalNs[e] / 1000 << " us\n";
+                }
+            }
+            for (const Stats& s : GetTypeStats()){
+                os << TypeName(*s.type) << '\n';
+                for (std::size_t e = 0; e < TaskEventCount; e++){
+                    if (s.calls[e] != 0)
+                        os << "  " << EventName(static_cast<Event>(e)) << ": " << s.calls[e] << " calls, total "
+                            << s.totalNs[e] / 1000 << " us, avg " << s.totalNs[e] / static_cast<std::int64_t>(s.calls[e])
+                            << " ns, max " << s.maxNs[e] << " ns\n";
+                }
+            }
+            if (dropped != 0)
+                os << "dropped: " << dropped << '\n';
+        }
+
+        static const char* EventName(Event e) NOEXCEPT
+        {
+            static const char* const names[EventCount] = {
+                "Execute", "Draw", "Spawn", "Terminate", "PrepareDraw",
+                "TaskManager::Execute", "TaskManager::Draw", "ExclusivePush", "ExclusivePop",
+            };
+            return names[static_cast<std::size_t>(e)];
+        }
+
+        //! 可能ならデマングルした型名
+        static std::string TypeName(const std::type_info& type)
+        {
+#if defined(__GNUG__)
+            int status = 0;
+            char* p = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+            if (p){
+                std::string result(p);
+                std::free(p);
+                return result;
+            }
+#endif
+            return type.name();
+        }
+
+    private:
+        struct Sample {
+            Event event;
+            const std::type_info* type;
+            unsigned int id;
+            std::int64_t start;
+            std::int64_t duration;
+        };
+        struct TraceEvent {
+            Event event;
+            const std::type_info* type;
+            unsigned int id;
+            unsigned int tid;
+            std::int64_t start;
+            std::int64_t duration;
+        };
+        //! スレッドごとの計測バッファ
+        struct ThreadBuffer {
+            std::thread::id thread;
+            unsigned int tid;
+            std::vector<Sample> samples;
+            std::uint64_t dropped = 0;
+        };
+
+        static std::atomic<std::uint64_t>& instanceCounter() NOEXCEPT
+        {
+            static std::atomic<std::uint64_t> counter{ 0 };
+            return counter;
+        }
+
+        std::int64_t Now() const NOEXCEPT
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        void Record(Event event, const std::type_info* type, unsigned int id, std::int64_t start, std::int64_t duration) NOEXCEPT
+        {
+            ThreadBuffer* b = LocalBuffer();
+            if (!b)
+                return;
+            try{
+                b->samples.push_back(Sample{ event, type, id, start, duration });
+            }
+            catch (...){
+                b->dropped++;
+            }
+        }
+
+        //! 現在のスレッドのバッファ。プロファイラが変わったときだけ探し直す
+        ThreadBuffer* LocalBuffer() NOEXCEPT
+        {
+            struct Cache {
+                std::uint64_t instance;
+                ThreadBuffer* buffer;
+            };
+            static thread_local Cache cache = { 0, nullptr };
+            if (cache.instance == instance)
+                return cache.buffer;
+
+            try{
+                std::lock_guard<std::mutex> lock(mutex);
+                const std::thread::id self = std::this_thread::get_id();
+                auto it = std::find_if(buffers.begin(), buffers.end(), [&self](const std::unique_ptr<ThreadBuffer>& b){ return b->thread == self; });
+                if (it == buffers.end()){
+                    buffers.emplace_back(new ThreadBuffer{ self, static_cast<unsigned int>(buffers.size()), {} });
+                    it = buffers.end() - 1;
+                }
+                cache = Cache{ instance, it->get() };
+                return cache.buffer;
+            }
+            catch (...){
+                return nullptr;
+            }
+        }
+
+        static void Accumulate(Stats& stats, const Sample& s) NOEXCEPT
+        {
+            const std::size_t e = static_cast<std::size_t>(s.event);
+            stats.type = s.type;
+            stats.calls[e]++;
+            stats.totalNs[e] += s.duration;
+            stats.maxNs[e] = std::max(stats.maxNs[e], s.duration);
+        }
+
+        void AddTrace(const TraceEvent& t)
+        {
+            if (trace.size() < traceCapacity)
+                trace.push_back(t);
+            else
+                trace[traceNext] = t;
+            traceNext = (traceNext + 1) % traceCapacity;
+        }
+
+        static std::string Digits3(std::int64_t n)
+        {
+            std::string s = std::to_string(n);
+            return std::string(3 - std::min<std::size_t>(3, s.size()), '0') + s;
+        }
+
+        static void WriteEscaped(std::ostream& os, const std::string& s)
+        {
+            for (char c : s){
+                if (c == '"' || c == '\\')
+                    os << '\\';
+                os << c;
+            }
+        }
+
+        const std::uint64_t instance;						//!< スレッドごとのバッファのキャッシュを見分ける番号
+        const std::chrono::steady_clock::time_point epoch;	//!< 計測時刻の基準
+        std::atomic<bool> enabled{ true };
+
+        std::mutex mutex;									//!< buffersの追加・集計の排他
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+        std::uint64_t frame = 0;
+        std::uint64_t dropped = 0;
+        std::unordered_map<std::type_index, Stats> typeStats;
+        std::unordered_map<unsigned int, Stats> idStats;
+        std::deque<FrameSummary> history;
+
+        std::vector<TraceEvent> trace;						//!< トレースのリングバッファ
+        std::size_t traceCapacity = 0;
+        std::size_t traceNext = 0;
+    };
+}
@@ -0,0 +1,359 @@
+﻿/*!
+*	@file
+*	@brief タスクマネージャへの入力の記録と再生
+*/
+#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <unordered_map>
+#include <typeindex>
+#include <functional>
+#include <cstring>
+#include <cstdint>
+#include "task.h"
+
+namespace gtf
+{
+    //! 記録の種類
+    enum class JournalTag : unsigned char {
+        Frame,				//!< Execute。経過時間が続く
+        FrameRepeat,		//!< 前回と同じ経過時間のExecute
+        Type,				//!< 型名の定義。以降、定義順の番号で参照する
+        Add,				//!< 入力の結果としてのタスク追加
+        ExternalAdd,		//!< 外からのタスク追加（入力）
+        Terminate,			//!< タスクのTerminate
+        RemoveByID,			//!< 外からのRemoveTaskByID（入力）
+        RevertByID,			//!< 外からのRevertExclusiveTaskByID（入力）
+        Input,				//!< アプリケーションの入力データ
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief マネージャへの入力とタスクの増減を、ストリームに記録する
+    *
+    *	TaskManager::SetJournalに設定して使う。
+    *	型は最初に現れたときだけ名前を書き、整数は可変長で書くので、1フレーム数バイトで済む。
+    *	ゲームパッドの状態などアプリケーションの入力は、Inputで記録する。
+    */
+    class TaskRecorder : public TaskJournal
+    {
+    public:
+        explicit TaskRecorder(std::ostream& stream) : out(stream) {}
+        TaskRecorder(const TaskRecorder&) = delete;
+        TaskRecorder& operator=(const TaskRecorder&) = delete;
+
+        //! アプリケーションの入力データを記録する。再生時はTaskReplayer::SetInputHandlerの関数に渡される
+        void Input(const void* data, std::size_t size)
+        {
+            Put(JournalTag::Input);
+            PutVarint(size);
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        }
+
+        std::uint64_t GetFrameCount() const NOEXCEPT { return frames; }		//!< 記録したExecuteの数
+
+        void OnExecute(double elapsedTime) override
+        {
+            ++frames;
+            if (frames > 1 && std::memcmp(&elapsedTime, &lastElapsed, sizeof(double)) == 0){
+                Put(JournalTag::FrameRepeat);
+                return;
+            }
+            lastElapsed = elapsedTime;
+            Put(JournalTag::Frame);
+            out.write(reinterpret_cast<const char*>(&elapsedTime), sizeof(double));
+        }
+        void OnAdd(const TaskBase& task, bool external) override
+        {
+            PutTask(external ? JournalTag::ExternalAdd : JournalTag::Add, task);
+        }
+        void OnTerminate(const TaskBase& task) override
+        {
+            PutTask(JournalTag::Terminate, task);
+        }
+        void OnRemoveByID(unsigned int id) override
+        {
+            Put(JournalTag::RemoveByID);
+            PutVarint(id);
+        }
+        void OnRevertByID(unsigned int id) override
+        {
+            Put(JournalTag::RevertByID);
+            PutVarint(id);
+        }
+
+    private:
+        void Put(JournalTag tag)
+        {
+            out.put(static_cast<char>(tag));
+        }
+        void PutVarint(std::uint64_t value)
+        {
+            while (value >= 0x80){
+                out.put(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.put(static_cast<char>(value));
+        }
+        void PutTask(JournalTag tag, const TaskBase& task)
+        {
+            const std::type_index type(typeid(task));
+            auto it = types.find(type);
+            if (it == types.end()){
+                const char* name = type.name();
+                const std::size_t length = std::strlen(name);
+                Put(JournalTag::Type);
+                PutVarint(length);
+                out.write(name, static_cast<std::streamsize>(length));
+                it = types.emplace(type, types.size()).first;
+            }
+            Put(tag);
+            PutVarint(it->second);
+            PutVarint(task.GetID());
+        }
+
+        std::ostream& out;
+        std::unordered_map<std::type_index, std::size_t> types;	//!< 型→記録した順の番号
+        std::uint64_t frames = 0;
+        double lastElapsed = 0;
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskRecorderの記録を再生する
+    *
+    *	Executeの経過時間と外からの操作を記録どおりにマネージャに与え、その結果のタスクの増減が記録と一致するか確かめる。
+    *	Drawは呼ばず、フレームの間で待たないので、描画なしモードのマネージャと組み合わせると実時間よりずっと速く進む。
+    *	外から追加されたタスクは、型ごとにRegisterした関数で作り直す。
+    *	記録と食い違った時点で再生を止める（HasDiverged）。
+    */
+    class TaskReplayer : private TaskJournal
+    {
+    public:
+        using Factory = std::function<void(TaskManager& /* manager */, unsigned int /* id */)>;
+        using InputHandler = std::function<void(TaskManager& /* manager */, const unsigned char* /* data */, std::size_t /* size */)>;
+
+        explicit TaskReplayer(std::istream& stream) : in(stream) {}
+        TaskReplayer(const TaskReplayer&) = delete;
+        TaskReplayer& operator=(const TaskReplayer&) = delete;
+
+        //! 外から追加された型Tのタスクを作り直す関数を登録する。関数はマネージャにタスクを1つ追加すること
+        template<class T>
+        void Register(Factory factory)
+        {
+            factories[typeid(T).name()] = std::move(factory);
+        }
+        //! 型Tのタスクを引数なしで作り直す
+        template<class T>
+        void Register()
+        {
+            Register<T>([](TaskManager& manager, unsigned int){ manager.AddNewTask<T>(); });
+        }
+        //! TaskRecorder::Inputで記録したデータを受け取る関数を設定する。ここでタスクを追加・除去しないこと
+        void SetInputHandler(InputHandler handler) { inputHandler = std::move(handler); }
+
+        //! 次のExecuteまで再生する。記録の終わりに達したか、食い違ったらfalse
+        bool Step(TaskManager& manager)
+        {
+            if (ended || diverged)
+                return false;
+
+            TaskJournal* const prev = manager.GetJournal();
+            manager.SetJournal(this);
+            struct Restore {
+                TaskManager& manager;
+                TaskJournal* prev;
+                ~Restore(){ manager.SetJournal(prev); }
+            } restore{ manager, prev };
+
+            Record r;
+            for (;;){
+                if (!Read(r)){
+                    ended = true;
+                    return false;
+                }
+                switch (r.tag){
+                case JournalTag::Frame:
+                case JournalTag::FrameRepeat:
+                    manager.Execute(r.elapsed);
+                    ++frames;
+                    return !diverged;
+                case JournalTag::ExternalAdd:
+                {
+                    const auto f = factories.find(*r.type);
+                    if (f == factories.end()){
+                        Diverge("no factory for " + *r.type);
+                        return false;
+                    }
+                    expected = r.type;
+                    f->second(manager, r.id);
+                    if (expected)
+                        Diverge("factory did not add " + *r.type);
+                    break;
+                }
+                case JournalTag::RemoveByID:
+                    manager.RemoveTaskByID(r.id);
+                    break;
+                case JournalTag::RevertByID:
+                    manager.RevertExclusiveTaskByID(r.id);
+                    break;
+                case JournalTag::Input:
+                    if (inputHandler)
+                        inputHandler(manager, r.data.data(), r.data.size());
+                    break;
+                default:
+                    Diverge("missing " + Describe(r));
+                    break;
+                }
+                if (diverged)
+                    return false;
+            }
+        }
+
+        //! 最後まで再生する。再生したExecuteの数を返す
+        std::uint64_t Run(TaskManager& manager)
+        {
+            while (Step(manager))
+                ;
+            return frames;
+        }
+
+        std::uint64_t GetFrameCount() const NOEXCEPT { return frames; }		//!< 再生したExecuteの数
+        bool IsEnded() const NOEXCEPT { return ended; }						//!< 記録の終わりに達したか
+        bool HasDiverged() const NOEXCEPT { return diverged; }				//!< 記録と食い違ったか
+        const std::string& GetDivergence() const NOEXCEPT { return divergence; }	//!< 食い違いの内容
+
+    private:
+        struct Record {
+            JournalTag tag;
+            double elapsed;
+            const std::string* type;
+            unsigned int id;
+            std::vector<unsigned char> data;
+        };
+
+        bool Read(Record& r)
+        {
+            for (;;){
+                const int c = in.get();
+                if (c == std::char_traits<char>::eof())
+                    return false;
+                r.tag = static_cast<JournalTag>(c);
+                switch (r.tag){
+                case JournalTag::Frame:
+                    in.read(reinterpret_cast<char*>(&lastElapsed), sizeof(double));
+                    r.elapsed = lastElapsed;
+                    break;
+                case JournalTag::FrameRepeat:
+                    r.elapsed = lastElapsed;
+                    break;
+                case JournalTag::Type:
+                {
+                    std::string name(static_cast<std::size_t>(GetVarint()), '\0');
+                    in.read(&name[0], static_cast<std::streamsize>(name.size()));
+                    types.push_back(std::move(name));
+                    continue;
+                }
+                case JournalTag::Add:
+                case JournalTag::ExternalAdd:
+                case JournalTag::Terminate:
+                {
+                    const std::uint64_t type = GetVarint();
+                    if (type >= types.size())
+                        return false;
+                    r.type = &types[static_cast<std::size_t>(type)];
+                    r.id = static_cast<unsigned int>(GetVarint());
+                    break;
+                }
+                case JournalTag::RemoveByID:
+                case JournalTag::RevertByID:
+                    r.id = static_cast<unsigned int>(GetVarint());
+                    break;
+                case JournalTag::Input:
+                    r.data.resize(static_cast<std::size_t>(GetVarint()));
+                    in.read(reinterpret_cast<char*>(r.data.data()), static_cast<std::streamsize>(r.data.size()));
+                    break;
+                default:
+                    return false;
+                }
+                return !in.fail();
+            }
+        }
+
+        std::uint64_t GetVarint()
+        {
+            std::uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7){
+                const int c = in.get();
+                if (c == std::char_traits<char>::eof())
+                    break;
+                value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+                if ((c & 0x80) == 0)
+                    break;
+            }
+            return value;
+        }
+
+        void Diverge(std::string what)
+        {
+            if (diverged)
+                return;
+            diverged = true;
+            divergence = "frame " + std::to_string(frames) + ": " + what;
+        }
+
+        static std::string Describe(const Record& r)
+        {
+            static const char* const names[] = { "Frame", "FrameRepeat", "Type", "Add", "ExternalAdd", "Terminate", "RemoveByID", "RevertByID", "Input" };
+            std::string s = names[static_cast<int>(r.tag)];
+            if (r.tag == JournalTag::Add || r.tag == JournalTag::ExternalAdd || r.tag == JournalTag::Terminate)
+                s += " " + *r.type + " #" + std::to_string(r.id);
+            return s;
+        }
+
+        //! マネージャで起きたことが、記録の次の項目と一致するか確かめる
+        void Expect(JournalTag tag, const TaskBase& task)
+        {
+            if (diverged)
+                return;
+            Record r;
+            const char* const name = typeid(task).name();
+            if (!Read(r)){
+                Diverge(std::string("unexpected ") + (tag == JournalTag::Add ? "Add " : "Terminate ") + name);
+                return;
+            }
+            if (r.tag != tag || *r.type != name || r.id != task.GetID())
+                Diverge(Describe(r) + " expected, but " + (tag == JournalTag::Add ? "Add " : "Terminate ") + name + " #" + std::to_string(task.GetID()));
+        }
+
+        void OnExecute(double) override {}
+        void OnAdd(const TaskBase& task, bool external) override
+        {
+            if (!external){
+                Expect(JournalTag::Add, task);
+                return;
+            }
+            // Registerした関数による追加
+            if (!expected || *expected != typeid(task).name())
+                Diverge(std::string("unexpected ExternalAdd ") + typeid(task).name());
+            expected = nullptr;
+        }
+        void OnTerminate(const TaskBase& task) override { Expect(JournalTag::Terminate, task); }
+        void OnRemoveByID(unsigned int) override {}
+        void OnRevertByID(unsigned int) override {}
+
+        std::istream& in;
+        std::deque<std::string> types;						//!< 記録に現れた順の型名。追加しても要素は動かない
+        std::unordered_map<std::string, Factory> factories;	//!< 型名→作り直す関数
+        InputHandler inputHandler;
+        const std::string* expected = nullptr;				//!< Registerした関数が追加するはずの型
+        double lastElapsed = 0;
+        std::uint64_t frames = 0;
+        bool ended = false;
+        bool diverged = false;
+        std::string divergence;
+    };
+}
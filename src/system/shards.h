@@ -0,0 +1,156 @@
+﻿/*!
+*	@file
+*	@brief 複数のタスクマネージャを、それぞれ専用のスレッドで動かす
+*/
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include "task.h"
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief 独立したTaskManagerをN個、N本のスレッドで動かす
+    *
+    *	試合やAIの検証環境のような、互いに独立したシミュレーションを並列に進めるためのもの。
+    *	各マネージャは常に自分専用のスレッドでだけ実行・破棄されるので、マネージャ自身は単一スレッドのまま使える。
+    *	マネージャ間の連絡はPost（TaskManager::Post）で行う。メッセージは受け取り側の次のExecuteの先頭で、まとめて実行される。
+    *
+    *	Execute・Runは全てのマネージャの処理が終わるまで戻らない。
+    *	これらの実行中に、呼び出し元のスレッドからGetでマネージャに触らないこと（Postはよい）。
+    */
+    class TaskShards
+    {
+    public:
+        using Job = std::function<void(TaskManager& /* manager */, unsigned int /* index */)>;
+
+        explicit TaskShards(unsigned int count)
+        {
+            shards.reserve(count);
+            for (unsigned int i = 0; i < count; i++)
+                shards.emplace_back(new Shard());
+            for (unsigned int i = 0; i < count; i++)
+                shards[i]->thread = std::thread([this, i]{ ShardLoop(i); });
+        }
+
+        ~TaskShards()
+        {
+            for (auto&& s : shards){
+                {
+                    std::lock_guard<std::mutex> lock(s->mutex);
+                    s->quit = true;
+                }
+                s->cv.notify_one();
+            }
+            for (auto&& s : shards)
+                s->thread.join();
+        }
+
+        TaskShards(const TaskShards&) = delete;
+        TaskShards& operator=(const TaskShards&) = delete;
+
+        unsigned int GetCount() const NOEXCEPT { return static_cast<unsigned int>(shards.size()); }	//!< マネージャの数
+        TaskManager& Get(unsigned int index) NOEXCEPT { return shards[index]->manager; }				//!< マネージャを取得。Execute・Run中は触らないこと
+
+        //! 指定したマネージャにメッセージを送る。どのスレッドから呼んでもよい
+        void Post(unsigned int index, TaskManager::Message message)
+        {
+            shards[index]->manager.Post(std::move(message));
+        }
+
+        //! 全てのマネージャを、それぞれのスレッドでExecuteする
+        void Execute(double elapsedTime)
+        {
+            Run([elapsedTime](TaskManager& manager, unsigned int){ manager.Execute(elapsedTime); });
+        }
+
+        //! 全てのマネージャのスレッドでjobを実行し、終わるまで待つ
+        /*!
+        *	jobが例外を投げた場合、全てのスレッドの終了を待ってから、番号の小さいマネージャの例外を再送出する。
+        */
+        void Run(const Job& job)
+        {
+            if (shards.empty())
+                return;
+
+            remaining.store(static_cast<unsigned int>(shards.size()));
+            for (auto&& s : shards){
+                {
+                    std::lock_guard<std::mutex> lock(s->mutex);
+                    s->job = &job;
+                    s->error = nullptr;
+                    ++s->generation;
+                }
+                s->cv.notify_one();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(doneMutex);
+                cvDone.wait(lock, [this]{ return remaining.load() == 0; });
+            }
+            for (auto&& s : shards){
+                s->job = nullptr;
+                if (s->error){
+                    std::exception_ptr e = s->error;
+                    s->error = nullptr;
+                    std::rethrow_exception(e);
+                }
+            }
+        }
+
+    private:
+        struct Shard {
+            TaskManager manager;
+            std::thread thread;
+            std::mutex mutex;
+            std::condition_variable cv;
+            const Job* job = nullptr;				//!< 実行中の処理
+            unsigned long long generation = 0;		//!< Runされた回数
+            std::exception_ptr error;
+            bool quit = false;
+        };
+
+        void ShardLoop(unsigned int index)
+        {
+            Shard& s = *shards[index];
+            unsigned long long seen = 0;
+            for (;;){
+                const Job* job;
+                {
+                    std::unique_lock<std::mutex> lock(s.mutex);
+                    s.cv.wait(lock, [&s, seen]{ return s.quit || s.generation != seen; });
+                    if (s.quit)
+                        break;
+                    seen = s.generation;
+                    job = s.job;
+                }
+
+                try{
+                    (*job)(s.manager, index);
+                }
+                catch (...){
+                    s.error = std::current_exception();
+                }
+                if (remaining.fetch_sub(1) == 1){
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    cvDone.notify_all();
+                }
+            }
+
+            // タスクのTerminateも、このマネージャのスレッドで行う
+            s.manager.Destroy();
+        }
+
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::atomic<unsigned int> remaining{ 0 };		//!< Runで処理中のマネージャの数
+        std::mutex doneMutex;
+        std::condition_variable cvDone;
+    };
+}
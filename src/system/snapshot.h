@@ -0,0 +1,218 @@
+﻿/*!
+*	@file
+*	@brief タスクの状態のスナップショット（ロールバック用）
+*/
+#pragma once
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include "drawqueue.h"
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    class TaskBase;
+    class ExclusiveTaskBase;
+    class BackgroundTaskBase;
+    class TaskArena;
+    class TaskManager;
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskBase::SaveStateで、タスクの状態をスナップショットのバッファに書き込む
+    *
+    *	書き込んだ順にStateReaderで読み出す。ポインタのように、復元時に意味の変わる値は書かないこと。
+    */
+    class StateWriter
+    {
+    public:
+        explicit StateWriter(std::vector<unsigned char>& out) NOEXCEPT : buffer(out) {}
+
+        void Write(const void* data, std::size_t size)
+        {
+            const std::size_t pos = buffer.size();
+            buffer.resize(pos + size);
+            if (size != 0)
+                std::memcpy(buffer.data() + pos, data, size);
+        }
+
+        //! コピーしてよい型の値を書き込む
+        template<class T>
+        void Write(const T& value)
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "StateWriter::Write requires a trivially copyable type");
+            Write(&value, sizeof(T));
+        }
+
+    private:
+        std::vector<unsigned char>& buffer;
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskBase::LoadStateで、SaveStateが書き込んだ値を読み出す
+    */
+    class StateReader
+    {
+    public:
+        StateReader(const unsigned char* data, std::size_t size) NOEXCEPT : cur(data), end(data + size) {}
+
+        void Read(void* data, std::size_t size) NOEXCEPT
+        {
+            assert(static_cast<std::size_t>(end - cur) >= size);
+            if (size != 0)
+                std::memcpy(data, cur, size);
+            cur += size;
+        }
+
+        template<class T>
+        void Read(T& value) NOEXCEPT
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "StateReader::Read requires a trivially copyable type");
+            Read(&value, sizeof(T));
+        }
+        template<class T>
+        T Read() NOEXCEPT
+        {
+            T value;
+            Read(value);
+            return value;
+        }
+
+        std::size_t Remaining() const NOEXCEPT { return static_cast<std::size_t>(end - cur); }	//!< 読み残したバイト数
+
+    private:
+        const unsigned char* cur;
+        const unsigned char* end;
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskManager::SaveSnapshotで保存した、タスク全体の状態
+    *
+    *	タスクの配列・排他タスクのスタック・IDの索引・描画順と、各タスクのSaveStateの内容を持つ。
+    *	破棄されたタスクもスナップショットが持ち続けるので、LoadSnapshotで元に戻せる。
+    *	通常・常駐タスクは配列の位置でChunkSize個ずつのまとまりに分けて保存し、
+    *	直前のスナップショットから変わっていないまとまりとIDの索引は、コピーせずに共有する。
+    *	同じスナップショットに繰り返し保存すると、共有されていないまとまりの領域が使い回される。
+    *	ロールバック用に、数フレーム分を輪番で使い回すことを想定している。
+    */
+    class TaskSnapshot
+    {
+    public:
+        static const std::size_t ChunkSize = 64;	//!< 1つのまとまりに入るタスク配列の位置の数
+
+        TaskSnapshot() NOEXCEPT {}
+        TaskSnapshot(TaskSnapshot&&) NOEXCEPT = default;
+        TaskSnapshot& operator=(TaskSnapshot&&) NOEXCEPT = default;
+        TaskSnapshot(const TaskSnapshot&) = delete;
+        TaskSnapshot& operator=(const TaskSnapshot&) = delete;
+
+        bool IsEmpty() const NOEXCEPT { return !data; }														//!< まだ保存されていないか
+        std::size_t GetTaskCount() const NOEXCEPT { return data ? data->records : 0; }						//!< 保存したタスク数
+        std::size_t GetSerializedCount() const NOEXCEPT { return data ? data->serialized : 0; }				//!< そのうちSaveStateを呼んだタスク数（残りは前回の内容を使う）
+        std::size_t GetSharedCount() const NOEXCEPT { return data ? data->shared : 0; }						//!< そのうち前回のまとまりを共有したタスク数
+        std::size_t GetByteSize() const NOEXCEPT { return data ? data->bytes : 0; }							//!< タスクの状態のバイト数
+
+    private:
+        friend class TaskManager;
+
+        //! タスクごとの、マネージャが管理する値とSaveStateの位置
+        struct Record {
+            TaskBase* task;
+            std::uint64_t version;						//!< 保存時のタスクの状態の版
+            std::size_t offset;							//!< まとまりのbufferでの位置
+            std::size_t size;
+            DrawQueue::Key drawKey;
+            int drawLevel;
+            unsigned int tickInterval;
+            unsigned int tickPhase;
+            double lastTickTime;
+            bool deferrable;
+            unsigned int deferredFrames;
+            double wakeTime;
+        };
+
+        //! タスク配列のChunkSize個の位置と、そこにあるタスクの状態。保存後は変更せず、スナップショット間で共有する
+        struct Chunk {
+            std::uint64_t id = 0;						//!< 作ったときに振られる、マネージャの中で一意な番号
+            std::vector<std::shared_ptr<TaskBase>> tasks;	//!< 位置順。墓標はnullptr
+            std::vector<Record> records;				//!< tasksのうち墓標でないもの
+            std::vector<unsigned char> buffer;			//!< SaveStateの内容
+            bool volatileState = false;					//!< IsStateTrackedでないタスクを含む（毎回保存し直す）
+
+            void Clear() NOEXCEPT
+            {
+                tasks.clear();
+                records.clear();
+                buffer.clear();
+                volatileState = false;
+            }
+        };
+        using ChunkList = std::vector<std::shared_ptr<Chunk>>;
+        using IndexMap = std::unordered_map<unsigned int, std::size_t>;
+        using TickPhaseMap = std::unordered_map<unsigned int, unsigned int>;
+
+        struct ExLevel {
+            std::shared_ptr<ExclusiveTaskBase> value;
+            std::size_t SubTaskStartPos;
+            std::shared_ptr<TaskArena> arena;
+        };
+
+        struct Data {
+            std::uint64_t generation = 0;				//!< 保存ごとに振られる番号
+            ChunkList tasks;
+            ChunkList bgTasks;
+            Chunk exTasks;								//!< 排他タスク（数が少ないので毎回作る）
+            std::vector<ExLevel> exStack;
+            std::shared_ptr<ExclusiveTaskBase> exNext;
+            std::shared_ptr<const IndexMap> indices;
+            std::shared_ptr<const IndexMap> bgIndices;
+            std::size_t taskTombstones = 0;
+            std::size_t bgTaskTombstones = 0;
+            std::uint64_t tickFrame = 0;
+            double tickTime = 0;
+            std::shared_ptr<const TickPhaseMap> tickPhaseCounters;
+            std::uint64_t drawSeq = 0;
+
+            std::size_t records = 0;
+            std::size_t serialized = 0;
+            std::size_t shared = 0;
+            std::size_t bytes = 0;
+
+            //! 全てのタスクの記録を、通常・常駐・排他タスクの順にたどる
+            template<class F>
+                void ForEachRecord(F&& visit) const
+            {
+                for (auto&& c : tasks) for (auto&& r : c->records) visit(*c, r);
+                for (auto&& c : bgTasks) for (auto&& r : c->records) visit(*c, r);
+                for (auto&& r : exTasks.records) visit(exTasks, r);
+            }
+        };
+
+        //! 保存先を用意する。以前のまとまりは使い回せるようにspareへ移す
+        Data& Prepare(ChunkList& spareTasks, ChunkList& spareBgTasks)
+        {
+            if (!data)
+                data = std::make_shared<Data>();
+            spareTasks.swap(data->tasks);
+            spareBgTasks.swap(data->bgTasks);
+            data->exTasks.Clear();
+            data->exStack.clear();
+            data->records = 0;
+            data->serialized = 0;
+            data->shared = 0;
+            data->bytes = 0;
+            return *data;
+        }
+
+        std::shared_ptr<Data> data;
+    };
+}
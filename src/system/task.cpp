@@ -1,360 +1,1501 @@
-﻿
-
-/*============================================================================
-
-    タスク管理(?)
-
-==============================================================================*/
-
-#include <cassert>
-#include <algorithm>
-#include <typeinfo>
-#include "task.h"
-
-namespace gtf
-{
-    TaskManager::TaskManager()
-    {
-        // ダミーデータ挿入
-        const auto it = tasks.emplace(tasks.end(), std::make_shared<TaskBase>());
-        ex_stack.emplace_back(exNext, it);
-    }
-
-    void TaskManager::Destroy()
-    {
-        //バックグラウンドタスクTerminate
-        for(auto&& ib : bg_tasks) ib->Terminate();
-        bg_tasks.clear();
-
-        //排他タスク・通常タスクTerminate
-        while (ex_stack.size() != 0 && ex_stack.back().value){
-            CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
-            ex_stack.back().value->Terminate();
-            ex_stack.pop_back();
-        }
-        exNext = nullptr;
-    }
-
-    TaskManager::TaskPtr TaskManager::AddTaskGuaranteed(TaskBase *newTask)
-    {
-        assert(newTask);
-        assert(dynamic_cast<ExclusiveTaskBase*>(newTask) == nullptr);
-        assert(dynamic_cast<BackgroundTaskBase*>(newTask) == nullptr);
-
-        if (newTask->GetID() != 0){
-            RemoveTaskByID(newTask->GetID());
-        }
-
-        //通常タスクとしてAdd
-        tasks.emplace_back(newTask);
-        auto pnew = tasks.back();
-        newTask->Initialize();
-        if (newTask->GetID() != 0)
-            indices[newTask->GetID()] = pnew;
-        if (pnew->GetDrawPriority() >= 0)
-            ex_stack.back().drawList.emplace(pnew->GetDrawPriority(), pnew);
-        return pnew;
-    }
-
-    TaskManager::ExTaskPtr TaskManager::AddTask(ExclusiveTaskBase *newTask)
-    {
-        //排他タスクとしてAdd
-        //Execute中かもしれないので、ポインタ保存のみ
-        if (exNext){
-            auto t1 = *exNext;
-            auto t2 = *newTask;
-            OutputLog("■ALERT■ 排他タスクが2つ以上Addされた : %s / %s",
-                typeid(t1).name(), typeid(t2).name());
-        }
-        exNext = std::shared_ptr<ExclusiveTaskBase>(newTask);
-
-        return exNext;
-    }
-
-    TaskManager::BgTaskPtr TaskManager::AddTask(BackgroundTaskBase *newTask)
-    {
-        if (newTask->GetID() != 0){
-            RemoveTaskByID(newTask->GetID());
-        }
-
-        bg_tasks.emplace_back(newTask);
-
-        auto pbgt = bg_tasks.back();
-
-        //常駐タスクとしてAdd
-        pbgt->Initialize();
-        if (newTask->GetID() != 0)
-            bg_indices[newTask->GetID()] = pbgt;
-        if (pbgt->GetDrawPriority() >= 0)
-            drawListBG.emplace(pbgt->GetDrawPriority(), pbgt);
-        return pbgt;
-    }
-
-    void TaskManager::Execute(double elapsedTime)
-    {
-#ifdef ARRAYBOUNDARY_DEBUG
-        if(!AfxCheckMemory()){
-            OutputLog("AfxCheckMemory() failed");
-            return;
-        }
-#endif
-
-        //排他タスク、topのみExecute
-        assert(ex_stack.size() != 0);
-        std::shared_ptr<ExclusiveTaskBase> exTsk = ex_stack.back().value;
-
-        // 新しいタスクがある場合
-        if (exNext){
-            //現在排他タスクのInactivate
-            assert(ex_stack.size() != 0);
-            if (exTsk && !exTsk->Inactivate(exNext->GetID())){
-                //通常タスクを全て破棄する
-                CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
-
-                exTsk->Terminate();
-                ex_stack.pop_back();
-            }
-
-            //AddされたタスクをInitializeして突っ込む
-            const auto it = tasks.emplace(tasks.end(), std::make_shared<TaskBase>());				// ダミータスク挿入
-            ex_stack.emplace_back(move(exNext), it);
-            auto pnew = ex_stack.back().value;
-            if (pnew->IsFallthroughDraw()) {
-                assert(ex_stack.size() >= 2);
-                ex_stack.back().drawList = (ex_stack.rbegin() + 1)->drawList;					// 一つ下の階層のdrawListをコピー
-            }
-            pnew->Initialize();
-            if (pnew->GetDrawPriority() >= 0)
-                ex_stack.back().drawList.emplace(pnew->GetDrawPriority(), pnew);
-
-            exNext = nullptr;
-            exTsk = move(pnew);
-        }
-
-        if (exTsk)
-        {
-            bool ex_ret = true;
-#ifdef _CATCH_WHILE_EXEC
-            try{
-#endif
-                ex_ret = exTsk->Execute(elapsedTime);
-#ifdef _CATCH_WHILE_EXEC
-            }catch(...){
-                if (ex_stack.back() == NULL)OutputLog("catch while execute3 : NULL", SYSLOG_ERROR);
-                else OutputLog("catch while execute3 : %X %s",ex_stack.back(),typeid(*ex_stack.back()).name());
-            }
-#endif
-
-            if (!ex_ret)
-            {
-                if (!exNext){
-                    //現在排他タスクの変更
-
-#ifdef _CATCH_WHILE_EXEC
-                    try{
-#endif
-
-                        //通常タスクを全て破棄する
-                        CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
-
-#ifdef _CATCH_WHILE_EXEC
-                    }catch(...){
-                        if ((*i) == NULL)OutputLog("catch while terminate1 : NULL", SYSLOG_ERROR);
-                        else OutputLog("catch while terminate1 : %X %s", (*i), typeid(*(*i)).name());
-                    }
-#endif
-
-#ifdef _CATCH_WHILE_EXEC
-                    try{
-#endif
-
-                        //現在排他タスクの破棄
-                        unsigned int prvID = exTsk->GetID();
-                        exTsk->Terminate();
-                        exTsk = nullptr;
-                        ex_stack.pop_back();
-
-#ifdef _CATCH_WHILE_EXEC
-                    }catch(...){
-                        if (exTsk == NULL)OutputLog("catch while terminate2 : NULL", SYSLOG_ERROR);
-                        else OutputLog("catch while terminate : %X %s", exTsk, typeid(*exTsk).name());
-                    }
-#endif
-
-
-#ifdef _CATCH_WHILE_EXEC
-                    try{
-#endif
-
-                        //次の排他タスクをActivateする
-                        assert(ex_stack.size() != 0);
-                        exTsk = ex_stack.back().value;
-                        if (exTsk)
-                            exTsk->Activate(prvID);
-
-#ifdef _CATCH_WHILE_EXEC
-                    }catch(...){
-                        if (exTsk == NULL)OutputLog("catch while activate : NULL", SYSLOG_ERROR);
-                        else OutputLog("catch while activate : %X %s", exTsk, typeid(*exTsk).name());
-                    }
-#endif
-
-
-                    return;
-                }
-            }
-        }
-
-        //通常タスクExecute
-        assert(!ex_stack.empty());
-        taskExecute(tasks, ex_stack.back().SubTaskStartPos, tasks.end(), elapsedTime);
-
-        //常駐タスクExecute
-        taskExecute(bg_tasks, bg_tasks.begin(), bg_tasks.end(), elapsedTime);
-    }
-
-
-    void TaskManager::Draw()
-    {
-        assert(ex_stack.size() != 0);
-
-        //Drawリストを取得
-        auto iv = ex_stack.back().drawList.begin();
-        const auto iedv = ex_stack.back().drawList.end();
-        auto ivBG = drawListBG.begin();
-        const auto iedvBG = drawListBG.end();
-        auto DrawAndProceed = [](DrawPriorityMap::iterator& iv, DrawPriorityMap& drawList)
-        {
-                    auto is = iv->second.lock();
-
-                    if (is)
-                    {
-                        is->Draw();
-                        ++iv;
-                    }
-                    else
-                        drawList.erase(iv++);
-        };
-
-        //描画
-        while (iv != iedv)
-        {
-#ifdef _CATCH_WHILE_RENDER
-            try{
-#endif
-                while (ivBG != iedvBG && ivBG->first <= iv->first)
-                    DrawAndProceed(ivBG, drawListBG);
-                DrawAndProceed(iv, ex_stack.back().drawList);
-#ifdef _CATCH_WHILE_RENDER
-            }catch(...){
-                OutputLog("catch while draw : %X %s", *iv, typeid(*(*iv).lock()).name());
-            }
-#endif
-        }
-
-        // 書き残した常駐タスク処理
-        while (ivBG != iedvBG)
-            DrawAndProceed(ivBG, drawListBG);
-    }
-
-    void TaskManager::RemoveTaskByID(unsigned int id)
-    {
-        // ID比較用関数
-        const auto is_equal_to_id = [id](const auto& i){
-            return id == i->GetID();
-        };
-
-        //通常タスクをチェック
-        if (indices.count(id) != 0)
-        {
-            // 該当するIDのタスクがあったら削除
-            const auto it = std::find_if(
-                    tasks.begin(),
-                    tasks.end(), 
-                    is_equal_to_id);
-
-            if (it != tasks.end()) {
-                (*it)->Terminate();
-                tasks.erase(it);
-            }
-        }
-
-        //バックグラウンドタスクTerminate
-        if (bg_indices.count(id) != 0)
-        {
-            // 該当するIDのタスクがあったら削除
-            const auto it = std::find_if(
-                    bg_tasks.begin(),
-                    bg_tasks.end(), 
-                    is_equal_to_id);
-
-            if (it != bg_tasks.end()) {
-                (*it)->Terminate();
-                bg_tasks.erase(it);
-            }
-        }
-    }
-
-
-    //指定IDの排他タスクまでTerminate/popする
-    void TaskManager::RevertExclusiveTaskByID(unsigned int id)
-    {
-        bool act = false;
-        unsigned int previd = 0;
-
-        assert(ex_stack.size() != 0);
-        while (ex_stack.back().value){
-            const std::shared_ptr<ExclusiveTaskBase>& task = ex_stack.back().value;
-            if (task->GetID() == id){
-                if (act){
-                    task->Activate(previd);
-                }
-                return;
-            }
-            else{
-                previd = task->GetID();
-                act = true;
-                CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
-                task->Terminate();
-                ex_stack.pop_back();
-                assert(ex_stack.size() != 0);
-            }
-        }
-    }
-
-    //通常タスクを一部だけ破棄する
-    void TaskManager::CleanupPartialSubTasks(TaskList::iterator it_task)
-    {
-        for (TaskList::iterator i = it_task; i != tasks.end(); ++i){
-            (*i)->Terminate();
-        }
-        tasks.erase(it_task, tasks.end());
-    }
-
-
-    //デバッグ・タスク一覧表示
-    void TaskManager::DebugOutputTaskList()
-    {
-        OutputLog("\n\n■TaskManager::DebugOutputTaskList() - start");
-
-        OutputLog("□通常タスク一覧□");
-        //通常タスク
-        for(auto&& i : tasks) OutputLog(typeid(i).name());
-
-        OutputLog("□常駐タスク一覧□");
-        //バックグラウンドタスク
-        for(auto&& ib : bg_tasks) OutputLog(typeid(ib).name());
-
-        //排他タスク
-        OutputLog("\n");
-        OutputLog("□現在のタスク：");
-        if (ex_stack.empty())
-            OutputLog("なし");
-        else {
-            auto s_top_v = *ex_stack.back().value;
-            OutputLog(typeid(s_top_v).name());
-        }
-
-        OutputLog("\n\n■TaskManager::DebugOutputTaskList() - end\n\n");
-    }
-}
+﻿
+
+/*============================================================================
+
+    タスク管理(?)
+
+==============================================================================*/
+
+#include <cassert>
+#include <algorithm>
+#include <typeinfo>
+#include "task.h"
+
+namespace gtf
+{
+    TaskManager::TaskManager()
+    {
+        // ダミーデータ挿入
+        ex_stack.emplace_back(exNext, 0);
+    }
+
+    void TaskManager::Destroy()
+    {
+        //破棄は記録しない
+        journal = nullptr;
+
+        //Preload中の排他タスクは、終わるのを待ってから捨てる（Initializeされていないので、Terminateも呼ばない）
+        WaitPreloads();
+        preloading.clear();
+
+        //バックグラウンドタスクTerminate
+        for(auto&& ib : bg_tasks){
+            if (ib)
+                TerminateTask(*ib);
+        }
+        bg_tasks.clear();
+        bg_indices.clear();
+        bgIndicesChanged = true;
+        awakeBgValid = false;
+        drawListBG = DrawPriorityMap();
+        bgTaskTombstones = 0;
+
+        //排他タスク・通常タスクTerminate
+        while (ex_stack.size() != 0 && ex_stack.back().value){
+            GTF_PROFILE_PHASE(ExclusivePop);
+            CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
+            TerminateTask(*ex_stack.back().value);
+            PopExclusiveTask();
+        }
+        if (exNext)
+            ReleaseHandle(*exNext);
+        exNext = nullptr;
+        events.Clear();
+
+        //溜まっているログを書き出す
+        GetLogger().Flush();
+    }
+
+    TaskManager::TaskPtr TaskManager::AddTaskGuaranteed(TaskBase *newTask)
+    {
+        return AddTaskGuaranteed(std::shared_ptr<TaskBase>(newTask));
+    }
+
+    TaskManager::TaskPtr TaskManager::AddTaskGuaranteed(std::shared_ptr<TaskBase> newTask)
+    {
+        TaskPtr pnew = newTask;
+        AddNormalTask(std::move(newTask));
+        return pnew;
+    }
+
+    //通常タスクを追加する
+    void TaskManager::AddNormalTask(std::shared_ptr<TaskBase> newTask)
+    {
+        assert(newTask);
+        assert(dynamic_cast<ExclusiveTaskBase*>(newTask.get()) == nullptr);
+        assert(dynamic_cast<BackgroundTaskBase*>(newTask.get()) == nullptr);
+
+        //走査中なら同期点まで保留
+        if (IsDeferring()){
+            PushCommand(Command{ Command::Type::AddTask, std::move(newTask), 0, 0 });
+            return;
+        }
+
+        if (journal)
+            journal->OnAdd(*newTask, IsExternalCall());
+        JournalScope scope(*this);
+
+        if (newTask->GetID() != 0){
+            RemoveTaskByID(newTask->GetID());
+        }
+
+        //通常タスクとしてAdd。Initializeの中で除去されても、終わるまで破棄しない
+        const std::size_t pos = tasks.size();
+        tasks.emplace_back(std::move(newTask));
+        auto pnew = tasks.back();
+        linkChunkFlag(taskChunkChanged, *pnew, pos);
+        AcquireHandle(*pnew);
+        AssignTick(*pnew, true);
+        IndexType(*pnew);
+
+        //型別実行用の型。TypedTaskをさらに継承したクラスは仮想呼び出しで実行する
+        pnew->typeKey = &typeid(*pnew);
+        if (pnew->typedExecuteType && *pnew->typedExecuteType != *pnew->typeKey){
+            pnew->typedExecute = nullptr;
+            pnew->typedBatch = nullptr;
+        }
+        if (typeBatched){
+            if (typeBatchesValid)
+                AddToTypeBatch(pos);
+        }
+        else if (awakeValid)
+            awakeTasks.push_back(pos);
+        graphValid = false;
+
+        {
+            GTF_PROFILE_TASK(Spawn, *pnew);
+            pnew->Initialize();
+        }
+        if (pnew->GetID() != 0 && tasks[pos]){
+            indices[pnew->GetID()] = pos;
+            indicesChanged = true;
+        }
+        if (pnew->wakeTime > tickTime)			// Initializeの中で眠った
+            slept.store(true, std::memory_order_relaxed);
+        RegisterDraw(static_cast<int>(ex_stack.size()) - 1, *pnew, pnew->GetDrawPriority());
+    }
+
+    TaskManager::ExTaskPtr TaskManager::AddTask(ExclusiveTaskBase *newTask)
+    {
+        return AddTask(std::shared_ptr<ExclusiveTaskBase>(newTask));
+    }
+
+    TaskManager::ExTaskPtr TaskManager::AddTask(std::shared_ptr<ExclusiveTaskBase> newTask)
+    {
+        //走査中なら同期点まで保留
+        if (IsDeferring()){
+            ExTaskPtr pnew = newTask;
+            PushCommand(Command{ Command::Type::AddExTask, std::move(newTask), 0, 0 });
+            return pnew;
+        }
+        if (journal)
+            journal->OnAdd(*newTask, IsExternalCall());
+
+        //排他タスクとしてAdd
+        //Execute中かもしれないので、ポインタ保存のみ
+        if (exNext){
+            OutputLog("■ALERT■ 排他タスクが2つ以上Addされた : %s / %s",
+                typeid(*exNext), typeid(*newTask));
+            ReleaseHandle(*exNext);
+        }
+        exNext = std::move(newTask);
+        AcquireHandle(*exNext);
+
+        return exNext;
+    }
+
+    void TaskManager::StartPreload(std::shared_ptr<ExclusiveTaskBase> newTask)
+    {
+        assert(newTask && !newTask->preload.valid());
+
+        //Preloadが終わるまではマネージャが保持するので、生ポインタを渡してよい
+        ExclusiveTaskBase* const p = newTask.get();
+        p->preload = std::async(std::launch::async, [p]{
+            p->Preload();
+            p->SetPreloadProgress(1.0f);
+            p->preloaded.store(true, std::memory_order_release);
+        });
+
+        //走査中なら同期点まで保留
+        if (IsDeferring()){
+            PushCommand(Command{ Command::Type::PreloadExTask, std::move(newTask), 0, 0 });
+            return;
+        }
+        if (journal && IsExternalCall())
+            journal->OnAdd(*newTask, true);
+        preloading.push_back(std::move(newTask));
+    }
+
+    //Preloadの終わった排他タスクを、登録順に1つ追加する
+    void TaskManager::PromotePreloaded()
+    {
+        //1フレームに追加できる排他タスクは1つなので、他の排他タスクが追加待ちなら次のフレームに回す
+        if (exNext || preloading.empty())
+            return;
+        //記録・再生中は、追加されるフレームが変わらないよう終わるまで待つ
+        if (!journal && preloading.front()->preload.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        std::shared_ptr<ExclusiveTaskBase> ready = std::move(preloading.front());
+        preloading.pop_front();
+        ready->preload.get();		//Preloadで起きた例外はここで送出される（タスクは捨てられる）
+        AddTask(std::move(ready));
+    }
+
+    //実行中のPreloadが全て終わるまで待つ
+    void TaskManager::WaitPreloads()
+    {
+        for (auto&& p : preloading){
+            if (p->preload.valid())
+                p->preload.wait();
+        }
+        for (auto&& c : commands){
+            if (c.type == Command::Type::PreloadExTask){
+                auto& p = static_cast<ExclusiveTaskBase&>(*c.task).preload;
+                if (p.valid())
+                    p.wait();
+            }
+        }
+    }
+
+    TaskManager::BgTaskPtr TaskManager::AddTask(BackgroundTaskBase *newTask)
+    {
+        return AddTask(std::shared_ptr<BackgroundTaskBase>(newTask));
+    }
+
+    TaskManager::BgTaskPtr TaskManager::AddTask(std::shared_ptr<BackgroundTaskBase> newTask)
+    {
+        //走査中なら同期点まで保留
+        if (IsDeferring()){
+            BgTaskPtr pnew = newTask;
+            PushCommand(Command{ Command::Type::AddBgTask, std::move(newTask), 0, 0 });
+            return pnew;
+        }
+
+        if (journal)
+            journal->OnAdd(*newTask, IsExternalCall());
+        JournalScope scope(*this);
+
+        if (newTask->GetID() != 0){
+            RemoveTaskByID(newTask->GetID());
+        }
+
+        const std::size_t pos = bg_tasks.size();
+        bg_tasks.emplace_back(std::move(newTask));
+
+        auto pbgt = bg_tasks.back();
+        linkChunkFlag(bgChunkChanged, *pbgt, pos);
+        AcquireHandle(*pbgt);
+        AssignTick(*pbgt, false);
+        IndexType(*pbgt);
+        if (awakeBgValid)
+            awakeBgTasks.push_back(pos);
+
+        //常駐タスクとしてAdd
+        {
+            GTF_PROFILE_TASK(Spawn, *pbgt);
+            pbgt->Initialize();
+        }
+        if (pbgt->GetID() != 0 && bg_tasks[pos]){
+            bg_indices[pbgt->GetID()] = pos;
+            bgIndicesChanged = true;
+        }
+        if (pbgt->wakeTime > tickTime)			// Initializeの中で眠った
+            slept.store(true, std::memory_order_relaxed);
+        RegisterDraw(BgDrawLevel, *pbgt, pbgt->GetDrawPriority());
+        return pbgt;
+    }
+
+    void TaskManager::Execute(double elapsedTime)
+    {
+#ifdef ARRAYBOUNDARY_DEBUG
+        if(!AfxCheckMemory()){
+            OutputLog("AfxCheckMemory() failed");
+            return;
+        }
+#endif
+
+#ifdef GTF_PROFILE
+        profiler.NextFrame();
+#endif
+        GTF_PROFILE_PHASE(ManagerExecute);
+
+        if (journal)
+            journal->OnExecute(elapsedTime);
+        JournalScope scope(*this);
+
+        tickFrame++;
+        tickTime += elapsedTime;
+        budgetStats = BudgetStats();
+
+        //他のスレッドから届いたメッセージをまとめて実行する
+        mailbox.Receive([this](Message& message){ message(*this); });
+
+        FlushCommands();
+        PromotePreloaded();
+
+        //前のフレームで除去されたタスクの墓標を詰める
+        if (taskTombstones > 0 && taskTombstones * 4 >= tasks.size())
+            CompactTasks();
+        if (bgTaskTombstones > 0 && bgTaskTombstones * 4 >= bg_tasks.size())
+            CompactBgTasks();
+
+        //排他タスク、topのみExecute
+        assert(ex_stack.size() != 0);
+        std::shared_ptr<ExclusiveTaskBase> exTsk = ex_stack.back().value;
+
+        // 新しいタスクがある場合
+        if (exNext){
+            GTF_PROFILE_PHASE(ExclusivePush);
+
+            //現在排他タスクのInactivate
+            assert(ex_stack.size() != 0);
+            if (exTsk && !exTsk->Inactivate(exNext->GetID())){
+                //通常タスクを全て破棄する
+                CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
+
+                TerminateTask(*exTsk);
+                PopExclusiveTask();
+            }
+
+            //AddされたタスクをInitializeして突っ込む
+            ex_stack.emplace_back(move(exNext), tasks.size());
+            InvalidateSchedule();
+            auto pnew = ex_stack.back().value;
+            assert(!pnew->IsFallthroughDraw() || ex_stack.size() >= 2);
+            IndexType(*pnew);
+            {
+                GTF_PROFILE_TASK(Spawn, *pnew);
+                pnew->Initialize();
+            }
+            RegisterDraw(static_cast<int>(ex_stack.size()) - 1, *pnew, pnew->GetDrawPriority());
+
+            exNext = nullptr;
+            exTsk = move(pnew);
+        }
+
+        if (exTsk)
+        {
+            bool ex_ret = true;
+#ifdef _CATCH_WHILE_EXEC
+            try{
+#endif
+                ex_ret = executeOne(*exTsk, nullptr, elapsedTime);
+#ifdef _CATCH_WHILE_EXEC
+            }catch(...){
+                OutputLog("catch while execute3 : %p %s", exTsk.get(), typeid(*exTsk));
+            }
+#endif
+
+            if (!ex_ret)
+            {
+                if (!exNext){
+                    //現在排他タスクの変更
+                    GTF_PROFILE_PHASE(ExclusivePop);
+                    const unsigned int prvID = exTsk->GetID();
+
+#ifdef _CATCH_WHILE_EXEC
+                    try{
+#endif
+
+                        //通常タスクを全て破棄する
+                        CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
+
+#ifdef _CATCH_WHILE_EXEC
+                    }catch(...){
+                        OutputLog("catch while terminate1 : %p %s", exTsk.get(), typeid(*exTsk));
+                    }
+#endif
+
+#ifdef _CATCH_WHILE_EXEC
+                    try{
+#endif
+
+                        //現在排他タスクの破棄
+                        TerminateTask(*exTsk);
+                        exTsk = nullptr;
+                        PopExclusiveTask();
+
+#ifdef _CATCH_WHILE_EXEC
+                    }catch(...){
+                        if (!exTsk) OutputLog("catch while terminate2 : NULL");
+                        else OutputLog("catch while terminate2 : %p %s", exTsk.get(), typeid(*exTsk));
+                    }
+#endif
+
+
+#ifdef _CATCH_WHILE_EXEC
+                    try{
+#endif
+
+                        //次の排他タスクをActivateする
+                        assert(ex_stack.size() != 0);
+                        exTsk = ex_stack.back().value;
+                        if (exTsk)
+                            exTsk->Activate(prvID);
+
+#ifdef _CATCH_WHILE_EXEC
+                    }catch(...){
+                        if (!exTsk) OutputLog("catch while activate : NULL");
+                        else OutputLog("catch while activate : %p %s", exTsk.get(), typeid(*exTsk));
+                    }
+#endif
+
+
+                    return;
+                }
+            }
+        }
+
+        //通常タスクExecute
+        assert(!ex_stack.empty());
+        WakeTasks();
+        {
+            DeferScope defer(*this);
+            if (graphExecution)
+                ExecuteGraph(elapsedTime);
+            else if (typeBatched)
+                ExecuteTypeBatches(elapsedTime);
+            else
+                taskExecute(tasks, awakeTasks, elapsedTime);
+            if (budgetActive)
+                ExecuteDeferrable(elapsedTime);
+        }
+        SleepTasks();
+        FlushCommands();
+
+        //常駐タスクExecute
+        wakeAwake(bg_tasks, 0, awakeBgTasks, awakeBgValid, bgSleepers);
+        {
+            DeferScope defer(*this);
+            taskExecute(bg_tasks, awakeBgTasks, elapsedTime);
+        }
+        if (awakeBgValid && slept.exchange(false, std::memory_order_relaxed))
+            sleepIdle(bg_tasks, awakeBgTasks, bgSleepers);
+        FlushCommands();
+
+        //イベントを購読者に配る
+        {
+            DeferScope defer(*this);
+            events.Dispatch();
+        }
+        FlushCommands();
+    }
+
+
+    void TaskManager::Execute(double elapsedTime, std::chrono::steady_clock::duration budget)
+    {
+        budgetDeadline = std::chrono::steady_clock::now() + budget;
+        budgetActive = true;
+        try{
+            Execute(elapsedTime);
+        }
+        catch (...){
+            budgetActive = false;
+            deferrableTasks.clear();
+            throw;
+        }
+        budgetActive = false;
+        deferrableTasks.clear();
+    }
+
+    //予算の残っている間、持ち越せるタスクを古い順にExecuteする
+    void TaskManager::ExecuteDeferrable(double elapsedTime)
+    {
+        // 走査中に排他タスクが戻された場合は、位置が無効になっている
+        deferrableTasks.erase(std::remove_if(deferrableTasks.begin(), deferrableTasks.end(),
+            [this](std::size_t i){ return i >= tasks.size() || !tasks[i]; }), deferrableTasks.end());
+
+        // 持ち越しが続いているものを先に、あとは前回の実行が古い順
+        std::stable_sort(deferrableTasks.begin(), deferrableTasks.end(), [this](std::size_t a, std::size_t b){
+            const TaskBase& ta = *tasks[a];
+            const TaskBase& tb = *tasks[b];
+            const bool starvingA = ta.deferredFrames >= maxDeferFrames;
+            const bool starvingB = tb.deferredFrames >= maxDeferFrames;
+            if (starvingA != starvingB)
+                return starvingA;
+            return ta.lastTickTime < tb.lastTickTime;
+        });
+
+        budgetStats.candidates = deferrableTasks.size();
+        std::forward_list<std::size_t> deleteList;
+        for (std::size_t i : deferrableTasks){
+            // 前のタスクのExecute中に排他タスクが戻され、配列が縮んでいる場合がある
+            if (i >= tasks.size() || !tasks[i])
+                continue;
+            TaskBase& task = *tasks[i];
+            const bool starving = task.deferredFrames >= maxDeferFrames;
+            if (!starving && std::chrono::steady_clock::now() >= budgetDeadline){
+                task.deferredFrames++;
+                task.MarkChanged();
+                budgetStats.deferred++;
+                budgetStats.maxDeferredFrames = std::max(budgetStats.maxDeferredFrames, task.deferredFrames);
+                continue;
+            }
+
+            if (starving)
+                budgetStats.forced++;
+            budgetStats.executed++;
+            task.deferredFrames = 0;
+            if (executeOne(task, task.typedExecute, elapsedTime) == false)
+                deleteList.push_front(i);
+        }
+        deferrableTasks.clear();
+        removeFinished(tasks, deleteList);
+    }
+
+    void TaskManager::SetParallelExecution(unsigned int threadCount)
+    {
+        if (threadCount == 0)
+            workerPool.reset();
+        else if (!workerPool || workerPool->GetWorkerCount() != threadCount + 1)
+            workerPool.reset(new WorkStealingPool(threadCount));
+    }
+
+    void TaskManager::SetTypeBatchedExecution(bool enable)
+    {
+        typeBatched = enable;
+        InvalidateSchedule();
+        if (!enable){
+            typeBatches.clear();
+            typeBatchIndex.clear();
+        }
+    }
+
+    //最上位の階層の通常タスクを型ごとにまとめてExecuteする
+    void TaskManager::ExecuteTypeBatches(double elapsedTime)
+    {
+        if (!typeBatchesValid)
+            BuildTypeBatches();
+
+        // 走査中は追加が保留されるので、まとまりが変わることはない
+        std::forward_list<std::size_t> deleteList;
+        for (auto&& b : typeBatches){
+            const std::vector<std::size_t>& positions = b.positions;
+            // TypedTaskのまとまりは、型ごとの関数の中でまとめて静的に呼び出す
+            if (b.run)
+                b.run(*this, positions.data(), positions.size(), elapsedTime, deleteList);
+            else
+                executePositions(tasks, positions.size(), [&positions](std::size_t k){ return positions[k]; },
+                    VirtualExecute(), elapsedTime, deleteList);
+        }
+        removeFinished(tasks, deleteList);
+    }
+
+    //型別のまとまりを作り直す。眠っているタスクはまとまりに入れず、タイマーホイールに入れる
+    void TaskManager::BuildTypeBatches()
+    {
+        typeBatches.clear();
+        typeBatchIndex.clear();
+        typeBatchesValid = true;
+        sleepers.Reset(sleepers.TickOf(tickTime));
+        for (std::size_t i = ex_stack.back().SubTaskStartPos; i < tasks.size(); ++i){
+            if (!tasks[i])
+                continue;
+            // 眠っているタスクの型も、現れた順にまとまりを作っておく
+            if (sleepTask(sleepers, *tasks[i], i))
+                TypeBatchOf(*tasks[i]);
+            else
+                AddToTypeBatch(i);
+        }
+    }
+
+    //最上位の階層の通常タスクのうち、起きる時間になったものを実行する列に戻す
+    void TaskManager::WakeTasks()
+    {
+        // 依存グラフ実行では、眠っているタスクもグラフに残して飛ばす
+        if (graphExecution){
+            if (sleepers.Size() != 0)
+                sleepers.Reset(sleepers.TickOf(tickTime));
+            return;
+        }
+        if (!typeBatched){
+            wakeAwake(tasks, ex_stack.back().SubTaskStartPos, awakeTasks, awakeValid, sleepers);
+            return;
+        }
+        if (!typeBatchesValid){
+            BuildTypeBatches();
+            return;
+        }
+
+        // 型ごとのまとまりの後ろに足してから、まとまりごとに併合する
+        collectWoken(tasks, sleepers);
+        if (woken.empty())
+            return;
+        for (std::size_t pos : woken){
+            TypeBatch& b = typeBatches[TypeBatchOf(*tasks[pos])];
+            b.wokenFrom = std::min(b.wokenFrom, b.positions.size());
+            b.positions.push_back(pos);
+        }
+        for (auto&& b : typeBatches){
+            if (b.wokenFrom < b.positions.size())
+                mergeAwake(b.positions, b.wokenFrom);
+            b.wokenFrom = ~static_cast<std::size_t>(0);
+        }
+    }
+
+    //Executeの後で、眠った通常タスクを実行する列からタイマーホイールに移す
+    void TaskManager::SleepTasks()
+    {
+        // 誰も眠っていなければ、列はそのまま（除去されたタスクは、走査で飛ばされる）
+        if (graphExecution || !slept.exchange(false, std::memory_order_relaxed))
+            return;
+        // 走査中に排他タスクが戻された場合は、次のフレームで作り直す
+        if (typeBatched){
+            if (typeBatchesValid){
+                for (auto&& b : typeBatches)
+                    sleepIdle(tasks, b.positions, sleepers);
+            }
+        }
+        else if (awakeValid)
+            sleepIdle(tasks, awakeTasks, sleepers);
+    }
+
+    //最上位の階層の通常タスクを、依存グラフの段の順にExecuteする
+    void TaskManager::ExecuteGraph(double elapsedTime)
+    {
+        if (!graphValid)
+            BuildGraph();
+
+        // 1つのタスクのExecute。時間を計り、falseを返したらfalse
+        const auto run = [this, elapsedTime](std::size_t node) -> bool
+        {
+            // 排他タスクが戻されて配列が縮んでいる場合がある
+            const std::size_t i = graph.PositionOf(node);
+            TaskBase* const task = i < tasks.size() ? tasks[i].get() : nullptr;
+            if (!task || !IsTickDue(*task))
+                return true;
+            const auto start = std::chrono::steady_clock::now();
+            const bool alive = executeOne(*task, nullptr, elapsedTime);
+            graph.SetTime(node, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            return alive;
+        };
+
+        // 走査中は追加・除去が保留されるので、グラフが変わることはない
+        std::forward_list<std::size_t> deleteList;
+        for (std::size_t level = 0; level < graph.LevelCount(); level++){
+            const std::size_t* const nodes = graph.LevelBegin(level);
+            const std::size_t count = graph.LevelEnd(level) - nodes;
+
+            if (workerPool && count > 1){
+                // 1つ1つのタスクが重いことを想定して、1つずつ分ける
+                std::vector<std::vector<std::size_t>> removed(workerPool->GetWorkerCount());
+                parallelForDeferred(count, [&](std::size_t b, std::size_t e, unsigned int w){
+                    for (; b != e; ++b){
+                        if (!run(nodes[b]))
+                            removed[w].push_back(graph.PositionOf(nodes[b]));
+                    }
+                }, 1);
+                for (auto&& r : removed){
+                    for (std::size_t i : r)
+                        deleteList.push_front(i);
+                }
+                continue;
+            }
+
+            for (std::size_t k = 0; k < count; k++){
+#ifdef _CATCH_WHILE_EXEC
+                try{
+#endif
+                    if (!run(nodes[k]))
+                        deleteList.push_front(graph.PositionOf(nodes[k]));
+#ifdef _CATCH_WHILE_EXEC
+                }
+                catch (...){
+                    const std::size_t i = graph.PositionOf(nodes[k]);
+                    OutputLog("catch while execute1 : %p , %s", tasks[i].get(), typeid(*tasks[i]));
+                    level = graph.LevelCount();
+                    break;
+                }
+#endif
+            }
+        }
+        removeFinished(tasks, deleteList);
+        graph.FinishFrame();
+    }
+
+    void TaskManager::BuildGraph()
+    {
+        graphPositions.clear();
+        for (std::size_t i = ex_stack.back().SubTaskStartPos; i < tasks.size(); ++i){
+            if (tasks[i])
+                graphPositions.push_back(i);
+        }
+        graph.Build(graphPositions,
+            [this](std::size_t pos, TaskDependencies& deps){ return tasks[pos]->DeclareDependencies(deps); },
+            [this](std::size_t pos){ return tasks[pos]->GetID(); });
+        graphValid = true;
+        if (graph.GetStats().cyclic)
+            OutputLog("■ALERT■ タスクの依存が循環しているので、追加順にExecuteする");
+    }
+
+    //追加された通常タスクを型別のまとまりに加える
+    void TaskManager::AddToTypeBatch(std::size_t pos)
+    {
+        typeBatches[TypeBatchOf(*tasks[pos])].positions.push_back(pos);
+    }
+
+    //タスクの型のまとまりの添字。なければ作る
+    std::size_t TaskManager::TypeBatchOf(TaskBase& task)
+    {
+        const auto r = typeBatchIndex.emplace(std::type_index(*task.typeKey), typeBatches.size());
+        if (r.second)
+            typeBatches.push_back(TypeBatch{ task.typeKey, task.typedBatch, {}, ~static_cast<std::size_t>(0) });
+        return r.first->second;
+    }
+
+
+    void TaskManager::Draw()
+    {
+        assert(ex_stack.size() != 0);
+        if (headless)
+            return;
+        GTF_PROFILE_PHASE(ManagerDraw);
+        JournalScope scope(*this);
+
+        FlushCommands();
+        {
+            DeferScope defer(*this);
+            DrawTasks();
+        }
+        FlushCommands();
+    }
+
+    //描画するタスクを、常駐タスクとマージしたプライオリティ順にたどる
+    template<class F>
+    void TaskManager::VisitDrawOrder(F&& visit)
+    {
+        //Drawリストを取得。フォールスルーする階層は、下の階層のリストと描画時にマージする
+        std::vector<DrawPriorityMap::Cursor> levels;
+        for (std::size_t i = ex_stack.size() - 1; ; --i){
+            ex_stack[i].drawList.Compact();
+            levels.push_back(ex_stack[i].drawList.Begin());
+            if (i == 0 || !ex_stack[i].value->IsFallthroughDraw())
+                break;
+        }
+        drawListBG.Compact();
+        auto ivBG = drawListBG.Begin();
+
+        //プライオリティの高い順、同じなら登録順に次の項目を選ぶ
+        auto NextLevel = [&levels]() -> DrawPriorityMap::Cursor*
+        {
+            DrawPriorityMap::Cursor* next = nullptr;
+            for (auto&& iv : levels){
+                if (iv.Valid() && (!next || iv.Priority() > next->Priority() ||
+                    (iv.Priority() == next->Priority() && iv.Seq() < next->Seq())))
+                    next = &iv;
+            }
+            return next;
+        };
+        auto VisitAndProceed = [&visit](DrawPriorityMap::Cursor& iv)
+        {
+            // 直前のDrawで除去されている場合がある
+            TaskBase* const t = iv.Task();
+            iv.Next();
+            if (t)
+                visit(*t);
+        };
+
+        while (DrawPriorityMap::Cursor* iv = NextLevel())
+        {
+            while (ivBG.Valid() && ivBG.Priority() <= iv->Priority())
+                VisitAndProceed(ivBG);
+            VisitAndProceed(*iv);
+        }
+
+        // 書き残した常駐タスク処理
+        while (ivBG.Valid())
+            VisitAndProceed(ivBG);
+    }
+
+    //プライオリティ順にDrawする
+    void TaskManager::DrawTasks()
+    {
+        if (!twoPhaseDraw){
+            VisitDrawOrder([this](TaskBase& t){ DrawOne(t); });
+            return;
+        }
+
+        //描画順を確定させ、準備を済ませてから順にDrawする
+        drawOrder.clear();
+        VisitDrawOrder([this](TaskBase& t){ drawOrder.push_back(&t); });
+        PrepareDrawTasks();
+        for (TaskBase* t : drawOrder)
+            DrawOne(*t);
+    }
+
+    //1つのタスクのDraw
+    void TaskManager::DrawOne(TaskBase& task)
+    {
+#ifdef _CATCH_WHILE_RENDER
+        try{
+#endif
+            GTF_PROFILE_TASK(Draw, task);
+            task.Draw();
+#ifdef _CATCH_WHILE_RENDER
+        }catch(...){
+            // 例外を投げたタスクは飛ばして続ける
+            OutputLog("catch while draw : %p %s", &task, typeid(task));
+        }
+#endif
+    }
+
+    //drawOrderのタスクのPrepareDrawを呼ぶ
+    void TaskManager::PrepareDrawTasks()
+    {
+        if (!workerPool){
+            for (TaskBase* t : drawOrder){
+                GTF_PROFILE_TASK(PrepareDraw, *t);
+                t->PrepareDraw();
+            }
+            return;
+        }
+
+        parallelForDeferred(drawOrder.size(), [this](std::size_t b, std::size_t e, unsigned int){
+            for (; b != e; ++b){
+                GTF_PROFILE_TASK(PrepareDraw, *drawOrder[b]);
+                drawOrder[b]->PrepareDraw();
+            }
+        });
+    }
+
+    void TaskManager::RemoveTaskByID(unsigned int id)
+    {
+        //走査中なら同期点まで保留
+        if (IsDeferring()){
+            PushCommand(Command{ Command::Type::RemoveByID, nullptr, id, 0 });
+            return;
+        }
+        if (journal && IsExternalCall())
+            journal->OnRemoveByID(id);
+        JournalScope scope(*this);
+
+        //通常タスクをチェック
+        const auto it = indices.find(id);
+        if (it != indices.end())
+            RemoveTaskAt(tasks, it->second);
+
+        //バックグラウンドタスクTerminate
+        const auto ib = bg_indices.find(id);
+        if (ib != bg_indices.end())
+            RemoveTaskAt(bg_tasks, ib->second);
+    }
+
+    //通常タスクをTerminateして墓標に置き換える
+    void TaskManager::RemoveTaskAt(TaskList& list, std::size_t pos)
+    {
+        assert(&list == &tasks && list[pos]);
+        TerminateTask(*list[pos]);
+        Unindex(indices, list[pos]->GetID(), pos);
+        indicesChanged = true;
+        UnregisterDraw(*list[pos]);
+        list[pos] = nullptr;
+        ++taskTombstones;
+        graphValid = false;
+    }
+
+    //常駐タスクをTerminateして墓標に置き換える
+    void TaskManager::RemoveTaskAt(BgTaskList& list, std::size_t pos)
+    {
+        assert(&list == &bg_tasks && list[pos]);
+        TerminateTask(*list[pos]);
+        Unindex(bg_indices, list[pos]->GetID(), pos);
+        bgIndicesChanged = true;
+        UnregisterDraw(*list[pos]);
+        list[pos] = nullptr;
+        ++bgTaskTombstones;
+    }
+
+    //描画プライオリティが0以上なら描画キューに登録する
+    void TaskManager::RegisterDraw(int level, TaskBase& task, int priority)
+    {
+        task.MarkChanged();
+        task.drawLevel = level;
+        if (priority < 0)
+            return;
+        task.drawKey.priority = priority;
+        //描画なしモードでは、プライオリティだけ覚えておく（seqが0なら未登録）
+        if (headless){
+            task.drawKey.seq = 0;
+            return;
+        }
+        task.drawKey.seq = ++drawSeq;
+        DrawListOf(level).Add(task.drawKey, &task);
+    }
+
+    //描画キューから外す
+    void TaskManager::UnregisterDraw(TaskBase& task)
+    {
+        task.MarkChanged();
+        if (task.drawKey.priority >= 0 && task.drawKey.seq != 0)
+            DrawListOf(task.drawLevel).Remove(task.drawKey);
+        task.drawKey = DrawQueue::Key();
+        task.drawLevel = -1;
+    }
+
+    //描画なしモードの切り替え
+    void TaskManager::SetHeadless(bool enable)
+    {
+        assert(!IsDeferring());
+        if (headless == enable)
+            return;
+        headless = enable;
+        if (!enable){
+            RebuildDrawLists();
+            return;
+        }
+
+        for (auto&& e : ex_stack){
+            e.drawList.Clear();
+            if (e.value)
+                e.value->drawKey.seq = 0;
+        }
+        drawListBG.Clear();
+        const auto clear = [](TaskBase& task){
+            task.drawKey.seq = 0;
+            task.MarkChanged();
+        };
+        for (auto&& t : tasks) if (t) clear(*t);
+        for (auto&& t : bg_tasks) if (t) clear(*t);
+    }
+
+    //登録されているタスクを、全て描画キューに登録し直す
+    void TaskManager::RebuildDrawLists()
+    {
+        for (auto&& e : ex_stack)
+            e.drawList.Clear();
+        drawListBG.Clear();
+
+        //各階層では、排他タスクが先、通常タスクが追加順になる
+        const auto add = [this](TaskBase& task){
+            if (task.drawLevel == -1 || task.drawKey.priority < 0)
+                return;
+            task.drawKey.seq = ++drawSeq;
+            task.MarkChanged();
+            DrawListOf(task.drawLevel).Add(task.drawKey, &task);
+        };
+        for (auto&& e : ex_stack) if (e.value) add(*e.value);
+        for (auto&& t : tasks) if (t) add(*t);
+        for (auto&& t : bg_tasks) if (t) add(*t);
+    }
+
+    //描画プライオリティの変更
+    void TaskManager::SetDrawPriority(const TaskPtr& task, int priority)
+    {
+        PushCommand(Command{ Command::Type::SetDrawPriority, task.lock(), 0, priority });
+    }
+    void TaskManager::SetDrawPriority(const TaskRef& task, int priority)
+    {
+        PushCommand(Command{ Command::Type::SetDrawPriority, nullptr, 0, priority, task });
+    }
+
+    //眠っているタスクを起こす
+    void TaskManager::WakeTask(const TaskPtr& task)
+    {
+        PushCommand(Command{ Command::Type::WakeTask, task.lock(), 0, 0 });
+    }
+    void TaskManager::WakeTask(const TaskRef& task)
+    {
+        PushCommand(Command{ Command::Type::WakeTask, nullptr, 0, 0, task });
+    }
+
+    //眠っているタスクを起こす。タイマーホイールにあれば、次のフレームの先頭で実行する列に戻る
+    void TaskManager::ApplyWake(TaskBase& task)
+    {
+        if (task.terminated)
+            return;
+        task.CancelWait();
+        task.wakeTime = 0;
+        task.MarkChanged();
+        if (task.cold && task.cold->sleepLink.wheel)
+            task.cold->sleepLink.wheel->Wake(task.cold->sleepLink);
+    }
+
+    //描画プライオリティの変更を反映する
+    void TaskManager::ApplyDrawPriority(TaskBase& task, int priority)
+    {
+        if (task.drawLevel == -1)		// 既に除去されている
+            return;
+        if (task.drawKey.priority == priority)
+            return;
+
+        const int level = task.drawLevel;
+        UnregisterDraw(task);
+        RegisterDraw(level, task, priority);
+    }
+
+    //保留する操作を記録する
+    void TaskManager::PushCommand(Command&& command)
+    {
+        WorkerCommandTarget& target = workerCommandTarget();
+        if (target.owner == this)
+            target.buffer->push_back(std::move(command));
+        else
+            commands.push_back(std::move(command));
+    }
+
+    //保留している操作を記録順に反映する
+    void TaskManager::FlushCommands()
+    {
+        assert(!IsDeferring());
+
+        // 反映中に記録された操作も続けて処理する
+        for (std::size_t i = 0; i < commands.size(); i++){
+            Command c = std::move(commands[i]);
+            switch (c.type){
+            case Command::Type::AddTask:
+                AddNormalTask(std::move(c.task));
+                break;
+            case Command::Type::AddBgTask:
+                AddTask(std::static_pointer_cast<BackgroundTaskBase>(std::move(c.task)));
+                break;
+            case Command::Type::AddExTask:
+                AddTask(std::static_pointer_cast<ExclusiveTaskBase>(std::move(c.task)));
+                break;
+            case Command::Type::PreloadExTask:
+                preloading.push_back(std::static_pointer_cast<ExclusiveTaskBase>(std::move(c.task)));
+                break;
+            case Command::Type::RemoveByID:
+                RemoveTaskByID(c.id);
+                break;
+            case Command::Type::RevertExTask:
+                RevertExclusiveTaskByID(c.id);
+                break;
+            case Command::Type::SetDrawPriority:
+                if (c.task)
+                    ApplyDrawPriority(*c.task, c.priority);
+                else if (TaskBase* const t = c.handle.lock())
+                    ApplyDrawPriority(*t, c.priority);
+                break;
+            case Command::Type::WakeTask:
+                if (c.task)
+                    ApplyWake(*c.task);
+                else if (TaskBase* const t = c.handle.lock())
+                    ApplyWake(*t);
+                break;
+            }
+        }
+        commands.clear();
+    }
+
+    //タスクのTerminate。終了を待っているタスクを起こす
+    void TaskManager::TerminateTask(TaskBase& task)
+    {
+        if (journal)
+            journal->OnTerminate(task);
+        task.CancelWait();
+        task.CancelSleep();
+        UnindexType(task);
+        {
+            GTF_PROFILE_TASK(Terminate, task);
+            task.Terminate();
+        }
+        task.terminated = true;
+        ReleaseHandle(task);
+        task.WakeWaiters();
+        if (task.subscribed){
+            events.RemoveOwner(&task);
+            task.subscribed = false;
+        }
+        // 外れた位置のまとまりは変わる。この後は印をつけない
+        task.MarkChanged();
+        task.changeFlag = nullptr;
+    }
+
+    //Terminateを呼ばずにマネージャから切り離す
+    void TaskManager::DetachTask(TaskBase& task)
+    {
+        task.CancelWait();
+        task.CancelSleep();
+        UnindexType(task);
+        ReleaseHandle(task);
+        task.WakeWaiters();
+        if (task.subscribed){
+            events.RemoveOwner(&task);
+            task.subscribed = false;
+        }
+        task.drawKey = DrawQueue::Key();
+        task.drawLevel = -1;
+        task.changeFlag = nullptr;
+    }
+
+    //現在のタスクの状態をスナップショットに保存する
+    void TaskManager::SaveSnapshot(TaskSnapshot& snapshot)
+    {
+        assert(!IsDeferring());
+        FlushCommands();
+
+        // 直前のスナップショットから変わっていない部分は、そのまま共有する
+        const std::shared_ptr<const TaskSnapshot::Data> base = lastSnapshot.lock();
+        if (snapshot.data == base)
+            snapshot.data = nullptr;		// 直前の内容を使うので、上書きせずに作り直す
+        TaskSnapshot::ChunkList spareTasks, spareBgTasks;
+        TaskSnapshot::Data& d = snapshot.Prepare(spareTasks, spareBgTasks);
+
+        d.generation = ++snapshotGeneration;
+        for (auto&& e : ex_stack)
+            d.exStack.push_back(TaskSnapshot::ExLevel{ e.value, e.SubTaskStartPos, e.arena });
+        d.exNext = exNext;
+        d.indices = (base && !indicesChanged) ? base->indices : std::make_shared<const TaskSnapshot::IndexMap>(indices);
+        d.bgIndices = (base && !bgIndicesChanged) ? base->bgIndices : std::make_shared<const TaskSnapshot::IndexMap>(bg_indices);
+        d.taskTombstones = taskTombstones;
+        d.bgTaskTombstones = bgTaskTombstones;
+        d.tickFrame = tickFrame;
+        d.tickTime = tickTime;
+        d.tickPhaseCounters = (base && !tickPhaseChanged) ? base->tickPhaseCounters : std::make_shared<const TaskSnapshot::TickPhaseMap>(tickPhaseCounters);
+        d.drawSeq = drawSeq;
+
+        saveChunks(d, d.tasks, spareTasks, base ? &base->tasks : nullptr, tasks, taskChunkChanged);
+        saveChunks(d, d.bgTasks, spareBgTasks, base ? &base->bgTasks : nullptr, bg_tasks, bgChunkChanged);
+        d.exTasks.id = ++snapshotChunkSerial;
+        for (auto&& e : ex_stack) if (e.value) saveRecord(d, d.exTasks, base ? &base->exTasks : nullptr, *e.value);
+
+        indicesChanged = false;
+        bgIndicesChanged = false;
+        tickPhaseChanged = false;
+        lastSnapshot = snapshot.data;
+    }
+
+    //タスク配列を、変わったまとまりだけ作り直して保存する
+    template<class List>
+    void TaskManager::saveChunks(TaskSnapshot::Data& d, TaskSnapshot::ChunkList& out, TaskSnapshot::ChunkList& spare,
+        const TaskSnapshot::ChunkList* base, const List& list, ChunkFlags& flags)
+    {
+        const std::size_t chunkSize = TaskSnapshot::ChunkSize;
+        out.resize((list.size() + chunkSize - 1) / chunkSize);
+        for (std::size_t k = 0; k < out.size(); k++){
+            std::atomic<bool>& changed = chunkFlag(flags, k * chunkSize);
+            const TaskSnapshot::Chunk* from = (base && k < base->size()) ? (*base)[k].get() : nullptr;
+            if (from && !from->volatileState && !changed.load(std::memory_order_relaxed)){
+                out[k] = (*base)[k];
+                d.records += from->records.size();
+                d.shared += from->records.size();
+                d.bytes += from->buffer.size();
+                continue;
+            }
+            changed.store(false, std::memory_order_relaxed);
+
+            // 他のスナップショットと共有していなければ、以前のまとまりの領域を使い回す
+            std::shared_ptr<TaskSnapshot::Chunk> chunk;
+            if (k < spare.size() && spare[k].use_count() == 1){
+                chunk = std::move(spare[k]);
+                chunk->Clear();
+            }
+            else
+                chunk = std::make_shared<TaskSnapshot::Chunk>();
+            chunk->id = ++snapshotChunkSerial;
+            const std::size_t end = std::min(list.size(), (k + 1) * chunkSize);
+            for (std::size_t pos = k * chunkSize; pos < end; pos++){
+                chunk->tasks.push_back(list[pos]);
+                if (list[pos])
+                    saveRecord(d, *chunk, from, *list[pos]);
+            }
+            out[k] = std::move(chunk);
+        }
+    }
+
+    //1つのタスクをまとまりに保存する。baseに状態の変わっていない内容があればコピーする
+    void TaskManager::saveRecord(TaskSnapshot::Data& d, TaskSnapshot::Chunk& chunk, const TaskSnapshot::Chunk* base, TaskBase& task)
+    {
+        TaskSnapshot::Record r;
+        r.task = &task;
+        r.version = task.stateVersion;
+        r.offset = chunk.buffer.size();
+        r.drawKey = task.drawKey;
+        r.drawLevel = task.drawLevel;
+        r.lastTickTime = task.lastTickTime;
+        r.deferredFrames = task.deferredFrames;
+        r.wakeTime = task.wakeTime;
+
+        TaskBase::ColdState& cold = task.Cold();
+        const bool tracked = task.IsStateTracked();
+        if (base && tracked && cold.savedChunk == base->id && cold.savedVersion == task.stateVersion){
+            const auto from = base->buffer.begin() + cold.savedOffset;
+            chunk.buffer.insert(chunk.buffer.end(), from, from + cold.savedSize);
+        }
+        else{
+            StateWriter out(chunk.buffer);
+            task.SaveState(out);
+            ++d.serialized;
+        }
+        r.size = chunk.buffer.size() - r.offset;
+        chunk.volatileState |= !tracked;
+
+        cold.savedVersion = task.stateVersion;
+        cold.savedChunk = chunk.id;
+        cold.savedOffset = r.offset;
+        cold.savedSize = r.size;
+        chunk.records.push_back(r);
+        ++d.records;
+        d.bytes += r.size;
+    }
+
+    //スナップショットの状態に戻す
+    std::size_t TaskManager::LoadSnapshot(const TaskSnapshot& snapshot)
+    {
+        assert(!IsDeferring());
+        assert(!snapshot.IsEmpty());
+        const TaskSnapshot::Data& d = *snapshot.data;
+        commands.clear();
+
+        // スナップショットにあるタスクに印をつけ、ないタスクを切り離す
+        d.ForEachRecord([&d](const TaskSnapshot::Chunk&, const TaskSnapshot::Record& r){
+            r.task->Cold().savedGeneration = d.generation;
+        });
+        const auto detach = [this, &d](TaskBase& task){
+            UnindexType(task);
+            if (task.Cold().savedGeneration != d.generation)
+                DetachTask(task);
+        };
+        for (auto&& t : tasks) if (t) detach(*t);
+        for (auto&& t : bg_tasks) if (t) detach(*t);
+        for (auto&& e : ex_stack) if (e.value) detach(*e.value);
+
+        tasks.clear();
+        for (auto&& c : d.tasks)
+            tasks.insert(tasks.end(), c->tasks.begin(), c->tasks.end());
+        bg_tasks.clear();
+        for (auto&& c : d.bgTasks)
+            for (auto&& t : c->tasks)
+                bg_tasks.push_back(std::static_pointer_cast<BackgroundTaskBase>(t));
+        // 戻した後は、このスナップショットから変わっていない
+        for (std::size_t pos = 0; pos < tasks.size(); pos++)
+            if (tasks[pos]) tasks[pos]->changeFlag = &chunkFlag(taskChunkChanged, pos);
+        for (std::size_t pos = 0; pos < bg_tasks.size(); pos++)
+            if (bg_tasks[pos]) bg_tasks[pos]->changeFlag = &chunkFlag(bgChunkChanged, pos);
+        for (auto&& flag : taskChunkChanged) flag.store(false, std::memory_order_relaxed);
+        for (auto&& flag : bgChunkChanged) flag.store(false, std::memory_order_relaxed);
+
+        // 階層が変わっていなければ、描画キューの領域を使い回す
+        bool sameLevels = ex_stack.size() == d.exStack.size();
+        for (std::size_t i = 0; sameLevels && i < ex_stack.size(); i++)
+            sameLevels = ex_stack[i].value == d.exStack[i].value;
+        if (sameLevels){
+            for (std::size_t i = 0; i < ex_stack.size(); i++){
+                ex_stack[i].SubTaskStartPos = d.exStack[i].SubTaskStartPos;
+                ex_stack[i].arena = d.exStack[i].arena;
+                ex_stack[i].drawList.Clear();
+            }
+        }
+        else{
+            ex_stack.clear();
+            for (auto&& e : d.exStack){
+                ex_stack.emplace_back(std::shared_ptr<ExclusiveTaskBase>(e.value), e.SubTaskStartPos);
+                ex_stack.back().arena = e.arena;
+            }
+        }
+        drawListBG.Clear();
+        if (exNext && exNext != d.exNext)
+            ReleaseHandle(*exNext);
+        exNext = d.exNext;
+        if (exNext)
+            AcquireHandle(*exNext);
+        indices = *d.indices;
+        bg_indices = *d.bgIndices;
+        taskTombstones = d.taskTombstones;
+        bgTaskTombstones = d.bgTaskTombstones;
+        tickFrame = d.tickFrame;
+        tickTime = d.tickTime;
+        tickPhaseCounters = *d.tickPhaseCounters;
+        drawSeq = d.drawSeq;
+        indicesChanged = false;
+        bgIndicesChanged = false;
+        tickPhaseChanged = false;
+
+        std::size_t loaded = 0;
+        d.ForEachRecord([this, &loaded](const TaskSnapshot::Chunk& chunk, const TaskSnapshot::Record& r){
+            TaskBase& task = *r.task;
+            // 版は減らないので、一致すれば保存後に状態は変わっていない
+            const bool changed = task.terminated || !task.IsStateTracked() || task.stateVersion != r.version;
+            task.terminated = false;
+            task.drawKey = r.drawKey;
+            task.drawLevel = r.drawLevel;
+            task.lastTickTime = r.lastTickTime;
+            task.deferredFrames = r.deferredFrames;
+            task.wakeTime = r.wakeTime;
+            if (changed){
+                StateReader in(chunk.buffer.data() + r.offset, r.size);
+                task.LoadState(in);
+                // 戻した状態に、これまで使われていない版を振る。まとまりの記録の版も新しくする
+                ++task.stateVersion;
+                task.MarkChanged();
+                ++loaded;
+            }
+            AcquireHandle(task);
+            TaskBase::ColdState& cold = *task.cold;
+            cold.savedVersion = task.stateVersion;
+            cold.savedChunk = chunk.id;
+            cold.savedOffset = r.offset;
+            cold.savedSize = r.size;
+            IndexType(task);
+        });
+
+        // 描画キューは、登録順に積み直す
+        drawOrder.clear();
+        bool unordered = false;				// 描画なしモードで保存されたタスクがある
+        d.ForEachRecord([this, &unordered](const TaskSnapshot::Chunk&, const TaskSnapshot::Record& r){
+            if (r.drawKey.priority < 0)
+                return;
+            if (headless){
+                r.task->drawKey.seq = 0;
+                r.task->MarkChanged();
+            }
+            else{
+                drawOrder.push_back(r.task);
+                unordered |= r.drawKey.seq == 0;
+            }
+        });
+        if (unordered)
+            RebuildDrawLists();
+        else{
+            std::sort(drawOrder.begin(), drawOrder.end(),
+                [](const TaskBase* a, const TaskBase* b){ return a->drawKey.seq < b->drawKey.seq; });
+            for (TaskBase* task : drawOrder)
+                DrawListOf(task->drawLevel).Add(task->drawKey, task);
+        }
+        drawOrder.clear();
+
+        InvalidateSchedule();
+        awakeBgValid = false;
+        lastSnapshot = snapshot.data;
+        return loaded;
+    }
+
+    //型別の索引に加える
+    void TaskManager::IndexType(TaskBase& task)
+    {
+        if (task.typeSlot == TypeSlot<TaskBase>::None)
+            return;
+        if (task.typeSlot >= typeIndex.size())
+            typeIndex.resize(task.typeSlot + 1);
+        auto& list = typeIndex[task.typeSlot];
+        task.typeIndexPos = list.size();
+        list.push_back(&task);
+    }
+
+    //型別の索引から外す。最後のタスクを空いた位置に移す
+    void TaskManager::UnindexType(TaskBase& task) NOEXCEPT
+    {
+        if (task.typeIndexPos == TypeSlot<TaskBase>::None)
+            return;
+        auto& list = typeIndex[task.typeSlot];
+        list[task.typeIndexPos] = list.back();
+        list[task.typeIndexPos]->typeIndexPos = task.typeIndexPos;
+        list.pop_back();
+        task.typeIndexPos = TypeSlot<TaskBase>::None;
+    }
+
+    //追加されたタスクに、Executeする間隔とフレームを割り当てる
+    void TaskManager::AssignTick(TaskBase& task, bool allowDefer)
+    {
+        task.tickInterval = std::max(1u, task.GetTickInterval());
+        task.tickPhase = 0;
+        if (task.tickInterval > 1){
+            task.tickPhase = tickPhaseCounters[task.tickInterval]++ % task.tickInterval;
+            tickPhaseChanged = true;
+        }
+        task.lastTickTime = tickTime;
+        task.deferrable = allowDefer && task.IsDeferrable();
+        task.deferredFrames = 0;
+    }
+
+    //最上位の排他タスクの階層をpopする
+    void TaskManager::PopExclusiveTask()
+    {
+        assert(ex_stack.back().value);
+        ex_stack.back().value->drawKey = DrawQueue::Key();
+        ex_stack.back().value->drawLevel = -1;
+        ex_stack.pop_back();
+        InvalidateSchedule();
+    }
+
+
+    //指定IDの排他タスクまでTerminate/popする
+    void TaskManager::RevertExclusiveTaskByID(unsigned int id)
+    {
+        //走査中なら同期点まで保留（走査中のタスクや配列を破棄しないように）
+        if (IsDeferring()){
+            PushCommand(Command{ Command::Type::RevertExTask, nullptr, id, 0 });
+            return;
+        }
+
+        bool act = false;
+        unsigned int previd = 0;
+
+        if (journal && IsExternalCall())
+            journal->OnRevertByID(id);
+        JournalScope scope(*this);
+
+        assert(ex_stack.size() != 0);
+        while (ex_stack.back().value){
+            const std::shared_ptr<ExclusiveTaskBase>& task = ex_stack.back().value;
+            if (task->GetID() == id){
+                if (act){
+                    task->Activate(previd);
+                }
+                return;
+            }
+            else{
+                GTF_PROFILE_PHASE(ExclusivePop);
+                previd = task->GetID();
+                act = true;
+                CleanupPartialSubTasks(ex_stack.back().SubTaskStartPos);
+                TerminateTask(*task);
+                PopExclusiveTask();
+                assert(ex_stack.size() != 0);
+            }
+        }
+    }
+
+    //通常タスクを一部だけ破棄する
+    void TaskManager::CleanupPartialSubTasks(std::size_t startPos)
+    {
+        // 呼ばれるのは最上位の階層をpopする直前なので、その階層のアリーナはもう再利用しない
+        assert(startPos == ex_stack.back().SubTaskStartPos);
+        if (ex_stack.back().arena)
+            ex_stack.back().arena->Retire();
+
+        // 墓標だけが切り落とされても、まとまりは変わる
+        markTruncated(taskChunkChanged, startPos, tasks.size());
+
+        // Terminate中に追加されたタスクも対象
+        for (std::size_t i = startPos; i < tasks.size(); ++i){
+            if (tasks[i]){
+                TerminateTask(*tasks[i]);
+                Unindex(indices, tasks[i]->GetID(), i);
+                indicesChanged = true;
+                UnregisterDraw(*tasks[i]);
+            }
+            else
+                --taskTombstones;
+        }
+        tasks.erase(tasks.begin() + startPos, tasks.end());
+        InvalidateSchedule();
+    }
+
+    //墓標を取り除いてタスク配列を詰める
+    void TaskManager::CompactTasks()
+    {
+        auto level = ex_stack.begin();
+        std::size_t dst = 0;
+        for (std::size_t src = 0; src < tasks.size(); ++src){
+            // ここから始まる階層の開始位置を、詰めた後の位置に合わせる
+            for (; level != ex_stack.end() && level->SubTaskStartPos <= src; ++level)
+                level->SubTaskStartPos = dst;
+
+            if (tasks[src]){
+                if (dst != src){
+                    tasks[dst] = std::move(tasks[src]);
+                    MoveIndex(indices, tasks[dst]->GetID(), src, dst);
+                    linkChunkFlag(taskChunkChanged, *tasks[dst], dst);
+                }
+                ++dst;
+            }
+        }
+        for (; level != ex_stack.end(); ++level)
+            level->SubTaskStartPos = dst;
+
+        markTruncated(taskChunkChanged, dst, tasks.size());
+        indicesChanged = true;
+        tasks.resize(dst);
+        taskTombstones = 0;
+        InvalidateSchedule();
+    }
+
+    //墓標を取り除いて常駐タスク配列を詰める
+    void TaskManager::CompactBgTasks()
+    {
+        std::size_t dst = 0;
+        for (std::size_t src = 0; src < bg_tasks.size(); ++src){
+            if (bg_tasks[src]){
+                if (dst != src){
+                    bg_tasks[dst] = std::move(bg_tasks[src]);
+                    MoveIndex(bg_indices, bg_tasks[dst]->GetID(), src, dst);
+                    linkChunkFlag(bgChunkChanged, *bg_tasks[dst], dst);
+                }
+                ++dst;
+            }
+        }
+
+        markTruncated(bgChunkChanged, dst, bg_tasks.size());
+        bgIndicesChanged = true;
+        bg_tasks.resize(dst);
+        bgTaskTombstones = 0;
+        awakeBgValid = false;
+    }
+
+
+    //デバッグ・タスク一覧表示
+    void TaskManager::DebugOutputTaskList()
+    {
+        OutputLog("\n\n■TaskManager::DebugOutputTaskList() - start");
+
+        OutputLog("□通常タスク一覧□");
+        //通常タスク
+        for(auto&& i : tasks) if (i) OutputLog("%s", typeid(*i));
+
+        OutputLog("□常駐タスク一覧□");
+        //バックグラウンドタスク
+        for(auto&& ib : bg_tasks) if (ib) OutputLog("%s", typeid(*ib));
+
+        //排他タスク
+        OutputLog("\n");
+        OutputLog("□現在のタスク：");
+        if (ex_stack.empty() || !ex_stack.back().value)
+            OutputLog("なし");
+        else
+            OutputLog("%s", typeid(*ex_stack.back().value));
+
+        OutputLog("\n\n■TaskManager::DebugOutputTaskList() - end\n\n");
+    }
+}
@@ -1,295 +1,1322 @@
-﻿/*!
-*	@file
-*	@brief タスク(?)管理・定義
-*/
-#pragma once
-#include <vector>
-#include <deque>
-#include <string>
-#include <map>
-#include <forward_list>
-#include <list>
-#include <unordered_map>
-#include <memory>
-#include <functional>
-#include <type_traits>
-#include <utility>
-
-#ifdef __clang__
-#   if !__has_feature(cxx_noexcept)
-#       define NOEXCEPT
-#   else
-#       define NOEXCEPT noexcept
-#   endif
-#elif (defined(_MSC_FULL_VER) && _MSC_FULL_VER < 190023026) || (defined(__GNUC__) && (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 6) || !defined(__GXX_EXPERIMENTAL_CXX0X__)))
-#define NOEXCEPT
-#else
-#define NOEXCEPT noexcept
-#endif
-
-/*!
-*	@defgroup Tasks
-*	@brief タスク
-*
-*	TaskBaseを継承したクラスは、メインループから呼ばれる更新・描画処理関数を持っています。
-*	システムはこのクラスのリストを持っています。
-*	タイトル・キャラセレ・試合 などのゲームの状態の変更は、
-*	これらタスククラスの切り替えによって行われます。
-*/
-
-namespace gtf
-{
-    /*!
-    *	@ingroup Tasks
-    *	@brief	基本タスク
-    *
-    *	・Executeでfalseを返すと破棄される
-    *	・親の排他タスクが変更されたとき、破棄される
-    */
-    class TaskBase
-    {
-    public:
-        virtual ~TaskBase(){}
-        virtual void Initialize(){}							//!< ExecuteまたはDrawがコールされる前に1度だけコールされる
-        virtual bool Execute(double /* elapsedTime */)
-                            {return(true);}					//!< 毎フレームコールされる
-        virtual void Terminate(){}							//!< タスクのリストから外されるときにコールされる（その直後、deleteされる）
-        virtual void Draw(){}								//!< 描画時にコールされる
-        virtual unsigned int GetID() const { return 0; }	//!< 0以外を返すようにした場合、マネージャに同じIDを持つタスクがAddされたとき破棄される
-        virtual int GetDrawPriority() const { return -1; }	//!< 描画プライオリティ。低いほど後順に（手前に）Draw処理。マイナスならば表示しない
-    };
-
-
-    /*!
-    *	@ingroup Tasks
-    *	@brief 排他タスク? =ゲームのシーンと考えてください。
-    *
-    *	・他の排他タスクと一緒には動作(Execute)しない
-    *	・他の排他タスクが追加された場合、Inactivateがコールされ、そこでfalseを返すと
-    *		破棄される。trueを返すとExecute、WndMessageがコールされない状態になり、
-    *		新規の排他タスクが全て破棄されたときにActivateが呼ばれ、処理が再開する。
-    *	・通常タスクとの親子関係を持つ。
-    *	・AddTask実行後、一度Executeが実行されるまで追加が保留される。その後に追加された通常タスクは子タスクとなる。
-    */
-    class ExclusiveTaskBase : public TaskBase
-    {
-    public:
-        explicit ExclusiveTaskBase(bool fallthroughDraw = false) NOEXCEPT : isFallthroughDraw(fallthroughDraw) {}
-        virtual ~ExclusiveTaskBase(){}
-        virtual void Activate(unsigned int /* prvTaskID */){}				//!< Executeが再開されるときに呼ばれる
-        virtual bool Inactivate(unsigned int /* nextTaskID */){return true;}//!< 他の排他タスクが開始したときに呼ばれる
-
-        virtual int GetDrawPriority() const override {return 0;}				//!< 描画プライオリティ取得メソッド
-        bool IsFallthroughDraw() const NOEXCEPT { return isFallthroughDraw; }		//!< 一つ下の階層のタスクのDrawを実行するかどうか
-
-    private:
-        const bool isFallthroughDraw = false;
-    };
-
-
-
-    /*!
-    *	@ingroup Tasks
-    *	@brief 常駐タスク
-    *
-    *	・基本タスクと違い、排他タスクが変更されても破棄されない
-    *	・Enabledでないときには Execute , WndMessage をコールしない
-    */
-    class BackgroundTaskBase : public TaskBase
-    {
-    public:
-        virtual ~BackgroundTaskBase(){}
-
-        bool IsEnabled() const NOEXCEPT { return m_isEnabled; }
-        void Enable() NOEXCEPT { m_isEnabled = true; }
-        void Disable() NOEXCEPT { m_isEnabled = false; }
-
-    private:
-        bool m_isEnabled = true;
-    };
-
-
-
-
-    /*!
-    *	@ingroup System
-    *	@brief タスク管理クラス
-    *
-    *	タスク継承クラスのリストを管理し、描画、更新を行う。
-    *
-    *	実行中に例外が起こったとき、どのクラスが例外を起こしたのかをログに吐き出す。
-    *	その際に実行時型情報からクラス名を取得しているので、コンパイルの際には
-    *	実行時型情報(RTTIと表記される場合もある)をONにすること。
-    */
-
-    class TaskManager
-    {
-
-    public:
-        TaskManager();
-        ~TaskManager(){Destroy();}
-
-        using TaskPtr = std::weak_ptr<TaskBase>;
-        using ExTaskPtr = std::weak_ptr<ExclusiveTaskBase>;
-        using BgTaskPtr = std::weak_ptr<BackgroundTaskBase>;
-
-        void Destroy();
-
-        void RemoveTaskByID(unsigned int id);				//!< 指定IDを持つタスクの除去　※注：Exclusiveタスクはチェックしない
-        void RevertExclusiveTaskByID(unsigned int id);		//!< 指定IDの排他タスクまでTerminate/popする
-
-        //! 最上位にあるエクスクルーシブタスクをゲト
-        ExTaskPtr GetTopExclusiveTask() const
-        {
-            return ex_stack.back().value;
-        }
-
-        //! タスクの自動生成
-        template <class C, typename... A, class PC = std::shared_ptr<C>,
-            typename std::enable_if<
-                std::integral_constant<bool, std::is_base_of<BackgroundTaskBase, C>::value ||
-                std::is_base_of<ExclusiveTaskBase, C>::value
-                >::value, std::nullptr_t>::type = nullptr>
-            PC AddNewTask(A&&... args)
-        {
-            return std::static_pointer_cast<C>(AddTask(new C(std::forward<A>(args)...)).lock());
-        }
-        
-        template <class C, typename... A, class PC = std::shared_ptr<C>,
-            typename std::enable_if<
-                std::integral_constant<bool, !std::is_base_of<BackgroundTaskBase, C>::value &&
-                !std::is_base_of<ExclusiveTaskBase, C>::value
-                >::value, std::nullptr_t>::type = nullptr>
-            PC AddNewTask(A&&... args)
-        {
-            return std::static_pointer_cast<C>(AddTaskGuaranteed(new C(std::forward<A>(args)...)).lock());
-        }
-
-        //! 任意のクラス型のタスクを取得（通常・常駐兼用）
-        template<class T> std::shared_ptr<T> FindTask(unsigned int id) const
-        {
-            return std::dynamic_pointer_cast<T>(FindTask_impl<T>(id).lock());
-        }
-
-        void Execute(double elapsedTime);					//!< 各タスクのExecute関数をコールする
-        void Draw();										//!< 各タスクをプライオリティ順にDrawする
-
-        //!< 排他タスクが全部なくなっちゃったかどうか
-        bool ExEmpty() const    {
-            return ex_stack.size() <= 1;
-        }
-
-        //デバッグ
-        void DebugOutputTaskList();							//!< 現在リストに保持されているクラスのクラス名をデバッグ出力する
-
-    private:
-        using TaskList = std::list<std::shared_ptr<TaskBase>>;
-        using BgTaskList = std::list<std::shared_ptr<BackgroundTaskBase>>;
-        using DrawPriorityMap = std::multimap<int, TaskPtr, std::greater<int>>;
-
-        struct ExTaskInfo {
-            const std::shared_ptr<ExclusiveTaskBase> value;	//!< 排他タスクのポインタ
-            const TaskList::iterator SubTaskStartPos;		//!< 依存する通常タスクの開始地点
-            DrawPriorityMap drawList;						//!< Draw順ソート用コンテナ。排他タスク自身や、DrawFallthrough時は一つ下の階層のDrawリストも含まれる。
-
-            ExTaskInfo(std::shared_ptr<ExclusiveTaskBase>& source, TaskList::iterator startPos) NOEXCEPT
-                : value(source), SubTaskStartPos(startPos)
-            {
-            }
-            ExTaskInfo(std::shared_ptr<ExclusiveTaskBase>&& source, TaskList::iterator startPos) NOEXCEPT
-                : value(std::move(source)), SubTaskStartPos(startPos)
-            {
-            }
-
-        };
-        using ExTaskStack = std::deque<ExTaskInfo>;
-
-        //! 追加したタスクはTaskManager内部で自動的に破棄されるので、呼び出し側でdeleteしないこと。
-        ExTaskPtr AddTask(ExclusiveTaskBase *newTask);     //!< 排他タスク追加
-        BgTaskPtr AddTask(BackgroundTaskBase *newTask);    //!< 常駐タスク追加
-        TaskPtr AddTaskGuaranteed(TaskBase *newTask);      //!< タスク追加（エラー検出無し）
-
-        //!指定IDの通常タスク取得
-        TaskPtr FindTask(unsigned int id) const
-        {
-            const auto result = indices.find(id);
-            return (result != indices.end()) ? result->second : TaskPtr();
-        }
-
-        //!指定IDの常駐タスク取得
-        BgTaskPtr FindBGTask(unsigned int id) const
-        {
-            const auto result = bg_indices.find(id);
-            return (result != bg_indices.end()) ? result->second : BgTaskPtr();
-        }
-        void CleanupPartialSubTasks(TaskList::iterator it_task);	//!< 一部の通常タスクをTerminate , deleteする
-
-        //! ログ出力
-        void OutputLog(std::string /* s */, ...)
-        {
-            // Not Implemented
-        }
-
-        template<class T,
-            typename std::enable_if<
-                std::integral_constant<bool, !std::is_base_of<BackgroundTaskBase, T>::value &&
-                !std::is_base_of<ExclusiveTaskBase, T>::value
-                >::value, std::nullptr_t>::type = nullptr>
-            TaskPtr FindTask_impl(unsigned int id) const
-        {
-            return FindTask(id);
-        }
-        
-        template<class T, typename std::enable_if<std::is_base_of<BackgroundTaskBase, T>::value, std::nullptr_t>::type = nullptr>
-            BgTaskPtr FindTask_impl(unsigned int id) const
-        {
-            return FindBGTask(id);
-        }
-
-        //! タスクExecute
-        template<class T, typename I = typename T::iterator>
-            void taskExecute(T& tasks, I i, I ied, double elapsedTime)
-        {
-            std::forward_list<I> deleteList;
-
-            for (; i != ied; ++i){
-#ifdef _CATCH_WHILE_EXEC
-                try{
-#endif
-                    if ((*i)->Execute(elapsedTime) == false)
-                    {
-                        deleteList.push_front(i);
-                    }
-#ifdef _CATCH_WHILE_EXEC
-                }
-                catch (...){
-                    if (*i == nullptr) OutputLog("catch while execute1 : NULL", SYSLOG_ERROR);
-                    else OutputLog("catch while execute1 : %X , %s", *i, typeid(**i).name());
-                    break;
-                }
-#endif
-            }
-
-            //タスクでfalseを返したものを消す
-            for (const I& i : deleteList){
-                (*i)->Terminate();
-                tasks.erase(i);
-            }
-        }
-
-        TaskList tasks;								//!< 現在動作ちゅうのタスクリスト
-        BgTaskList bg_tasks;						//!< 常駐タスクリスト
-        ExTaskStack ex_stack;						//!< 排他タスクのスタック。topしか実行しない
-
-        std::shared_ptr<ExclusiveTaskBase> exNext = nullptr;	//!< 現在フレームでAddされた排他タスク
-        DrawPriorityMap drawListBG;					//!< Draw順ソート用コンテナ（常駐タスク）
-        std::unordered_map<unsigned int, TaskPtr> indices;
-        std::unordered_map<unsigned int, BgTaskPtr> bg_indices;
-    };
-
-
-}
-
-#ifdef GTF_HEADER_ONLY
-#   include "task.cpp"
-#endif
+﻿/*!
+*	@file
+*	@brief タスク(?)管理・定義
+*/
+#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <forward_list>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <typeinfo>
+#include <typeindex>
+#include <chrono>
+#include <future>
+#include <atomic>
+#include <limits>
+#include <cassert>
+
+#ifdef __clang__
+#   if !__has_feature(cxx_noexcept)
+#       define NOEXCEPT
+#   else
+#       define NOEXCEPT noexcept
+#   endif
+#elif (defined(_MSC_FULL_VER) && _MSC_FULL_VER < 190023026) || (defined(__GNUC__) && (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 6) || !defined(__GXX_EXPERIMENTAL_CXX0X__)))
+#define NOEXCEPT
+#else
+#define NOEXCEPT noexcept
+#endif
+
+#include "threadpool.h"
+#include "arena.h"
+#include "drawqueue.h"
+#include "logger.h"
+#include "mailbox.h"
+#include "eventbus.h"
+#include "typeslot.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "taskgraph.h"
+#include "handle.h"
+#include "timerwheel.h"
+
+// GTF_PROFILEを定義すると、TaskManagerがタスクの処理時間を計測する
+#ifdef GTF_PROFILE
+#   include "profiler.h"
+#   define GTF_PROFILE_CONCAT_(a, b) a##b
+#   define GTF_PROFILE_CONCAT(a, b) GTF_PROFILE_CONCAT_(a, b)
+#   define GTF_PROFILE_TASK(event, task) gtf::TaskProfiler::Scope GTF_PROFILE_CONCAT(gtfProfileScope, __LINE__)(profiler, gtf::TaskProfiler::Event::event, task)
+#   define GTF_PROFILE_PHASE(event) gtf::TaskProfiler::Scope GTF_PROFILE_CONCAT(gtfProfileScope, __LINE__)(profiler, gtf::TaskProfiler::Event::event)
+#else
+#   define GTF_PROFILE_TASK(event, task)
+#   define GTF_PROFILE_PHASE(event)
+#endif
+
+/*!
+*	@defgroup Tasks
+*	@brief タスク
+*
+*	TaskBaseを継承したクラスは、メインループから呼ばれる更新・描画処理関数を持っています。
+*	システムはこのクラスのリストを持っています。
+*	タイトル・キャラセレ・試合 などのゲームの状態の変更は、
+*	これらタスククラスの切り替えによって行われます。
+*/
+
+namespace gtf
+{
+    template<class T> class TypedTask;
+    class CoroutineTask;
+    class TaskManager;
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief	基本タスク
+    *
+    *	・Executeでfalseを返すと破棄される
+    *	・親の排他タスクが変更されたとき、破棄される
+    *	・GetTickIntervalで2以上を返すと、そのフレーム数に1回だけExecuteされる。
+    *	  同じ間隔のタスクは各フレームに均等に割り振られ、elapsedTimeには前回のExecuteからの経過時間の合計が渡される
+    *	・SaveState/LoadStateを実装すると、TaskManager::SaveSnapshot/LoadSnapshotでロールバックできる。
+    *	  IsStateTrackedでtrueを返すタスクは、状態を変えるたびにTouchStateを呼ぶこと。変わっていないタスクは保存・復元が省かれる
+    *	・SleepFor・SleepUntilWokenで眠ると、起きるまでExecuteされない（Drawはされる。排他タスクは眠らない）。
+    *	  眠っているタスクは実行の列から外れてタイマーホイールに入るので、何もしないタスクを多く持っても毎フレームの負荷にならない
+    */
+    class TaskBase
+    {
+    public:
+        TaskBase() NOEXCEPT {}
+        //! 複製は、どのマネージャにも登録されていない新しいタスクになる（ハンドル・描画・眠り・待ち・スナップショットは引き継がない）。型ごとの実行関数だけを引き継ぐ
+        TaskBase(const TaskBase& other) NOEXCEPT
+            : typedExecute(other.typedExecute), typedBatch(other.typedBatch), typedExecuteType(other.typedExecuteType) {}
+        //! 代入しても、代入先のマネージャでの状態は変わらない
+        TaskBase& operator=(const TaskBase&) NOEXCEPT { return *this; }
+        virtual ~TaskBase(){ CancelWait(); CancelSleep(); WakeWaiters(); }
+        virtual void Initialize(){}							//!< ExecuteまたはDrawがコールされる前に1度だけコールされる
+        virtual bool Execute(double /* elapsedTime */)
+                            {return(true);}					//!< 毎フレームコールされる
+        virtual void Terminate(){}							//!< タスクのリストから外されるときにコールされる（その直後、deleteされる）
+        virtual void Draw(){}								//!< 描画時にコールされる
+        virtual void PrepareDraw(){}						//!< 描画準備モードのとき、Drawの前にコールされる。並列実行モードではワーカースレッド上で並列にコールされる
+        virtual unsigned int GetID() const { return 0; }	//!< 0以外を返すようにした場合、マネージャに同じIDを持つタスクがAddされたとき破棄される
+        virtual int GetDrawPriority() const { return -1; }	//!< 描画プライオリティ。低いほど後順に（手前に）Draw処理。マイナスならば表示しない
+        virtual bool IsParallelExecutable() const { return false; }	//!< trueを返すと、並列実行モードのときワーカースレッド上でExecuteされる
+        virtual unsigned int GetTickInterval() const { return 1; }	//!< 何フレームに1回Executeするか。追加時に1度だけ参照される（下記参照）
+        virtual bool IsDeferrable() const { return false; }			//!< trueを返すと、予算つきのExecuteで時間が足りないとき次のフレームに持ち越される（通常タスクのみ）
+        virtual void SaveState(StateWriter& /* out */) const {}		//!< スナップショットに状態を書き込む
+        virtual void LoadState(StateReader& /* in */){}				//!< SaveStateで書き込んだ状態に戻す
+        virtual bool IsStateTracked() const { return false; }		//!< trueを返すと、TouchStateされていないときはSaveState/LoadStateが省かれる
+        virtual bool DeclareDependencies(TaskDependencies& /* deps */) const { return false; }	//!< 依存グラフ実行モードで、読み書きするものと実行順を宣言する。trueを返すと、依存のないタスクと並列にExecuteされうる
+
+    protected:
+        //! 状態を変えたことを知らせる（IsStateTrackedでtrueを返すタスク用）
+        void TouchState() NOEXCEPT
+        {
+            ++stateVersion;
+            MarkChanged();
+        }
+
+        //! seconds秒経つまで眠る（Initialize・Executeの中から呼ぶ）。起きた後のExecuteには、前回のExecuteからの経過時間の合計が渡される
+        void SleepFor(double seconds) NOEXCEPT
+        {
+            sleepable = true;
+            wakeTime = lastTickTime + seconds;
+            MarkChanged();
+        }
+        //! TaskManager::WakeTaskで起こされるまで眠る（Initialize・Executeの中から呼ぶ）
+        void SleepUntilWoken() NOEXCEPT
+        {
+            sleepable = true;
+            wakeTime = std::numeric_limits<double>::infinity();
+            MarkChanged();
+        }
+
+    private:
+        friend class TaskManager;
+        template<class T> friend class TypedTask;
+        friend class CoroutineTask;
+        using ExecuteFunction = bool(*)(TaskBase*, double);
+        using BatchFunction = void(*)(TaskManager&, const std::size_t*, std::size_t, double, std::forward_list<std::size_t>&);
+
+        //! 終了を待つ・待たれる関係の連結。複製・代入しても、相手のタスクとの関係は移らない
+        struct WaitLinks {
+            WaitLinks() NOEXCEPT {}
+            WaitLinks(const WaitLinks&) NOEXCEPT {}							//!< 複製は何も待たず、誰にも待たれていない
+            WaitLinks& operator=(const WaitLinks&) NOEXCEPT { return *this; }	//!< 代入先の関係はそのまま
+
+            TaskBase* waitingFor = nullptr;					//!< 終了を待っているタスク
+            TaskBase* firstWaiter = nullptr;				//!< このタスクの終了を待っているタスクの連結リストの先頭
+            TaskBase* nextWaiter = nullptr;					//!< 同じタスクの終了を待っている次のタスク
+        };
+
+        //! 眠り・待ち・スナップショット・ハンドルの状態。毎フレームの実行では触らないので、タスク本体とは別に確保する
+        struct ColdState {
+            WaitLinks wait;									//!< 終了を待つ・待たれる関係
+            TaskTimerWheel::Link sleepLink;					//!< 眠っている間、タイマーホイールに入るためのリンク。値はタスクの位置
+            std::uint64_t savedVersion = 0;					//!< 最後にスナップショットに保存したときの版
+            std::uint64_t savedGeneration = 0;				//!< 復元中のスナップショットの番号。そのスナップショットにあるかの印
+            std::uint64_t savedChunk = 0;					//!< 最後に保存・復元したまとまりの番号
+            std::size_t savedOffset = 0;					//!< そのまとまりでの状態の位置
+            std::size_t savedSize = 0;						//!< その状態の大きさ
+            std::uint32_t handleIndex = TaskHandleTable::None;	//!< ハンドルの番号。マネージャに登録されていなければNone
+        };
+
+        //! ColdStateを用意する。マネージャへの登録時と、終了を待ち始めるときに呼ばれる
+        ColdState& Cold()
+        {
+            if (!cold)
+                cold.reset(new ColdState());
+            return *cold;
+        }
+
+        //! ハンドルの番号。一度もマネージャに登録されていなければNone
+        std::uint32_t HandleIndex() const NOEXCEPT
+        {
+            return cold ? cold->handleIndex : TaskHandleTable::None;
+        }
+
+        //! 終了を待っているタスクの連結リストから外れる
+        void CancelWait() NOEXCEPT
+        {
+            if (!cold || !cold->wait.waitingFor)
+                return;
+            WaitLinks& wait = cold->wait;
+            TaskBase** link = &wait.waitingFor->cold->wait.firstWaiter;
+            while (*link != this)
+                link = &(*link)->cold->wait.nextWaiter;
+            *link = wait.nextWaiter;
+            wait.waitingFor = nullptr;
+            wait.nextWaiter = nullptr;
+        }
+
+        //! このタスクの終了を待っているタスクを全て起こす
+        void WakeWaiters() NOEXCEPT
+        {
+            if (!cold)
+                return;
+            for (TaskBase* waiter = cold->wait.firstWaiter; waiter; ){
+                ColdState& w = *waiter->cold;
+                TaskBase* const next = w.wait.nextWaiter;
+                waiter->wakeTime = 0;
+                waiter->MarkChanged();
+                w.wait.waitingFor = nullptr;
+                w.wait.nextWaiter = nullptr;
+                if (w.sleepLink.wheel)
+                    w.sleepLink.wheel->Wake(w.sleepLink);
+                waiter = next;
+            }
+            cold->wait.firstWaiter = nullptr;
+        }
+
+        //! スナップショットに保存する値を変えたことを、所属するまとまりに知らせる（並列実行中にも呼ばれる）
+        void MarkChanged() NOEXCEPT
+        {
+            if (changeFlag && !changeFlag->load(std::memory_order_relaxed))
+                changeFlag->store(true, std::memory_order_relaxed);
+        }
+
+        //! タイマーホイールから外れる
+        void CancelSleep() NOEXCEPT
+        {
+            if (cold && cold->sleepLink.wheel)
+                cold->sleepLink.wheel->Remove(cold->sleepLink);
+        }
+
+        // 毎フレームの実行で触る値を先に並べる
+        ExecuteFunction typedExecute = nullptr;				//!< TypedTaskが設定する、仮想呼び出しを介さないExecute
+        BatchFunction typedBatch = nullptr;					//!< TypedTaskが設定する、同じ型のタスクをまとめて仮想呼び出しを介さずにExecuteする関数
+        const std::type_info* typedExecuteType = nullptr;	//!< typedExecuteが対象とする型
+        double lastTickTime = 0;							//!< 前回Executeした（または追加された）ときの累積時間
+        double wakeTime = 0;								//!< 累積時間がこの値になるまでExecuteしない
+        std::atomic<bool>* changeFlag = nullptr;			//!< 所属するまとまりの変更の印。通常・常駐タスクとしてマネージャにある間だけ設定される
+        std::uint64_t stateVersion = 0;						//!< 状態の版。TouchStateで増え、減ることはない
+        unsigned int tickInterval = 1;						//!< Executeする間隔（フレーム数）
+        unsigned int tickPhase = 0;							//!< 間隔の中でExecuteするフレーム
+        unsigned int deferredFrames = 0;					//!< 連続して持ち越されたフレーム数
+        bool deferrable = false;							//!< 予算つきのExecuteで持ち越せるか
+        bool sleepable = false;								//!< 眠ることがあるか。trueなら経過時間は前回のExecuteからの合計で渡される
+        bool terminated = false;							//!< Terminate済みか
+        bool subscribed = false;							//!< イベントを購読したことがあるか
+        int drawLevel = -1;									//!< 所属する描画キュー。排他タスクの階層、常駐タスクは-2、管理外は-1
+        DrawQueue::Key drawKey;								//!< 描画キューに登録されたときのキー
+        const std::type_info* typeKey = nullptr;			//!< 型別実行で使う実行時の型。追加時に設定される
+        std::size_t typeSlot = TypeSlot<TaskBase>::None;	//!< AddNewTaskで生成した型の番号
+        std::size_t typeIndexPos = TypeSlot<TaskBase>::None;	//!< 型別の索引での位置。索引になければNone
+        std::unique_ptr<ColdState> cold;					//!< めったに使わない状態。マネージャに登録されるまではnullptr
+    };
+
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief 型別実行で仮想呼び出しを省ける基本タスク
+    *
+    *	class Bullet : public gtf::TypedTask<Bullet> { ... };
+    *	のように、自分自身の型を渡して継承する。
+    *	Publishされたイベントは、通常タスク・常駐タスクのExecuteが終わった後にまとめて購読者に配られる。
+    *	配信中の操作も同期点まで保留される。
+    *
+    *	型別実行モードでは、実行時の型がちょうどTのタスクは、型ごとに1度の呼び出しでまとめて
+    *	T::Executeを直接（インライン展開できる形で）呼び出して実行される。
+    *	Tをさらに継承したクラスは、通常の仮想呼び出しで実行される。
+    */
+    template<class T>
+    class TypedTask : public TaskBase
+    {
+    public:
+        TypedTask() NOEXCEPT
+        {
+            typedExecute = &ExecuteAs;
+            typedBatch = &RunBatch;
+            typedExecuteType = &typeid(T);
+        }
+        virtual ~TypedTask(){}
+
+    private:
+        static bool ExecuteAs(TaskBase* task, double elapsedTime)
+        {
+            return static_cast<T*>(task)->T::Execute(elapsedTime);
+        }
+
+        //! positions[0]～positions[count-1]の位置にある型Tのタスクを、順にT::Executeする（TaskManagerの定義の後で定義）
+        static void RunBatch(TaskManager& manager, const std::size_t* positions, std::size_t count, double elapsedTime, std::forward_list<std::size_t>& deleteList);
+    };
+
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief 排他タスク? =ゲームのシーンと考えてください。
+    *
+    *	・他の排他タスクと一緒には動作(Execute)しない
+    *	・他の排他タスクが追加された場合、Inactivateがコールされ、そこでfalseを返すと
+    *		破棄される。trueを返すとExecute、WndMessageがコールされない状態になり、
+    *		新規の排他タスクが全て破棄されたときにActivateが呼ばれ、処理が再開する。
+    *	・通常タスクとの親子関係を持つ。
+    *	・AddTask実行後、一度Executeが実行されるまで追加が保留される。その後に追加された通常タスクは子タスクとなる。
+    *	・TaskManager::PreloadNewTaskで生成した場合、Preloadが別スレッドで実行され、
+    *		それが終わった後のExecuteで追加される。重い読み込みはPreloadで行うと、切り替えが一瞬で済む。
+    */
+    class ExclusiveTaskBase : public TaskBase
+    {
+    public:
+        explicit ExclusiveTaskBase(bool fallthroughDraw = false) NOEXCEPT : isFallthroughDraw(fallthroughDraw) {}
+        virtual ~ExclusiveTaskBase(){}
+        virtual void Activate(unsigned int /* prvTaskID */){}				//!< Executeが再開されるときに呼ばれる
+        virtual bool Inactivate(unsigned int /* nextTaskID */){return true;}//!< 他の排他タスクが開始したときに呼ばれる
+        virtual void Preload(){}											//!< PreloadNewTaskで生成されたとき、別スレッドでInitializeより前に呼ばれる。TaskManagerには触らないこと
+
+        virtual int GetDrawPriority() const override {return 0;}				//!< 描画プライオリティ取得メソッド
+        bool IsFallthroughDraw() const NOEXCEPT { return isFallthroughDraw; }		//!< 一つ下の階層のタスクのDrawを実行するかどうか
+
+        bool IsPreloaded() const NOEXCEPT { return preloaded.load(std::memory_order_acquire); }				//!< Preloadが終わったかどうか
+        float GetPreloadProgress() const NOEXCEPT { return preloadProgress.load(std::memory_order_relaxed); }	//!< Preloadの進み具合（0～1）
+
+    protected:
+        //! Preloadの中から、進み具合（0～1）を報告する
+        void SetPreloadProgress(float progress) NOEXCEPT { preloadProgress.store(progress, std::memory_order_relaxed); }
+
+    private:
+        friend class TaskManager;
+
+        const bool isFallthroughDraw = false;
+        std::atomic<float> preloadProgress{ 0.0f };
+        std::atomic<bool> preloaded{ false };
+        std::future<void> preload;					//!< 実行中のPreload。Preloadで生成されていなければ無効
+    };
+
+
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief 常駐タスク
+    *
+    *	・基本タスクと違い、排他タスクが変更されても破棄されない
+    *	・Enabledでないときには Execute , WndMessage をコールしない
+    */
+    class BackgroundTaskBase : public TaskBase
+    {
+    public:
+        virtual ~BackgroundTaskBase(){}
+
+        bool IsEnabled() const NOEXCEPT { return m_isEnabled; }
+        void Enable() NOEXCEPT { m_isEnabled = true; }
+        void Disable() NOEXCEPT { m_isEnabled = false; }
+
+    private:
+        bool m_isEnabled = true;
+    };
+
+
+
+
+    /*!
+    *	@ingroup Tasks
+    *	@brief 実行時の型がTのタスクを並べた範囲
+    *
+    *	TaskManager::GetTasksOfTypeが返す。タスクの追加・除去で無効になる。
+    */
+    template<class T>
+    class TaskSpan
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = T*;
+            using reference = T&;
+
+            explicit iterator(TaskBase* const* p = nullptr) NOEXCEPT : pos(p) {}
+            T& operator*() const NOEXCEPT { return static_cast<T&>(**pos); }
+            T* operator->() const NOEXCEPT { return static_cast<T*>(*pos); }
+            iterator& operator++() NOEXCEPT { ++pos; return *this; }
+            iterator operator++(int) NOEXCEPT { iterator r = *this; ++pos; return r; }
+            bool operator==(const iterator& other) const NOEXCEPT { return pos == other.pos; }
+            bool operator!=(const iterator& other) const NOEXCEPT { return pos != other.pos; }
+
+        private:
+            TaskBase* const* pos;
+        };
+
+        TaskSpan() NOEXCEPT : first(nullptr), last(nullptr) {}
+        TaskSpan(TaskBase* const* f, TaskBase* const* l) NOEXCEPT : first(f), last(l) {}
+
+        iterator begin() const NOEXCEPT { return iterator(first); }
+        iterator end() const NOEXCEPT { return iterator(last); }
+        std::size_t size() const NOEXCEPT { return static_cast<std::size_t>(last - first); }
+        bool empty() const NOEXCEPT { return first == last; }
+        T& operator[](std::size_t i) const NOEXCEPT { return static_cast<T&>(*first[i]); }
+
+    private:
+        TaskBase* const* first;
+        TaskBase* const* last;
+    };
+
+
+
+    /*!
+    *	@ingroup System
+    *	@brief タスク管理クラス
+    *
+    *	タスク継承クラスのリストを管理し、描画、更新を行う。
+    *
+    *	タスクのExecute・Draw中に行われたタスクの追加、IDによる除去、排他タスクの階層の巻き戻し、描画プライオリティの変更は
+    *	コマンドとして記録され、走査が終わった時点（同期点）で記録順にまとめて反映される。
+    *	そのため、Execute中に追加されたタスクが実行されるのは次のフレームからになる。
+    *
+    *	型別実行モードでは、最上位の階層の通常タスクを実行時の型ごとにまとめ、型の順にExecuteする。
+    *	同じ型の中では追加順に実行される。型の異なるタスク同士の実行順に依存する場合は使わないこと。
+    *
+    *	最上位の階層の通常タスクと常駐タスクは、起きているものの位置の列を追加順に持ち、その列だけを走査する。
+    *	眠ったタスクはExecuteの後で列から外してタイマーホイールに入れ、起きる時間が来たフレームの先頭で列に戻す。
+    *
+    *	実行中に例外が起こったとき、どのクラスが例外を起こしたのかをログに吐き出す。
+    *	その際に実行時型情報からクラス名を取得しているので、コンパイルの際には
+    *	実行時型情報(RTTIと表記される場合もある)をONにすること。
+    */
+
+    class TaskManager
+    {
+
+    public:
+        TaskManager();
+        ~TaskManager(){Destroy();}
+
+        using TaskPtr = std::weak_ptr<TaskBase>;
+        using ExTaskPtr = std::weak_ptr<ExclusiveTaskBase>;
+        using BgTaskPtr = std::weak_ptr<BackgroundTaskBase>;
+        using TaskRef = TaskHandle<TaskBase>;				//!< TaskPtrの代わりに使える、参照カウントを持たないハンドル
+        using ExTaskRef = TaskHandle<ExclusiveTaskBase>;
+        using BgTaskRef = TaskHandle<BackgroundTaskBase>;
+
+        void Destroy();
+
+        void RemoveTaskByID(unsigned int id);				//!< 指定IDを持つタスクの除去　※注：Exclusiveタスクはチェックしない
+        void RevertExclusiveTaskByID(unsigned int id);		//!< 指定IDの排他タスクまでTerminate/popする（走査中なら同期点で反映される）
+
+        //! 最上位にあるエクスクルーシブタスクをゲト
+        ExTaskPtr GetTopExclusiveTask() const
+        {
+            return ex_stack.back().value;
+        }
+        ExTaskRef GetTopExclusiveHandle() const NOEXCEPT
+        {
+            return ex_stack.back().value ? GetHandle(*ex_stack.back().value) : ExTaskRef();
+        }
+        //! 最上位の階層の通常タスク用アリーナ。まだ通常タスクが追加されていなければ空
+        std::weak_ptr<const TaskArena> GetTopArena() const NOEXCEPT
+        {
+            return ex_stack.back().arena;
+        }
+
+        //! 登録されているタスクのハンドルを取得（Initializeの中から取得してよい）。登録されていなければ無効なハンドル
+        template<class T> TaskHandle<T> GetHandle(const T& task) const NOEXCEPT
+        {
+            const std::uint32_t index = task.HandleIndex();
+            if (index == TaskHandleTable::None)
+                return TaskHandle<T>();
+            return TaskHandle<T>(&handles, index, handles.GenerationOf(index));
+        }
+
+        //! 任意のクラス型のタスクのハンドルを取得（通常・常駐・排他兼用）。FindTaskと違い、参照カウントを操作しない
+        template<class T> TaskHandle<T> FindHandle(unsigned int id) const
+        {
+            T* const task = CastTaskPtr<T>(FindRaw_impl<T>(id));
+            return task ? GetHandle(*task) : TaskHandle<T>();
+        }
+
+        //! タスクの自動生成
+        template <class C, typename... A, class PC = std::shared_ptr<C>,
+            typename std::enable_if<
+                std::integral_constant<bool, std::is_base_of<BackgroundTaskBase, C>::value ||
+                std::is_base_of<ExclusiveTaskBase, C>::value
+                >::value, std::nullptr_t>::type = nullptr>
+            PC AddNewTask(A&&... args)
+        {
+            C* pnew = new C(std::forward<A>(args)...);
+            pnew->typeSlot = TypeSlot<TaskBase>::Of<C>();
+            return std::static_pointer_cast<C>(AddTask(pnew).lock());
+        }
+        
+        template <class C, typename... A, class PC = std::shared_ptr<C>,
+            typename std::enable_if<
+                std::integral_constant<bool, !std::is_base_of<BackgroundTaskBase, C>::value &&
+                !std::is_base_of<ExclusiveTaskBase, C>::value
+                >::value, std::nullptr_t>::type = nullptr>
+            PC AddNewTask(A&&... args)
+        {
+            // 制御ブロックごと、現在の階層のアリーナから確保する
+            PC pnew = std::allocate_shared<C>(ArenaAllocator<C>(GetCurrentArena()), std::forward<A>(args)...);
+            pnew->typeSlot = TypeSlot<TaskBase>::Of<C>();
+            AddNormalTask(pnew);
+            return pnew;
+        }
+
+        //! 排他タスクを生成し、Preloadを別スレッドで開始する。Preloadが終わった後のExecuteで、排他タスクとして追加される
+        template <class C, typename... A, class PC = std::shared_ptr<C>,
+            typename std::enable_if<std::is_base_of<ExclusiveTaskBase, C>::value, std::nullptr_t>::type = nullptr>
+            PC PreloadNewTask(A&&... args)
+        {
+            PC pnew(new C(std::forward<A>(args)...));
+            pnew->typeSlot = TypeSlot<TaskBase>::Of<C>();
+            StartPreload(pnew);
+            return pnew;
+        }
+
+        //! Preload中、または追加待ちの排他タスクがあるかどうか
+        bool IsPreloading() const NOEXCEPT { return !preloading.empty(); }
+
+        //! 任意のクラス型のタスクを取得（通常・常駐・排他兼用）
+        /*!
+        *	実行時の型がちょうどTなら、RTTIを使わずに型を確かめる。
+        *	shared_ptrを返すので、参照カウントの原子的な増減が1組ある。毎フレーム引くならFindHandleを使う。
+        */
+        template<class T> std::shared_ptr<T> FindTask(unsigned int id) const
+        {
+            return CastTask<T>(FindTask_impl<T>(id));
+        }
+
+        //! 実行時の型がちょうどTのタスクを全て取得する（通常・常駐・排他兼用、順不同）
+        template<class T> TaskSpan<T> GetTasksOfType() const
+        {
+            const std::size_t slot = TypeSlot<TaskBase>::Of<T>();
+            if (slot >= typeIndex.size() || typeIndex[slot].empty())
+                return TaskSpan<T>();
+            const auto& list = typeIndex[slot];
+            return TaskSpan<T>(list.data(), list.data() + list.size());
+        }
+
+        void Execute(double elapsedTime);					//!< 各タスクのExecute関数をコールする
+        void Execute(double elapsedTime, std::chrono::steady_clock::duration budget);	//!< 予算つきのExecute。持ち越せるタスクは、予算の残っている間だけ実行する
+        void SetMaxDeferFrames(unsigned int frames) NOEXCEPT { maxDeferFrames = frames; }	//!< 持ち越しが何フレーム続いたら、予算を超えても実行するか
+
+        //! 直前のExecuteで、持ち越せるタスクをどれだけ実行・持ち越ししたか
+        struct BudgetStats {
+            std::size_t candidates = 0;				//!< 予算内で実行する対象になったタスク数
+            std::size_t executed = 0;				//!< そのうち実行したタスク数
+            std::size_t deferred = 0;				//!< 次のフレームに持ち越したタスク数
+            std::size_t forced = 0;					//!< 持ち越しが続いたため、予算を超えても実行したタスク数
+            unsigned int maxDeferredFrames = 0;		//!< 持ち越したタスクの、連続して持ち越されたフレーム数の最大
+        };
+        const BudgetStats& GetBudgetStats() const NOEXCEPT { return budgetStats; }
+        void SetParallelExecution(unsigned int threadCount);	//!< 並列実行モードで使うワーカースレッド数を設定する。0で並列実行しない
+        void SetTypeBatchedExecution(bool enable);			//!< 型別実行モードの切り替え。通常タスクを型ごとにまとめてExecuteする
+
+        //! 依存グラフ実行モードの切り替え。型別実行モードより優先される
+        /*!
+        *	最上位の階層の通常タスクを、DeclareDependenciesの宣言から作った依存グラフの段の順にExecuteする。
+        *	並列実行モードでは、同じ段のタスクはワーカースレッド上で並列にExecuteされる。
+        *	依存を宣言しないタスクは、これまでどおり追加順に（他のタスクと同時でなく）Executeされる。
+        *	グラフはタスクが追加・除去されたときだけ作り直される。このモードでは、予算つきのExecuteでも持ち越しはしない。
+        */
+        void SetGraphExecution(bool enable) NOEXCEPT { graphExecution = enable; InvalidateSchedule(); }
+        const TaskGraph::Stats& GetGraphStats() const NOEXCEPT { return graph.GetStats(); }	//!< 依存グラフの大きさと、直前のフレームの最長経路の時間
+        void Draw();										//!< 各タスクをプライオリティ順にDrawする
+        void SetTwoPhaseDraw(bool enable) NOEXCEPT { twoPhaseDraw = enable; }	//!< 描画準備モードの切り替え。Drawの前に全タスクのPrepareDrawを（並列実行モードなら並列に）呼ぶ
+        void SetHeadless(bool enable);						//!< 描画なしモードの切り替え。描画キューを持たず、Drawは何もしない。戻すと描画キューを作り直す
+        bool IsHeadless() const NOEXCEPT { return headless; }
+
+        //! 入力とタスクの増減の通知先を設定する。nullptrで通知しない。Destroyで外される
+        /*!
+        *	TaskRecorderで記録し、TaskReplayerで再生するためのもの。
+        *	通知先があるときは、Preloadの終わりを待ってから排他タスクを追加するので、追加されるフレームが一定になる。
+        */
+        void SetJournal(TaskJournal* newJournal) NOEXCEPT { journal = newJournal; }
+        TaskJournal* GetJournal() const NOEXCEPT { return journal; }
+
+        //! 描画プライオリティの変更。次の同期点でまとめて反映され、同じプライオリティの中では最後尾に並ぶ
+        void SetDrawPriority(const TaskPtr& task, int priority);
+        void SetDrawPriority(const TaskRef& task, int priority);
+
+        //! 眠っているタスクを起こす。次のフレームからExecuteされる（走査中なら同期点で反映される）
+        /*!
+        *	SleepUntilWokenで眠ったタスクを、イベントの購読の中などから起こすためのもの。
+        *	CoroutineTaskの待機も打ち切られる。
+        */
+        void WakeTask(const TaskPtr& task);
+        void WakeTask(const TaskRef& task);
+        std::size_t GetSleepingCount() const NOEXCEPT { return sleepers.Size() + bgSleepers.Size(); }	//!< タイマーホイールで眠っているタスク数
+
+        //!< 排他タスクが全部なくなっちゃったかどうか
+        bool ExEmpty() const    {
+            return ex_stack.size() <= 1;
+        }
+
+        using Subscription = EventBus::Subscription;
+
+        //! イベントを発行する。並列実行中のタスクからも発行でき、Executeの最後にまとめて配られる
+        template<class E>
+            void Publish(E&& event)
+        {
+            events.Publish(std::forward<E>(event), workerCommandTarget().owner == this);
+        }
+
+        //! 型Eのイベントを購読する。ownerがTerminateされると（排他タスクの階層が戻された場合も）自動で解除される
+        template<class E, class F>
+            Subscription Subscribe(TaskBase& owner, F&& handler)
+        {
+            assert(workerCommandTarget().owner != this);
+            owner.subscribed = true;
+            return events.Subscribe<E>(&owner, std::forward<F>(handler));
+        }
+        void Unsubscribe(Subscription id) NOEXCEPT { events.Unsubscribe(id); }	//!< 購読を解除する
+
+        //! 現在のタスクの状態をスナップショットに保存する。ExecuteやDrawの外で呼ぶこと
+        /*!
+        *	直前に保存・復元したスナップショットから、タスクの増減も状態の変化（TouchState・眠り・描画順・
+        *	経過時間の持ち越し）もないまとまりは、そのスナップショットと共有して手を触れない。
+        *	変わったまとまりでも、状態の変わっていないタスクはSaveStateを呼ばずに前回の内容をコピーする。
+        *	IDの索引も、変わっていなければ共有する。
+        */
+        void SaveSnapshot(TaskSnapshot& snapshot);
+
+        //! スナップショットの状態に戻す。ExecuteやDrawの外で呼ぶこと。LoadStateを呼んだタスク数を返す
+        /*!
+        *	保存後に破棄されたタスクは、Initializeされ直すことなく元に戻る。
+        *	保存後に追加されたタスクは、Terminateを呼ばずに外される。保留中の操作は捨てられる。
+        *	保存後に状態の変わっていないタスクは、LoadStateを呼ばない。
+        *	イベントの購読と、CoroutineTaskの中断位置は元に戻らない。保存後に破棄されたタスクのハンドルは、取得し直すこと。
+        */
+        std::size_t LoadSnapshot(const TaskSnapshot& snapshot);
+
+        //! 他のマネージャ（スレッド）から送るメッセージ。受け取ったマネージャを引数に、そのスレッドで実行される
+        using Message = std::function<void(TaskManager&)>;
+
+        //! メッセージを送る。どのスレッドから呼んでもよく、次のExecuteの先頭で届いた順に実行される
+        void Post(Message message) { mailbox.Post(std::move(message)); }
+
+        //! ログの出力先を設定する。nullptrならAsyncLogger::Default()に出力する
+        void SetLogger(std::shared_ptr<AsyncLogger> newLogger) NOEXCEPT { logger = std::move(newLogger); }
+        AsyncLogger& GetLogger() const NOEXCEPT { return logger ? *logger : AsyncLogger::Default(); }
+
+        //デバッグ
+        void DebugOutputTaskList();							//!< 現在リストに保持されているクラスのクラス名をデバッグ出力する
+#ifdef GTF_PROFILE
+        TaskProfiler& GetProfiler() NOEXCEPT { return profiler; }	//!< プロファイラ取得。集計はExecuteの先頭で前のフレームの分が行われる
+#endif
+
+    private:
+        template<class T> friend class TypedTask;
+
+        //! タスクを登録順に並べた配列。除去されたタスクはnullptrの墓標として残り、フレームの合間に詰められる
+        using TaskList = std::vector<std::shared_ptr<TaskBase>>;
+        using BgTaskList = std::vector<std::shared_ptr<BackgroundTaskBase>>;
+        using DrawPriorityMap = DrawQueue;
+        using TaskIndexMap = std::unordered_map<unsigned int, std::size_t>;	//!< ID→タスク配列の添字
+        using ChunkFlags = std::deque<std::atomic<bool>>;	//!< スナップショットのまとまりごとの変更の印。伸ばしても要素は動かない
+
+        //! Execute・Draw中に保留された操作
+        struct Command {
+            enum class Type {
+                AddTask,				//!< 通常タスク追加
+                AddBgTask,				//!< 常駐タスク追加
+                AddExTask,				//!< 排他タスク追加
+                PreloadExTask,			//!< Preloadを開始した排他タスクの登録
+                RemoveByID,				//!< IDによる除去
+                RevertExTask,			//!< 排他タスクの階層の巻き戻し
+                SetDrawPriority,		//!< 描画プライオリティ変更
+                WakeTask,				//!< 眠っているタスクを起こす
+            };
+
+            Type type;
+            std::shared_ptr<TaskBase> task;
+            unsigned int id;
+            int priority;
+            TaskRef handle = TaskRef();			//!< taskの代わりにハンドルで指定された場合
+        };
+        using CommandBuffer = std::vector<Command>;
+
+        //! 並列実行中のワーカーが記録するコマンドの書き込み先
+        struct WorkerCommandTarget {
+            const TaskManager* owner;
+            CommandBuffer* buffer;
+        };
+        static WorkerCommandTarget& workerCommandTarget() NOEXCEPT
+        {
+            static thread_local WorkerCommandTarget target = { nullptr, nullptr };
+            return target;
+        }
+
+        //! タスクの走査中であることを示すスコープ。この間の操作はコマンドとして保留される
+        class DeferScope
+        {
+        public:
+            explicit DeferScope(TaskManager& m) NOEXCEPT : manager(m) { ++manager.deferDepth; }
+            ~DeferScope(){ --manager.deferDepth; }
+            DeferScope(const DeferScope&) = delete;
+            DeferScope& operator=(const DeferScope&) = delete;
+        private:
+            TaskManager& manager;
+        };
+
+        //! 入力を処理していることを示すスコープ。この間のタスクの増減は、入力の結果として通知される
+        class JournalScope
+        {
+        public:
+            explicit JournalScope(TaskManager& m) NOEXCEPT : manager(m) { ++manager.journalDepth; }
+            ~JournalScope(){ --manager.journalDepth; }
+            JournalScope(const JournalScope&) = delete;
+            JournalScope& operator=(const JournalScope&) = delete;
+        private:
+            TaskManager& manager;
+        };
+
+        //! 外からの操作（入力）か
+        bool IsExternalCall() const NOEXCEPT { return journalDepth == 0 && !IsDeferring(); }
+
+        struct ExTaskInfo {
+            const std::shared_ptr<ExclusiveTaskBase> value;	//!< 排他タスクのポインタ
+            std::size_t SubTaskStartPos;					//!< 依存する通常タスクの開始位置（tasksの添字）
+            DrawPriorityMap drawList;						//!< Draw順ソート用コンテナ。この階層の通常タスクと排他タスク自身を含む。DrawFallthrough時は描画の際に下の階層とマージされる。
+            std::shared_ptr<TaskArena> arena;				//!< この階層の通常タスク用アリーナ。popされると、タスクが全て解放された時点でまとめて解放される
+
+            ExTaskInfo(std::shared_ptr<ExclusiveTaskBase>& source, std::size_t startPos) NOEXCEPT
+                : value(source), SubTaskStartPos(startPos)
+            {
+            }
+            ExTaskInfo(std::shared_ptr<ExclusiveTaskBase>&& source, std::size_t startPos) NOEXCEPT
+                : value(std::move(source)), SubTaskStartPos(startPos)
+            {
+            }
+
+        };
+        using ExTaskStack = std::deque<ExTaskInfo>;
+
+        //! 型別実行で、最上位の階層の同じ型の通常タスクをまとめたもの
+        struct TypeBatch {
+            const std::type_info* type;
+            TaskBase::BatchFunction run;					//!< まとまりを仮想呼び出しを介さずにExecuteする関数。nullptrなら1つずつ仮想呼び出し
+            std::vector<std::size_t> positions;				//!< 起きているタスクの位置（tasksの添字）。追加順に並ぶ
+            std::size_t wokenFrom;							//!< このフレームで起きたタスクを足し始めた位置。足していなければsize_tの最大値
+        };
+
+        //! 追加したタスクはTaskManager内部で自動的に破棄されるので、呼び出し側でdeleteしないこと。
+        ExTaskPtr AddTask(ExclusiveTaskBase *newTask);     //!< 排他タスク追加
+        BgTaskPtr AddTask(BackgroundTaskBase *newTask);    //!< 常駐タスク追加
+        TaskPtr AddTaskGuaranteed(TaskBase *newTask);      //!< タスク追加（エラー検出無し）
+        TaskPtr AddTaskGuaranteed(std::shared_ptr<TaskBase> newTask);	//!< タスク追加（エラー検出無し）
+        BgTaskPtr AddTask(std::shared_ptr<BackgroundTaskBase> newTask);	//!< 常駐タスク追加
+        ExTaskPtr AddTask(std::shared_ptr<ExclusiveTaskBase> newTask);	//!< 排他タスク追加
+        void StartPreload(std::shared_ptr<ExclusiveTaskBase> newTask);	//!< Preloadを別スレッドで開始し、追加待ちに登録する
+        void PromotePreloaded();							//!< Preloadの終わった排他タスクを、登録順に1つ追加する
+        void WaitPreloads();								//!< 実行中のPreloadが全て終わるまで待つ
+
+        //! 操作を保留するべきか
+        bool IsDeferring() const NOEXCEPT
+        {
+            return deferDepth > 0 || workerCommandTarget().owner == this;
+        }
+        void PushCommand(Command&& command);				//!< 保留する操作を記録する
+        void FlushCommands();								//!< 保留している操作を記録順に反映する（同期点）
+
+        //! 最上位の階層のアリーナを取得（なければ作る）
+        const std::shared_ptr<TaskArena>& GetCurrentArena()
+        {
+            auto& arena = ex_stack.back().arena;
+            if (!arena)
+                arena = std::make_shared<TaskArena>();
+            return arena;
+        }
+
+        //!指定IDの通常タスク取得
+        TaskPtr FindTask(unsigned int id) const
+        {
+            const auto result = indices.find(id);
+            return (result != indices.end()) ? tasks[result->second] : TaskPtr();
+        }
+
+        //!指定IDの常駐タスク取得
+        BgTaskPtr FindBGTask(unsigned int id) const
+        {
+            const auto result = bg_indices.find(id);
+            return (result != bg_indices.end()) ? bg_tasks[result->second] : BgTaskPtr();
+        }
+
+        //!指定IDの排他タスク取得。同じIDがあれば上の階層のもの
+        ExTaskPtr FindExTask(unsigned int id) const
+        {
+            for (auto it = ex_stack.rbegin(); it != ex_stack.rend(); ++it){
+                if (it->value && it->value->GetID() == id)
+                    return it->value;
+            }
+            return ExTaskPtr();
+        }
+
+        //! タスクをTにキャストする。TがPの基底か、実行時の型がちょうどTなら、dynamic_castしない
+        template<class T, class P, typename std::enable_if<std::is_base_of<T, P>::value, std::nullptr_t>::type = nullptr>
+            static std::shared_ptr<T> CastTask(std::shared_ptr<P>&& task) NOEXCEPT
+        {
+            return std::move(task);
+        }
+        template<class T, class P, typename std::enable_if<!std::is_base_of<T, P>::value, std::nullptr_t>::type = nullptr>
+            static std::shared_ptr<T> CastTask(std::shared_ptr<P>&& task) NOEXCEPT
+        {
+            if (task && task->typeSlot == TypeSlot<TaskBase>::Of<T>())
+                return std::static_pointer_cast<T>(std::move(task));
+            return std::dynamic_pointer_cast<T>(std::move(task));
+        }
+        //! ハンドルの番号を割り当てる。ColdStateもここで用意される
+        void AcquireHandle(TaskBase& task)
+        {
+            TaskBase::ColdState& cold = task.Cold();
+            if (cold.handleIndex == TaskHandleTable::None)
+                cold.handleIndex = handles.Acquire(&task);
+        }
+        //! ハンドルの番号を返す。古いハンドルは無効になる
+        void ReleaseHandle(TaskBase& task)
+        {
+            if (task.HandleIndex() != TaskHandleTable::None){
+                handles.Release(task.cold->handleIndex);
+                task.cold->handleIndex = TaskHandleTable::None;
+            }
+        }
+
+        //! CastTaskの生ポインタ版
+        template<class T, typename std::enable_if<std::is_base_of<T, TaskBase>::value, std::nullptr_t>::type = nullptr>
+            static T* CastTaskPtr(TaskBase* task) NOEXCEPT
+        {
+            return task;
+        }
+        template<class T, typename std::enable_if<!std::is_base_of<T, TaskBase>::value, std::nullptr_t>::type = nullptr>
+            static T* CastTaskPtr(TaskBase* task) NOEXCEPT
+        {
+            if (task && task->typeSlot == TypeSlot<TaskBase>::Of<T>())
+                return static_cast<T*>(task);
+            return dynamic_cast<T*>(task);
+        }
+        void IndexType(TaskBase& task);						//!< 型別の索引に加える
+        void UnindexType(TaskBase& task) NOEXCEPT;			//!< 型別の索引から外す
+        void CleanupPartialSubTasks(std::size_t startPos);	//!< 一部の通常タスクをTerminate , deleteする
+        void DrawTasks();									//!< プライオリティ順にDrawする
+        void DrawOne(TaskBase& task);						//!< 1つのタスクのDraw
+        void PrepareDrawTasks();							//!< drawOrderのタスクのPrepareDrawを呼ぶ
+        template<class F> void VisitDrawOrder(F&& visit);	//!< 描画するタスクを、常駐タスクとマージしたプライオリティ順にたどる
+        void AddNormalTask(std::shared_ptr<TaskBase> newTask);	//!< 通常タスクを追加する。AddTaskGuaranteedと違い、weak_ptrを作らない
+        void RebuildDrawLists();							//!< 登録されているタスクを、全て描画キューに登録し直す
+        void CompactTasks();								//!< 墓標を取り除いてタスク配列を詰める
+        void CompactBgTasks();								//!< 墓標を取り除いて常駐タスク配列を詰める
+        void RemoveTaskAt(TaskList& list, std::size_t pos);		//!< 通常タスクをTerminateして墓標に置き換える
+        void RemoveTaskAt(BgTaskList& list, std::size_t pos);	//!< 常駐タスクをTerminateして墓標に置き換える
+        void RegisterDraw(int level, TaskBase& task, int priority);	//!< 描画プライオリティが0以上なら描画キューに登録する
+        void UnregisterDraw(TaskBase& task);					//!< 描画キューから外す
+        void ApplyDrawPriority(TaskBase& task, int priority);	//!< 描画プライオリティの変更を反映する
+        void TerminateTask(TaskBase& task);					//!< タスクのTerminate。終了を待っているタスクを起こす
+        void DetachTask(TaskBase& task);			//!< Terminateを呼ばずにマネージャから切り離す（ロールバック用）
+        void PopExclusiveTask();								//!< 最上位の排他タスクの階層をpopする
+        void AssignTick(TaskBase& task, bool allowDefer);		//!< 追加されたタスクに、Executeする間隔とフレームを割り当てる
+        template<class List>
+            void saveChunks(TaskSnapshot::Data& d, TaskSnapshot::ChunkList& out, TaskSnapshot::ChunkList& spare,
+                const TaskSnapshot::ChunkList* base, const List& list, ChunkFlags& flags);	//!< タスク配列を、変わったまとまりだけ作り直して保存する
+        void saveRecord(TaskSnapshot::Data& d, TaskSnapshot::Chunk& chunk, const TaskSnapshot::Chunk* base, TaskBase& task);	//!< 1つのタスクをまとまりに保存する
+
+        //! 位置posを含むまとまりの変更の印。なければ作る
+        static std::atomic<bool>& chunkFlag(ChunkFlags& flags, std::size_t pos)
+        {
+            const std::size_t chunk = pos / TaskSnapshot::ChunkSize;
+            while (flags.size() <= chunk)
+                flags.emplace_back(true);
+            return flags[chunk];
+        }
+        //! 位置posに置いたタスクに、そのまとまりの変更の印を結びつけて印をつける
+        static void linkChunkFlag(ChunkFlags& flags, TaskBase& task, std::size_t pos)
+        {
+            task.changeFlag = &chunkFlag(flags, pos);
+            task.changeFlag->store(true, std::memory_order_relaxed);
+        }
+        //! 配列がoldSizeからnewSizeに縮んだとき、切り落とされた位置を含むまとまりに印をつける
+        static void markTruncated(ChunkFlags& flags, std::size_t newSize, std::size_t oldSize)
+        {
+            for (std::size_t pos = newSize; pos < oldSize; pos += TaskSnapshot::ChunkSize - pos % TaskSnapshot::ChunkSize)
+                chunkFlag(flags, pos).store(true, std::memory_order_relaxed);
+        }
+        void ExecuteDeferrable(double elapsedTime);			//!< 予算の残っている間、持ち越せるタスクを古い順にExecuteする
+
+        //! このフレームでExecuteするタスクか
+        bool IsTickDue(const TaskBase& task) const NOEXCEPT
+        {
+            // 眠っているタスクは、起きる時間まで仮想呼び出しもしない
+            return task.wakeTime <= tickTime &&
+                (task.tickInterval <= 1 || tickFrame % task.tickInterval == task.tickPhase);
+        }
+        void ExecuteTypeBatches(double elapsedTime);			//!< 最上位の階層の通常タスクを型ごとにまとめてExecuteする
+        void BuildTypeBatches();								//!< 型別のまとまりを作り直す
+        void AddToTypeBatch(std::size_t pos);					//!< 追加された通常タスクを型別のまとまりに加える
+        std::size_t TypeBatchOf(TaskBase& task);				//!< タスクの型のまとまりの添字。なければ作る
+        void WakeTasks();									//!< 最上位の階層の通常タスクのうち、起きる時間になったものを実行する列に戻す
+        void SleepTasks();									//!< Executeの後で、眠った通常タスクを実行する列からタイマーホイールに移す
+        void ApplyWake(TaskBase& task);						//!< 眠っているタスクを起こす
+        void ExecuteGraph(double elapsedTime);				//!< 最上位の階層の通常タスクを依存グラフの段の順にExecuteする
+        void BuildGraph();									//!< 依存グラフを作り直す
+        void InvalidateSchedule() NOEXCEPT { typeBatchesValid = false; graphValid = false; awakeValid = false; }	//!< タスクの位置や階層が変わったので、型別のまとまりと依存グラフと起きているタスクの列を作り直させる
+
+        static const int BgDrawLevel = -2;					//!< 常駐タスクのdrawLevel
+
+        //! 指定階層の描画キュー
+        DrawPriorityMap& DrawListOf(int level)
+        {
+            return level == BgDrawLevel ? drawListBG : ex_stack[level].drawList;
+        }
+
+        //! IDの索引から、指定位置のタスクの項目を外す
+        static void Unindex(TaskIndexMap& index, unsigned int id, std::size_t pos)
+        {
+            if (id == 0)
+                return;
+            const auto it = index.find(id);
+            if (it != index.end() && it->second == pos)
+                index.erase(it);
+        }
+
+        //! IDの索引の、移動したタスクの添字を書き換える
+        static void MoveIndex(TaskIndexMap& index, unsigned int id, std::size_t from, std::size_t to)
+        {
+            if (id == 0)
+                return;
+            const auto it = index.find(id);
+            if (it != index.end() && it->second == from)
+                it->second = to;
+        }
+
+        //! ログ出力。書式化と出力はログのスレッドで行われる
+        template<typename... A>
+        void OutputLog(const char* format, const A&... args) const NOEXCEPT
+        {
+            GetLogger().Log(format, args...);
+        }
+
+        //! FindTaskの実装。weak_ptrを経由せず、保持しているshared_ptrを1度だけ複製する
+        template<class T,
+            typename std::enable_if<
+                std::integral_constant<bool, !std::is_base_of<BackgroundTaskBase, T>::value &&
+                !std::is_base_of<ExclusiveTaskBase, T>::value
+                >::value, std::nullptr_t>::type = nullptr>
+            std::shared_ptr<TaskBase> FindTask_impl(unsigned int id) const
+        {
+            const auto result = indices.find(id);
+            return (result != indices.end()) ? tasks[result->second] : nullptr;
+        }
+        
+        template<class T, typename std::enable_if<std::is_base_of<BackgroundTaskBase, T>::value, std::nullptr_t>::type = nullptr>
+            std::shared_ptr<BackgroundTaskBase> FindTask_impl(unsigned int id) const
+        {
+            const auto result = bg_indices.find(id);
+            return (result != bg_indices.end()) ? bg_tasks[result->second] : nullptr;
+        }
+
+        template<class T, typename std::enable_if<std::is_base_of<ExclusiveTaskBase, T>::value, std::nullptr_t>::type = nullptr>
+            std::shared_ptr<ExclusiveTaskBase> FindTask_impl(unsigned int id) const
+        {
+            for (auto it = ex_stack.rbegin(); it != ex_stack.rend(); ++it){
+                if (it->value && it->value->GetID() == id)
+                    return it->value;
+            }
+            return nullptr;
+        }
+
+        //! FindTask_implの生ポインタ版
+        template<class T,
+            typename std::enable_if<
+                std::integral_constant<bool, !std::is_base_of<BackgroundTaskBase, T>::value &&
+                !std::is_base_of<ExclusiveTaskBase, T>::value
+                >::value, std::nullptr_t>::type = nullptr>
+            TaskBase* FindRaw_impl(unsigned int id) const
+        {
+            const auto result = indices.find(id);
+            return (result != indices.end()) ? tasks[result->second].get() : nullptr;
+        }
+
+        template<class T, typename std::enable_if<std::is_base_of<BackgroundTaskBase, T>::value, std::nullptr_t>::type = nullptr>
+            TaskBase* FindRaw_impl(unsigned int id) const
+        {
+            const auto result = bg_indices.find(id);
+            return (result != bg_indices.end()) ? bg_tasks[result->second].get() : nullptr;
+        }
+
+        template<class T, typename std::enable_if<std::is_base_of<ExclusiveTaskBase, T>::value, std::nullptr_t>::type = nullptr>
+            TaskBase* FindRaw_impl(unsigned int id) const
+        {
+            for (auto it = ex_stack.rbegin(); it != ex_stack.rend(); ++it){
+                if (it->value && it->value->GetID() == id)
+                    return it->value.get();
+            }
+            return nullptr;
+        }
+
+        //! 仮想呼び出しでExecuteする
+        struct VirtualExecute {
+            bool operator()(TaskBase& task, double elapsedTime) const { return task.Execute(elapsedTime); }
+        };
+
+        //! 1つのタスクのExecute。executeが渡された場合は仮想呼び出しを介さない
+        bool executeOne(TaskBase& task, TaskBase::ExecuteFunction execute, double elapsedTime)
+        {
+            if (execute)
+                return executeWith(task, [execute](TaskBase& t, double e){ return execute(&t, e); }, elapsedTime);
+            return executeWith(task, VirtualExecute(), elapsedTime);
+        }
+
+        //! 1つのタスクのExecute。call(task, elapsedTime)でExecuteを呼び出す
+        template<class C>
+            bool executeWith(TaskBase& task, const C& call, double elapsedTime)
+        {
+            // 間引いたり持ち越したり眠ったりするタスクには、前回からの経過時間をまとめて渡す
+            const bool accumulated = task.tickInterval > 1 || task.deferrable || task.sleepable;
+            if (accumulated){
+                elapsedTime = tickTime - task.lastTickTime;
+                task.lastTickTime = tickTime;
+                task.MarkChanged();
+            }
+            bool alive;
+            {
+                GTF_PROFILE_TASK(Execute, task);
+                alive = call(task, elapsedTime);
+            }
+            if (task.wakeTime > tickTime)
+                noteSleep(task, accumulated);
+            return alive;
+        }
+
+        //! Executeの中で眠ったタスクを、Executeの後でタイマーホイールに移させる
+        void noteSleep(TaskBase& task, bool accumulated) NOEXCEPT
+        {
+            // 初めて眠ったタスクは、SleepForが前回の時間から数えているので、このExecuteの時間から数え直す
+            if (!accumulated){
+                task.wakeTime += tickTime - task.lastTickTime;
+                task.lastTickTime = tickTime;
+                task.MarkChanged();
+            }
+            slept.store(true, std::memory_order_relaxed);
+        }
+
+        //! [0, count)をワーカーで並列に処理する。処理中のタスクの操作は区間ごとに記録し、区間順に連結して保留する
+        /*!
+        *	1つの区間はminGrain個以上。1つ1つが重い処理なら小さくする。
+        */
+        template<class F>
+            void parallelForDeferred(std::size_t count, F body, std::size_t minGrain = 32)
+        {
+            // ワーカーからのタスク追加に備え、アリーナは先に作っておく
+            GetCurrentArena();
+
+            const std::size_t grain = std::max<std::size_t>(minGrain, count / (workerPool->GetWorkerCount() * 8));
+            std::vector<CommandBuffer> rangeCommands((count + grain - 1) / grain);
+            workerPool->ParallelFor(count, grain, [&](std::size_t b, std::size_t e, unsigned int w){
+                WorkerCommandTarget& target = workerCommandTarget();
+                const WorkerCommandTarget prev = target;
+                target.owner = this;
+                target.buffer = &rangeCommands[b / grain];
+                try{
+                    body(b, e, w);
+                }
+                catch (...){
+                    target = prev;
+                    throw;
+                }
+                target = prev;
+            });
+            for (auto&& c : rangeCommands)
+                std::move(c.begin(), c.end(), std::back_inserter(commands));
+        }
+
+        //! 並列実行可能なタスクをまとめてExecute
+        template<class T, class C>
+            void parallelExecute(T& tasks, std::vector<std::size_t>& batch, const C& call, std::forward_list<std::size_t>& deleteList, double elapsedTime)
+        {
+            if (batch.empty())
+                return;
+
+            // falseを返したタスクはワーカーごとに集め、後で位置順にマージする
+            std::vector<std::vector<std::size_t>> removed(workerPool->GetWorkerCount());
+            parallelForDeferred(batch.size(), [&](std::size_t b, std::size_t e, unsigned int w){
+                for (; b != e; ++b){
+                    if (executeWith(*tasks[batch[b]], call, elapsedTime) == false)
+                        removed[w].push_back(b);
+                }
+            });
+
+            for (auto&& r : removed){
+                for (std::size_t b : r)
+                    deleteList.push_front(batch[b]);
+            }
+            batch.clear();
+        }
+
+        //! タスクExecute
+        /*!
+        *	positionAt(0)～positionAt(count-1)の位置にあるタスクを順にcall(task, elapsedTime)でExecuteし、falseを返したタスクの位置をdeleteListに積む。
+        *	並列実行モードでは、並列実行可能なタスクが続く間はまとめておき、次の逐次実行の前に並列に実行する。
+        */
+        template<class T, class F, class C>
+            void executePositions(T& tasks, std::size_t count, F positionAt, const C& call, double elapsedTime, std::forward_list<std::size_t>& deleteList)
+        {
+            std::vector<std::size_t> batch;				// 並列実行待ちのタスク
+
+            for (std::size_t k = 0; k < count; ++k){
+                const std::size_t i = positionAt(k);
+                // 排他タスクが戻されて配列が縮んでいる場合がある
+                if (i >= tasks.size() || !tasks[i] || !IsTickDue(*tasks[i]))
+                    continue;
+                // 予算つきのExecuteでは、持ち越せるタスクは後で予算の範囲で実行する
+                if (budgetActive && tasks[i]->deferrable){
+                    deferrableTasks.push_back(i);
+                    continue;
+                }
+                if (workerPool && tasks[i]->IsParallelExecutable()){
+                    batch.push_back(i);
+                    continue;
+                }
+                // 前にある並列実行可能なタスクを先に済ませておく
+                parallelExecute(tasks, batch, call, deleteList, elapsedTime);
+
+#ifdef _CATCH_WHILE_EXEC
+                try{
+#endif
+                    if (executeWith(*tasks[i], call, elapsedTime) == false)
+                    {
+                        deleteList.push_front(i);
+                    }
+#ifdef _CATCH_WHILE_EXEC
+                }
+                catch (...){
+                    if (i >= tasks.size() || !tasks[i]) OutputLog("catch while execute1 : NULL");
+                    else OutputLog("catch while execute1 : %p , %s", tasks[i].get(), typeid(*tasks[i]));
+                    break;
+                }
+#endif
+            }
+            parallelExecute(tasks, batch, call, deleteList, elapsedTime);
+        }
+
+        //! Executeでfalseを返したタスクをTerminateして墓標に置き換える
+        template<class T>
+            void removeFinished(T& tasks, std::forward_list<std::size_t>& deleteList)
+        {
+            // 実行順によらず、後ろのタスクから順にTerminateする
+            deleteList.sort(std::greater<std::size_t>());
+            for (std::size_t i : deleteList){
+                // Execute中に別の経路で破棄されている場合がある
+                if (i >= tasks.size() || !tasks[i])
+                    continue;
+                RemoveTaskAt(tasks, i);
+            }
+        }
+
+        //! 起きているタスクの列awakeの位置にあるタスクをExecuteする
+        template<class T>
+            void taskExecute(T& tasks, const std::vector<std::size_t>& awake, double elapsedTime)
+        {
+            std::forward_list<std::size_t> deleteList;
+            executePositions(tasks, awake.size(), [&awake](std::size_t k){ return awake[k]; }, VirtualExecute(), elapsedTime, deleteList);
+            removeFinished(tasks, deleteList);
+        }
+
+        //! 眠っていればタイマーホイールに入れる。起きていればfalse
+        bool sleepTask(TaskTimerWheel& wheel, TaskBase& task, std::size_t pos) NOEXCEPT
+        {
+            if (task.wakeTime <= tickTime)
+                return false;
+            wheel.Insert(task.cold->sleepLink, wheel.TickOf(task.wakeTime), pos);
+            return true;
+        }
+
+        //! tasksの添字start以降で、起きているタスクの列awakeを作り直す。眠っているタスクはタイマーホイールに入れる
+        template<class T>
+            void buildAwake(T& tasks, std::size_t start, std::vector<std::size_t>& awake, TaskTimerWheel& wheel)
+        {
+            wheel.Reset(wheel.TickOf(tickTime));
+            awake.clear();
+            for (std::size_t i = start; i < tasks.size(); ++i){
+                if (tasks[i] && !sleepTask(wheel, *tasks[i], i))
+                    awake.push_back(i);
+            }
+        }
+
+        //! 起きる時間になったタスクの位置を、位置順にwokenに集める
+        template<class T>
+            void collectWoken(T& tasks, TaskTimerWheel& wheel)
+        {
+            woken.clear();
+            wheel.Advance(wheel.TickOf(tickTime), woken);
+            // tick単位に切り上げているので、まだ時間の来ていないものは入れ直す
+            std::size_t n = 0;
+            for (std::size_t pos : woken){
+                TaskBase* const task = pos < tasks.size() ? tasks[pos].get() : nullptr;
+                if (task && !sleepTask(wheel, *task, pos))
+                    woken[n++] = pos;
+            }
+            woken.resize(n);
+            std::sort(woken.begin(), woken.end());
+        }
+
+        //! 起きる時間になったタスクを、起きているタスクの列awakeに戻す。列が無効なら、tasksの添字start以降で作り直す
+        template<class T>
+            void wakeAwake(T& tasks, std::size_t start, std::vector<std::size_t>& awake, bool& valid, TaskTimerWheel& wheel)
+        {
+            if (!valid){
+                buildAwake(tasks, start, awake, wheel);
+                valid = true;
+                return;
+            }
+            collectWoken(tasks, wheel);
+            const std::size_t from = awake.size();
+            awake.insert(awake.end(), woken.begin(), woken.end());
+            mergeAwake(awake, from);
+        }
+
+        //! 位置順の列listの、fromより後ろに足した位置を併合する
+        static void mergeAwake(std::vector<std::size_t>& list, std::size_t from)
+        {
+            std::inplace_merge(list.begin(), list.begin() + from, list.end());
+        }
+
+        //! 起きているタスクの列から、除去されたタスクを外し、眠ったタスクをタイマーホイールに移す
+        template<class T>
+            void sleepIdle(T& tasks, std::vector<std::size_t>& awake, TaskTimerWheel& wheel)
+        {
+            std::size_t n = 0;
+            for (std::size_t pos : awake){
+                TaskBase* const task = pos < tasks.size() ? tasks[pos].get() : nullptr;
+                if (task && !sleepTask(wheel, *task, pos))
+                    awake[n++] = pos;
+            }
+            awake.resize(n);
+        }
+
+        TaskList tasks;								//!< 現在動作ちゅうのタスクリスト
+        BgTaskList bg_tasks;						//!< 常駐タスクリスト
+        std::size_t taskTombstones = 0;				//!< tasks内の墓標の数
+        std::size_t bgTaskTombstones = 0;			//!< bg_tasks内の墓標の数
+        ExTaskStack ex_stack;						//!< 排他タスクのスタック。topしか実行しない
+
+        std::shared_ptr<ExclusiveTaskBase> exNext = nullptr;	//!< 現在フレームでAddされた排他タスク
+        std::deque<std::shared_ptr<ExclusiveTaskBase>> preloading;	//!< Preload中・追加待ちの排他タスク。登録順
+        DrawPriorityMap drawListBG;					//!< Draw順ソート用コンテナ（常駐タスク）
+        TaskIndexMap indices;						//!< 通常タスクのID索引。破棄されたタスクの項目は即座に外す
+        TaskIndexMap bg_indices;					//!< 常駐タスクのID索引
+
+        std::uint64_t drawSeq = 0;					//!< 描画キューへの登録順カウンタ
+
+        CommandBuffer commands;						//!< 保留中の操作
+        int deferDepth = 0;							//!< タスク走査のネスト数。0より大きければ操作を保留する
+
+        std::unique_ptr<WorkStealingPool> workerPool;	//!< 並列実行用スレッドプール。nullptrなら逐次実行
+
+        bool typeBatched = false;					//!< 型別実行モードかどうか
+        bool typeBatchesValid = false;				//!< typeBatchesが最上位の階層のタスクと一致しているか
+        std::vector<TypeBatch> typeBatches;			//!< 型別のまとまり。最初に現れた型から順に並ぶ
+        std::unordered_map<std::type_index, std::size_t> typeBatchIndex;	//!< 型→typeBatchesの添字
+
+        bool graphExecution = false;				//!< 依存グラフ実行モードかどうか
+        bool graphValid = false;					//!< graphが最上位の階層のタスクと一致しているか
+        TaskGraph graph;							//!< 最上位の階層の通常タスクの依存グラフ
+        std::vector<std::size_t> graphPositions;	//!< グラフを作るときの作業用
+
+        bool awakeValid = false;					//!< awakeTasksが最上位の階層のタスクと一致しているか
+        std::vector<std::size_t> awakeTasks;		//!< 最上位の階層の、起きている通常タスクの位置。追加順に並ぶ（型別実行モードではtypeBatchesが代わりになる）
+        TaskTimerWheel sleepers;					//!< 最上位の階層の、眠っている通常タスク
+        bool awakeBgValid = false;					//!< awakeBgTasksがbg_tasksと一致しているか
+        std::vector<std::size_t> awakeBgTasks;		//!< 起きている常駐タスクの位置。追加順に並ぶ
+        TaskTimerWheel bgSleepers;					//!< 眠っている常駐タスク
+        std::vector<std::size_t> woken;				//!< 起きたタスクを集める作業用
+        std::atomic<bool> slept{ false };			//!< 列を走査した後に、眠ったタスクがあるか（並列実行中にも書かれる）
+
+        std::uint64_t tickFrame = 0;				//!< Executeの回数
+        double tickTime = 0;						//!< Executeに渡された経過時間の累積
+        std::unordered_map<unsigned int, unsigned int> tickPhaseCounters;	//!< 間隔→次に割り当てるフレーム
+
+        bool budgetActive = false;					//!< 予算つきのExecute中か
+        std::chrono::steady_clock::time_point budgetDeadline;	//!< 予算の期限
+        unsigned int maxDeferFrames = 4;			//!< 持ち越しが続いたとき、予算を超えても実行するフレーム数
+        std::vector<std::size_t> deferrableTasks;	//!< このフレームで予算内実行を待つタスクの位置
+        BudgetStats budgetStats;
+
+        std::shared_ptr<AsyncLogger> logger;		//!< ログの出力先。nullptrなら既定のログ
+        Mailbox<Message> mailbox;					//!< 他のスレッドから届いたメッセージ
+        EventBus events;							//!< タスク間のイベント
+        std::vector<std::vector<TaskBase*>> typeIndex;	//!< 型の番号→その型のタスク（順不同）
+
+        std::weak_ptr<const TaskSnapshot::Data> lastSnapshot;	//!< 直前に保存・復元したスナップショット
+        std::uint64_t snapshotGeneration = 0;		//!< 最後に振ったスナップショットの番号
+        std::uint64_t snapshotChunkSerial = 0;		//!< 最後に振ったまとまりの番号
+        ChunkFlags taskChunkChanged;				//!< 通常タスク配列のまとまりごとの、lastSnapshotからの変更の印
+        ChunkFlags bgChunkChanged;					//!< 常駐タスク配列のまとまりごとの、lastSnapshotからの変更の印
+        bool indicesChanged = true;					//!< lastSnapshotからindicesが変わったか
+        bool bgIndicesChanged = true;				//!< lastSnapshotからbg_indicesが変わったか
+        bool tickPhaseChanged = true;				//!< lastSnapshotからtickPhaseCountersが変わったか
+
+        TaskHandleTable handles;					//!< ハンドルの番号→タスク
+        TaskJournal* journal = nullptr;				//!< 入力とタスクの増減の通知先
+        int journalDepth = 0;						//!< 入力の処理のネスト数
+        bool headless = false;						//!< 描画なしモードかどうか
+
+        bool twoPhaseDraw = false;					//!< 描画準備モードかどうか
+        std::vector<TaskBase*> drawOrder;			//!< 描画準備モードで、このフレームに描画するタスク（描画順）
+
+#ifdef GTF_PROFILE
+        TaskProfiler profiler;
+#endif
+    };
+
+
+    template<class T>
+    void TypedTask<T>::RunBatch(TaskManager& manager, const std::size_t* positions, std::size_t count, double elapsedTime, std::forward_list<std::size_t>& deleteList)
+    {
+        // 実行時の型がちょうどTのタスクだけが来るので、静的に呼び出せる
+        manager.executePositions(manager.tasks, count, [positions](std::size_t k){ return positions[k]; },
+            [](TaskBase& task, double e){ return static_cast<T&>(task).T::Execute(e); }, elapsedTime, deleteList);
+    }
+
+}
+
+#include "coroutine.h"
+
+#ifdef GTF_HEADER_ONLY
+#   include "task.cpp"
+#endif
@@ -0,0 +1,270 @@
+﻿/*!
+*	@file
+*	@brief タスクの依存グラフ
+*/
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    class TaskGraph;
+
+    /*!
+    *	@ingroup System
+    *	@brief TaskBase::DeclareDependenciesで、タスクが読み書きするものと、後に実行するタスクを宣言する
+    *
+    *	読み書きするものは、型（Reads<Physics>()）か、オブジェクトのアドレス（Reads(&world)）で表す。
+    */
+    class TaskDependencies
+    {
+    public:
+        template<class R> void Reads() { Access(KeyOf<R>(), false); }		//!< 型Rを読む
+        template<class R> void Writes() { Access(KeyOf<R>(), true); }		//!< 型Rを書く
+        void Reads(const void* resource) { Access(resource, false); }		//!< resourceを読む
+        void Writes(const void* resource) { Access(resource, true); }		//!< resourceを書く
+        void After(unsigned int id) { after.push_back(id); }				//!< IDがidのタスクの後に実行する
+
+    private:
+        friend class TaskGraph;
+
+        template<class R>
+        static const void* KeyOf() NOEXCEPT
+        {
+            static const char tag = 0;
+            return &tag;
+        }
+        void Access(const void* resource, bool write)
+        {
+            accesses.push_back(Entry{ resource, write });
+        }
+        void Clear() NOEXCEPT
+        {
+            accesses.clear();
+            after.clear();
+        }
+
+        struct Entry {
+            const void* resource;
+            bool write;
+        };
+        std::vector<Entry> accesses;
+        std::vector<unsigned int> after;
+    };
+
+    /*!
+    *	@ingroup System
+    *	@brief タスクの依存グラフと、実行する段
+    *
+    *	タスクを追加順に並べ、同じものを書くタスク同士、読むタスクと書くタスクの間に、追加順の辺を張る。
+    *	Afterで宣言された辺も加える。依存を宣言しないタスクは、前後の全てのタスクとの間に辺を張る（追加順に実行される）。
+    *	辺をたどった深さごとに段に分け、同じ段のタスクは同時に実行してよい。
+    *	辺が循環している場合は、全てのタスクを追加順に1つずつの段にする。
+    */
+    class TaskGraph
+    {
+    public:
+        //! 依存グラフの大きさと、直前のフレームの実行時間
+        struct Stats {
+            std::size_t nodes = 0;					//!< タスク数
+            std::size_t edges = 0;					//!< 辺の数
+            std::size_t levels = 0;					//!< 段の数（最長経路のタスク数）
+            bool cyclic = false;					//!< 辺が循環していたか
+            std::uint64_t builds = 0;				//!< グラフを作り直した回数
+            double workTime = 0;					//!< 直前のフレームのExecuteの合計時間（秒）
+            double criticalPathTime = 0;			//!< 直前のフレームの、辺をたどって最も時間のかかる経路の時間（秒）
+        };
+
+        //! グラフを作る。positionsはタスクの位置を追加順に並べたもの
+        /*!
+        *	declare(pos, deps)は依存を宣言したかどうかを、idOf(pos)はタスクのIDを返す。
+        */
+        template<class Declare, class IdOf>
+        void Build(const std::vector<std::size_t>& positions, Declare declare, IdOf idOf)
+        {
+            const std::size_t n = positions.size();
+            nodes = positions;
+            edgeFrom.clear();
+            edgeTo.clear();
+            resources.clear();
+            ids.clear();
+            lastEdgeTo.assign(n, static_cast<std::size_t>(None));
+            for (std::size_t j = 0; j < n; j++){
+                const unsigned int id = idOf(nodes[j]);
+                if (id != 0)
+                    ids[id] = j;
+            }
+
+            std::size_t barrier = None;				// 直前の、依存を宣言しなかったタスク
+            for (std::size_t j = 0; j < n; j++){
+                deps.Clear();
+                if (!declare(nodes[j], deps)){
+                    for (std::size_t i = (barrier == None ? 0 : barrier); i < j; i++)
+                        AddEdge(i, j);
+                    barrier = j;
+                    resources.clear();
+                    continue;
+                }
+
+                if (barrier != None)
+                    AddEdge(barrier, j);
+                for (auto&& a : deps.accesses){
+                    Resource& r = resources[a.resource];
+                    if (r.writer != None)
+                        AddEdge(r.writer, j);
+                    if (a.write){
+                        for (std::size_t i : r.readers)
+                            AddEdge(i, j);
+                        r.readers.clear();
+                        r.writer = j;
+                    }
+                    else
+                        r.readers.push_back(j);
+                }
+                for (unsigned int id : deps.after){
+                    const auto it = ids.find(id);
+                    if (it != ids.end())
+                        AddEdge(it->second, j);
+                }
+            }
+            SortLevels();
+            times.assign(n, 0.0);
+            ++stats.builds;
+        }
+
+        std::size_t NodeCount() const NOEXCEPT { return nodes.size(); }
+        std::size_t LevelCount() const NOEXCEPT { return levelStart.empty() ? 0 : levelStart.size() - 1; }
+        //! 段levelのタスクの番号を、追加順に並べた範囲
+        const std::size_t* LevelBegin(std::size_t level) const NOEXCEPT { return order.data() + levelStart[level]; }
+        const std::size_t* LevelEnd(std::size_t level) const NOEXCEPT { return order.data() + levelStart[level + 1]; }
+        std::size_t PositionOf(std::size_t node) const NOEXCEPT { return nodes[node]; }	//!< タスクの位置
+
+        //! タスクのExecuteにかかった時間を記録する。別々のタスクなら、並列に呼んでよい
+        void SetTime(std::size_t node, double seconds) NOEXCEPT { times[node] = seconds; }
+
+        //! このフレームの時間から、最も時間のかかる経路を求める。記録した時間は0に戻る
+        void FinishFrame()
+        {
+            finish.assign(nodes.size(), 0.0);
+            double work = 0, critical = 0;
+            for (std::size_t node : order){
+                finish[node] += times[node];
+                work += times[node];
+                critical = std::max(critical, finish[node]);
+                for (std::size_t e = succStart[node]; e < succStart[node + 1]; e++)
+                    finish[succ[e]] = std::max(finish[succ[e]], finish[node]);
+                times[node] = 0;
+            }
+            stats.workTime = work;
+            stats.criticalPathTime = critical;
+        }
+
+        const Stats& GetStats() const NOEXCEPT { return stats; }
+
+    private:
+        static const std::size_t None = ~static_cast<std::size_t>(0);
+
+        struct Resource {
+            std::size_t writer = None;				//!< 最後に書くタスク
+            std::vector<std::size_t> readers;		//!< その後に読むタスク
+        };
+
+        void AddEdge(std::size_t from, std::size_t to)
+        {
+            // toに入る辺はまとめて張るので、fromから最後に張った辺を見れば重複を省ける
+            if (from == to || lastEdgeTo[from] == to)
+                return;
+            lastEdgeTo[from] = to;
+            edgeFrom.push_back(from);
+            edgeTo.push_back(to);
+        }
+
+        //! 辺の深さで段に分ける
+        void SortLevels()
+        {
+            const std::size_t n = nodes.size();
+            succStart.assign(n + 1, 0);
+            for (std::size_t from : edgeFrom)
+                ++succStart[from + 1];
+            for (std::size_t i = 0; i < n; i++)
+                succStart[i + 1] += succStart[i];
+            succ.resize(edgeFrom.size());
+            indegree.assign(n, 0);
+            fillPos.assign(succStart.begin(), succStart.end() - 1);
+            for (std::size_t e = 0; e < edgeFrom.size(); e++){
+                succ[fillPos[edgeFrom[e]]++] = edgeTo[e];
+                ++indegree[edgeTo[e]];
+            }
+
+            // 入次数0のタスクから順に、深さを決める
+            level.assign(n, 0);
+            order.clear();
+            for (std::size_t i = 0; i < n; i++){
+                if (indegree[i] == 0)
+                    order.push_back(i);
+            }
+            for (std::size_t k = 0; k < order.size(); k++){
+                const std::size_t node = order[k];
+                for (std::size_t e = succStart[node]; e < succStart[node + 1]; e++){
+                    const std::size_t s = succ[e];
+                    level[s] = std::max(level[s], level[node] + 1);
+                    if (--indegree[s] == 0)
+                        order.push_back(s);
+                }
+            }
+
+            stats.nodes = n;
+            stats.edges = edgeFrom.size();
+            stats.cyclic = order.size() != n;
+            if (stats.cyclic){
+                // 循環していれば、追加順に1つずつ実行する（辺も追加順の鎖にする）
+                succ.clear();
+                for (std::size_t i = 0; i < n; i++){
+                    level[i] = i;
+                    succStart[i] = succ.size();
+                    if (i + 1 < n)
+                        succ.push_back(i + 1);
+                }
+                succStart[n] = succ.size();
+            }
+
+            // 段の順、同じ段の中では追加順に並べる
+            order.resize(n);
+            for (std::size_t i = 0; i < n; i++)
+                order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b){ return level[a] < level[b]; });
+            levelStart.clear();
+            for (std::size_t k = 0; k < n; k++){
+                if (k == 0 || level[order[k]] != level[order[k - 1]])
+                    levelStart.push_back(k);
+            }
+            levelStart.push_back(n);
+            stats.levels = LevelCount();
+        }
+
+        std::vector<std::size_t> nodes;				//!< 番号→タスクの位置。番号は追加順
+        std::vector<std::size_t> edgeFrom;
+        std::vector<std::size_t> edgeTo;
+        std::vector<std::size_t> lastEdgeTo;		//!< 番号→最後に張った辺の行き先
+        std::vector<std::size_t> succStart;			//!< 番号→succでの開始位置
+        std::vector<std::size_t> succ;				//!< 辺の行き先を、出発点の番号順に並べたもの
+        std::vector<std::size_t> indegree;
+        std::vector<std::size_t> fillPos;			//!< succを埋めるときの作業用
+        std::vector<std::size_t> level;				//!< 番号→段
+        std::vector<std::size_t> order;				//!< 段の順に並べた番号
+        std::vector<std::size_t> levelStart;		//!< 段→orderでの開始位置
+        std::vector<double> times;					//!< 番号→このフレームのExecuteの時間
+        std::vector<double> finish;					//!< 番号→経路の時間の作業用
+        std::unordered_map<const void*, Resource> resources;
+        std::unordered_map<unsigned int, std::size_t> ids;	//!< ID→番号
+        TaskDependencies deps;
+        Stats stats;
+    };
+}
@@ -0,0 +1,225 @@
+﻿/*!
+*	@file
+*	@brief ワークスティーリング方式のスレッドプール
+*/
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <algorithm>
+#include <cassert>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief ワークスティーリング方式のスレッドプール
+    *
+    *	ParallelForに渡された範囲を小さな区間に分割し、各ワーカーのキューに配る。
+    *	自分のキューが空になったワーカーは、他のワーカーのキューの末尾から区間を盗んで処理する。
+    *	呼び出し元のスレッドもワーカー0番として処理に参加し、全区間の完了まで戻らない。
+    *
+    *	ParallelForは同時に一つしか実行できない。ワーカーの中から呼ばれた場合は、その場で逐次実行する。
+    */
+    class WorkStealingPool
+    {
+    public:
+        using RangeFunction = std::function<void(std::size_t /* begin */, std::size_t /* end */, unsigned int /* workerIndex */)>;
+
+        //! @param threadCount 呼び出し元スレッドとは別に起動するワーカースレッド数
+        explicit WorkStealingPool(unsigned int threadCount)
+            : queues(new Queue[threadCount + 1])
+        {
+            threads.reserve(threadCount);
+            for (unsigned int i = 0; i < threadCount; i++)
+                threads.emplace_back([this, i]{ WorkerLoop(i + 1); });
+        }
+
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            cvWork.notify_all();
+            for (auto&& t : threads) t.join();
+        }
+
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        //! 呼び出し元スレッドを含めたワーカー数
+        unsigned int GetWorkerCount() const NOEXCEPT { return static_cast<unsigned int>(threads.size()) + 1; }
+
+        /*!
+        *	@brief [0, count)をgrain個ずつの区間に分けて並列実行する
+        *
+        *	funcは(begin, end, workerIndex)で呼ばれる。workerIndexは0～GetWorkerCount()-1の値で、
+        *	同じworkerIndexの呼び出しが同時に走ることはない。
+        *	funcが例外を投げた場合、全区間の終了を待ってから最初の例外を呼び出し元に再送出する。
+        */
+        void ParallelFor(std::size_t count, std::size_t grain, const RangeFunction& func)
+        {
+            if (count == 0)
+                return;
+            if (grain == 0)
+                grain = 1;
+            if (currentPool() == this || threads.empty() || count <= grain){
+                func(0, count, currentPool() == this ? currentIndex() : 0);
+                return;
+            }
+
+            std::lock_guard<std::mutex> submit(submitMutex);
+            const std::size_t chunks = (count + grain - 1) / grain;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &func;
+                error = nullptr;
+                remaining.store(chunks);
+            }
+
+            // 区間をラウンドロビンで配る
+            const unsigned int workers = GetWorkerCount();
+            for (std::size_t c = 0; c < chunks; c++){
+                Queue& q = queues[c % workers];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                q.ranges.push_back(Range{ c * grain, std::min(count, (c + 1) * grain) });
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++generation;
+            }
+            cvWork.notify_all();
+
+            RunRanges(0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            cvDone.wait(lock, [this]{ return remaining.load() == 0; });
+            job = nullptr;
+            if (error){
+                std::exception_ptr e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+        }
+
+    private:
+        struct Range {
+            std::size_t begin;
+            std::size_t end;
+        };
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Range> ranges;
+        };
+
+        //! 現在のスレッドが所属しているプール
+        static const WorkStealingPool*& currentPool() NOEXCEPT
+        {
+            static thread_local const WorkStealingPool* pool = nullptr;
+            return pool;
+        }
+        //! 現在のスレッドのワーカー番号
+        static unsigned int& currentIndex() NOEXCEPT
+        {
+            static thread_local unsigned int index = 0;
+            return index;
+        }
+
+        void WorkerLoop(unsigned int index)
+        {
+            currentPool() = this;
+            currentIndex() = index;
+
+            unsigned long long seen = 0;
+            for (;;){
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cvWork.wait(lock, [this, seen]{ return quit || generation != seen; });
+                    if (quit)
+                        return;
+                    seen = generation;
+                }
+                RunRanges(index);
+            }
+        }
+
+        //! 自分のキューの先頭から取り出す
+        bool Pop(unsigned int index, Range& out)
+        {
+            Queue& q = queues[index];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.ranges.empty())
+                return false;
+            out = q.ranges.front();
+            q.ranges.pop_front();
+            return true;
+        }
+
+        //! 他のワーカーのキューの末尾から盗む
+        bool Steal(unsigned int index, Range& out)
+        {
+            const unsigned int workers = GetWorkerCount();
+            for (unsigned int n = 1; n < workers; n++){
+                Queue& q = queues[(index + n) % workers];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (!q.ranges.empty()){
+                    out = q.ranges.back();
+                    q.ranges.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void RunRanges(unsigned int index)
+        {
+            const WorkStealingPool* const prevPool = currentPool();
+            const unsigned int prevIndex = currentIndex();
+            currentPool() = this;
+            currentIndex() = index;
+
+            Range r;
+            while (Pop(index, r) || Steal(index, r)){
+                try{
+                    (*job)(r.begin, r.end, index);
+                }
+                catch (...){
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                if (remaining.fetch_sub(1) == 1){
+                    std::lock_guard<std::mutex> lock(mutex);
+                    cvDone.notify_all();
+                }
+            }
+
+            currentPool() = prevPool;
+            currentIndex() = prevIndex;
+        }
+
+        std::vector<std::thread> threads;
+        std::unique_ptr<Queue[]> queues;				//!< ワーカーごとの区間キュー。0番は呼び出し元スレッド用
+
+        std::mutex submitMutex;							//!< ParallelForの多重実行防止
+        std::mutex mutex;
+        std::condition_variable cvWork;
+        std::condition_variable cvDone;
+        const RangeFunction* job = nullptr;				//!< 実行中の処理
+        std::atomic<std::size_t> remaining{ 0 };		//!< 未完了の区間数
+        std::exception_ptr error;
+        unsigned long long generation = 0;
+        bool quit = false;
+    };
+}
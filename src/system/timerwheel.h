@@ -0,0 +1,264 @@
+﻿/*!
+*	@file
+*	@brief 眠っているタスクの階層タイマーホイール
+*/
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief 起きる時間ごとに、眠っているものを分けておく階層タイマーホイール
+    *
+    *	時間はtick（resolution秒）単位に切り上げる。64個の枠を4段重ね、下の段ほど近い時間を細かく分ける。
+    *	上の段の枠は、時間が近づいたときに下の段へ振り分け直す。
+    *	入れる・外す・起こすはO(1)で、Advanceは起きるものと、その間の空でない枠の数に比例する。
+    *	入るものはLinkを埋め込んでおき、ホイールは確保をしない（枠の連結リストになる）。
+    *	マネージャのスレッドからだけ使うこと。
+    */
+    class TaskTimerWheel
+    {
+    public:
+        static const std::uint64_t Never = ~static_cast<std::uint64_t>(0);	//!< 起こされるまで眠る
+
+        //! ホイールに入るものに埋め込むリンク。複製・代入しても、ホイールでの位置は移らない
+        struct Link {
+            Link() NOEXCEPT {}
+            Link(const Link&) NOEXCEPT {}							//!< 複製はどのホイールにも入っていない
+            Link& operator=(const Link&) NOEXCEPT { return *this; }	//!< 代入先が入っているホイールはそのまま
+
+            Link* prev = nullptr;
+            Link* next = nullptr;
+            TaskTimerWheel* wheel = nullptr;		//!< 入っているホイール。入っていなければnullptr
+            std::uint64_t tick = 0;					//!< 起きるtick
+            std::size_t value = 0;					//!< 起きたときにAdvanceが返す値
+            unsigned int bucket = 0;				//!< 入っているリストの番号
+        };
+
+        explicit TaskTimerWheel(double resolution = 1.0 / 1000) NOEXCEPT : resolution(resolution) {}
+        ~TaskTimerWheel(){ Clear(); }
+        TaskTimerWheel(const TaskTimerWheel&) = delete;
+        TaskTimerWheel& operator=(const TaskTimerWheel&) = delete;
+
+        //! 時間（秒）を、その時間以降で最初のtickに切り上げる。無限大ならNever
+        std::uint64_t TickOf(double time) const NOEXCEPT
+        {
+            if (!(time > 0))
+                return 0;
+            const double tick = std::ceil(time / resolution);
+            if (!(tick < 1.8e19))
+                return Never;
+            return static_cast<std::uint64_t>(tick);
+        }
+
+        //! tickに起きるものとして入れる。既に過ぎていれば、次のAdvanceで起きる
+        void Insert(Link& link, std::uint64_t tick, std::size_t value) NOEXCEPT
+        {
+            assert(!link.wheel);
+            link.wheel = this;
+            link.tick = tick;
+            link.value = value;
+            Place(link);
+            ++count;
+        }
+
+        //! 起こさずに外す
+        void Remove(Link& link) NOEXCEPT
+        {
+            assert(link.wheel == this);
+            Unlink(link);
+            link.wheel = nullptr;
+            --count;
+        }
+
+        //! 時間を待たずに、次のAdvanceで起こす
+        void Wake(Link& link) NOEXCEPT
+        {
+            assert(link.wheel == this);
+            Unlink(link);
+            link.tick = current;
+            Push(Due, link);
+        }
+
+        //! tickまで進め、起きたものの値をfiredに足す。起きたものはホイールから外れる
+        void Advance(std::uint64_t tick, std::vector<std::size_t>& fired)
+        {
+            FireList(Due, fired);
+            while (current < tick){
+                const std::uint64_t next = NextEvent();
+                if (next > tick){
+                    current = tick;
+                    break;
+                }
+                current = next;
+                // 段の区切りに来たら、上の段の枠を振り分け直す
+                for (unsigned int level = 1; level < Levels; level++){
+                    if ((current & ((static_cast<std::uint64_t>(1) << (Bits * level)) - 1)) != 0)
+                        break;
+                    Cascade(level, static_cast<unsigned int>(current >> (Bits * level)) & Mask);
+                }
+                FireList(static_cast<unsigned int>(current & Mask), fired);
+                FireList(Due, fired);
+            }
+        }
+
+        //! 全て起こさずに外す
+        void Clear() NOEXCEPT
+        {
+            for (unsigned int b = 0; b < Buckets; b++){
+                for (Link* link = heads[b]; link; ){
+                    Link* const next = link->next;
+                    link->prev = link->next = nullptr;
+                    link->wheel = nullptr;
+                    link = next;
+                }
+                heads[b] = nullptr;
+            }
+            for (auto&& o : occupied)
+                o = 0;
+            count = 0;
+        }
+
+        //! 全て起こさずに外し、tickから進め直す（時間が巻き戻った場合にも使える）
+        void Reset(std::uint64_t tick) NOEXCEPT
+        {
+            Clear();
+            current = tick;
+        }
+
+        std::size_t Size() const NOEXCEPT { return count; }						//!< 入っている数
+        std::uint64_t GetCurrentTick() const NOEXCEPT { return current; }		//!< 最後にAdvanceしたtick
+
+    private:
+        static const unsigned int Bits = 6;
+        static const unsigned int Slots = 1u << Bits;					//!< 1段の枠の数
+        static const std::uint64_t Mask = Slots - 1;
+        static const unsigned int Levels = 4;
+        static const unsigned int Due = Slots * Levels;					//!< 時間の過ぎたもののリスト
+        static const unsigned int Parked = Due + 1;						//!< 起こされるまで眠るもののリスト
+        static const unsigned int Buckets = Parked + 1;
+
+        //! 起きるtickに応じたリストに入れる
+        void Place(Link& link) NOEXCEPT
+        {
+            if (link.tick == Never){
+                Push(Parked, link);
+                return;
+            }
+            if (link.tick <= current){
+                Push(Due, link);
+                return;
+            }
+            const std::uint64_t delta = link.tick - current;
+            unsigned int level = 0;
+            while (level + 1 < Levels && delta >> (Bits * (level + 1)) != 0)
+                level++;
+            // 最上段より遠いものは、最上段の一番遠い枠に入れ、振り分け直すときに入れ直す
+            const std::uint64_t span = static_cast<std::uint64_t>(1) << (Bits * Levels);
+            const std::uint64_t tick = delta < span ? link.tick : current + span - 1;
+            const unsigned int slot = static_cast<unsigned int>(tick >> (Bits * level)) & Mask;
+            occupied[level] |= static_cast<std::uint64_t>(1) << slot;
+            Push(level * Slots + slot, link);
+        }
+
+        void Push(unsigned int bucket, Link& link) NOEXCEPT
+        {
+            link.bucket = bucket;
+            link.prev = nullptr;
+            link.next = heads[bucket];
+            if (link.next)
+                link.next->prev = &link;
+            heads[bucket] = &link;
+        }
+
+        void Unlink(Link& link) NOEXCEPT
+        {
+            if (link.prev)
+                link.prev->next = link.next;
+            else
+                heads[link.bucket] = link.next;
+            if (link.next)
+                link.next->prev = link.prev;
+            link.prev = link.next = nullptr;
+            if (link.bucket < Due && !heads[link.bucket])
+                occupied[link.bucket / Slots] &= ~(static_cast<std::uint64_t>(1) << (link.bucket % Slots));
+        }
+
+        //! リストのものを全て起こす
+        void FireList(unsigned int bucket, std::vector<std::size_t>& fired)
+        {
+            Link* link = heads[bucket];
+            heads[bucket] = nullptr;
+            if (bucket < Due)
+                occupied[bucket / Slots] &= ~(static_cast<std::uint64_t>(1) << (bucket % Slots));
+            while (link){
+                Link* const next = link->next;
+                link->prev = link->next = nullptr;
+                link->wheel = nullptr;
+                --count;
+                fired.push_back(link->value);
+                link = next;
+            }
+        }
+
+        //! 上の段の枠のものを、下の段に振り分け直す
+        void Cascade(unsigned int level, unsigned int slot) NOEXCEPT
+        {
+            const unsigned int bucket = level * Slots + slot;
+            Link* link = heads[bucket];
+            heads[bucket] = nullptr;
+            occupied[level] &= ~(static_cast<std::uint64_t>(1) << slot);
+            while (link){
+                Link* const next = link->next;
+                Place(*link);
+                link = next;
+            }
+        }
+
+        //! 次に枠を処理するtick。どの段も空ならNever
+        std::uint64_t NextEvent() const NOEXCEPT
+        {
+            std::uint64_t next = Never;
+            for (unsigned int level = 0; level < Levels; level++){
+                if (!occupied[level])
+                    continue;
+                // 枠は、その段の区切りが来たときに処理される。今の区切りより後ろの枠が先、なければ次の周
+                const unsigned int shift = Bits * level;
+                const std::uint64_t period = current >> shift;
+                const unsigned int slot = static_cast<unsigned int>(period & Mask);
+                const std::uint64_t ahead = slot == Mask ? 0 : occupied[level] & (~static_cast<std::uint64_t>(0) << (slot + 1));
+                const std::uint64_t target = (period & ~Mask) + (ahead ? LowestBit(ahead) : Slots + LowestBit(occupied[level]));
+                if (target < (Never >> shift))
+                    next = std::min(next, target << shift);
+            }
+            return next;
+        }
+
+        static unsigned int LowestBit(std::uint64_t bits) NOEXCEPT
+        {
+#if defined(__GNUC__)
+            return static_cast<unsigned int>(__builtin_ctzll(bits));
+#else
+            unsigned int n = 0;
+            for (; (bits & 1) == 0; bits >>= 1)
+                n++;
+            return n;
+#endif
+        }
+
+        double resolution;							//!< 1tickの秒数
+        std::uint64_t current = 0;					//!< 最後にAdvanceしたtick
+        std::size_t count = 0;
+        Link* heads[Buckets] = {};					//!< リストの番号→先頭
+        std::uint64_t occupied[Levels] = {};		//!< 段→空でない枠のビット
+    };
+}
@@ -0,0 +1,42 @@
+﻿/*!
+*	@file
+*	@brief 型ごとに静的に割り振る番号
+*/
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+#ifndef NOEXCEPT
+#define NOEXCEPT noexcept
+#endif
+
+namespace gtf
+{
+    /*!
+    *	@ingroup System
+    *	@brief 型ごとに0から順に割り振られる番号
+    *
+    *	Domainごとに別の番号が振られるので、用途ごとに配列の添字として使える。
+    *	番号は型が最初に使われた順に振られ、プログラムの実行中は変わらない。RTTIは使わない。
+    */
+    template<class Domain>
+    class TypeSlot
+    {
+    public:
+        static const std::size_t None = ~static_cast<std::size_t>(0);		//!< 番号なし
+
+        template<class T>
+        static std::size_t Of() NOEXCEPT
+        {
+            static const std::size_t slot = Next();
+            return slot;
+        }
+
+    private:
+        static std::size_t Next() NOEXCEPT
+        {
+            static std::atomic<std::size_t> counter{ 0 };
+            return counter++;
+        }
+    };
+}
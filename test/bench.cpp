@@ -0,0 +1,264 @@
+﻿#define GTF_HEADER_ONLY
+#include "../src/system/task.h"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+
+using namespace gtf;
+
+// 確保回数を数えるため、グローバルなoperator newを置き換える
+// インライン展開されるとgccが確保・解放の組み合わせ違いと誤検出するので、展開させない
+#if defined(__GNUC__)
+#   define BENCH_NOINLINE __attribute__((noinline))
+#else
+#   define BENCH_NOINLINE
+#endif
+static std::atomic<std::uint64_t> allocations{ 0 };
+
+BENCH_NOINLINE void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+BENCH_NOINLINE void operator delete(void* p) NOEXCEPT { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, std::size_t) NOEXCEPT { std::free(p); }
+
+static volatile std::uint64_t sink;
+
+//! タスクの構成
+struct Mix {
+    const char* name;
+    unsigned int drawEvery;		//!< n個に1個が描画あり。0なら描画なし
+    unsigned int idEvery;		//!< n個に1個がIDあり。0ならIDなし
+};
+
+static const Mix mixes[] = {
+    { "plain", 0, 0 },
+    { "drawable", 1, 0 },
+    { "id", 0, 1 },
+    { "mixed", 2, 4 },
+};
+
+class BenchTask : public TaskBase
+{
+public:
+    BenchTask(unsigned int id, int priority) : id(id), priority(priority) {}
+    bool Execute(double /* e */) override { sink = sink + 1; return true; }
+    void Draw() override { sink = sink + 1; }
+    unsigned int GetID() const override { return id; }
+    int GetDrawPriority() const override { return priority; }
+
+private:
+    unsigned int id;
+    int priority;
+};
+
+//! 1度Executeされた後は、ほとんど眠っているタスク
+class IdleBenchTask : public BenchTask
+{
+public:
+    IdleBenchTask(unsigned int id, int priority, bool idle) : BenchTask(id, priority), idle(idle) {}
+    bool Execute(double e) override
+    {
+        if (idle)
+            SleepFor(3600.0);
+        return BenchTask::Execute(e);
+    }
+
+private:
+    bool idle;
+};
+
+class BenchScene : public ExclusiveTaskBase
+{
+public:
+    BenchScene(unsigned int id, bool fallthrough) : ExclusiveTaskBase(fallthrough), id(id) {}
+    bool Execute(double /* e */) override { return alive; }
+    unsigned int GetID() const override { return id; }
+
+    bool alive = true;
+
+private:
+    unsigned int id;
+};
+
+//! 通常タスクのID。シーンのIDと重ならないようにする
+static unsigned int TaskID(const Mix& mix, std::size_t i)
+{
+    return (mix.idEvery != 0 && i % mix.idEvery == 0) ? static_cast<unsigned int>(i + 1000000) : 0;
+}
+
+static int TaskPriority(const Mix& mix, std::size_t i)
+{
+    return (mix.drawEvery != 0 && i % mix.drawEvery == 0) ? static_cast<int>(i * 7 % 16) : -1;
+}
+
+static void AddTasks(TaskManager& task, const Mix& mix, std::size_t begin, std::size_t end)
+{
+    for (std::size_t i = begin; i < end; i++)
+        task.AddNewTask<BenchTask>(TaskID(mix, i), TaskPriority(mix, i));
+}
+
+//! ルートのシーンを積んだマネージャ
+static void PushScene(TaskManager& task, unsigned int id, bool fallthrough = false)
+{
+    task.AddNewTask<BenchScene>(id, fallthrough);
+    task.Execute(0);
+}
+
+//! 計測結果を1件出力する
+class Reporter
+{
+public:
+    Reporter() { std::printf("{\"benchmarks\":["); }
+    ~Reporter() { std::printf("\n]}\n"); }
+
+    template<class F>
+    void Run(const char* name, const Mix& mix, std::size_t tasks, F body)
+    {
+        const std::uint64_t alloc0 = allocations.load();
+        const auto t0 = std::chrono::steady_clock::now();
+        const std::size_t ops = body();
+        const auto t1 = std::chrono::steady_clock::now();
+        const std::uint64_t alloc1 = allocations.load();
+        if (ops == 0)
+            return;
+
+        const double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        std::printf("%s\n{\"name\":\"%s\",\"mix\":\"%s\",\"tasks\":%zu,\"ops\":%zu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}",
+            first ? "" : ",", name, mix.name, tasks, ops, ns / ops, static_cast<double>(alloc1 - alloc0) / ops);
+        std::fflush(stdout);
+        first = false;
+    }
+
+private:
+    bool first = true;
+};
+
+int main(int argc, char** argv)
+{
+    // 引数で最大のタスク数の桁を指定する（既定は10^6）
+    const int maxExponent = argc > 1 ? std::atoi(argv[1]) : 6;
+
+    Reporter report;
+    for (int e = 2; e <= maxExponent; e++){
+        std::size_t n = 1;
+        for (int k = 0; k < e; k++)
+            n *= 10;
+        // 1回の計測でおよそ10^6タスク分の処理になるように繰り返す
+        const std::size_t frames = std::max<std::size_t>(3, 1000000 / n);
+
+        for (const Mix& mix : mixes){
+            {
+                TaskManager task;
+                PushScene(task, 1);
+                report.Run("AddNewTask", mix, n, [&]{
+                    AddTasks(task, mix, 0, n);
+                    return n;
+                });
+
+                report.Run("Execute", mix, n, [&]{
+                    for (std::size_t f = 0; f < frames; f++)
+                        task.Execute(1.0 / 60);
+                    return frames * n;
+                });
+
+                if (mix.drawEvery != 0){
+                    report.Run("Draw", mix, n, [&]{
+                        for (std::size_t f = 0; f < frames; f++)
+                            task.Draw();
+                        return frames * n;
+                    });
+                }
+
+                if (mix.idEvery != 0){
+                    report.Run("FindTask", mix, n, [&]{
+                        std::size_t found = 0;
+                        for (std::size_t i = 0; i < n; i += mix.idEvery)
+                            found += task.FindTask<BenchTask>(TaskID(mix, i)) != nullptr;
+                        sink = sink + found;
+                        return (n + mix.idEvery - 1) / mix.idEvery;
+                    });
+
+                    report.Run("FindHandle", mix, n, [&]{
+                        std::size_t found = 0;
+                        for (std::size_t i = 0; i < n; i += mix.idEvery)
+                            found += task.FindHandle<BenchTask>(TaskID(mix, i)).lock() != nullptr;
+                        sink = sink + found;
+                        return (n + mix.idEvery - 1) / mix.idEvery;
+                    });
+
+                    report.Run("RemoveTaskByID", mix, n, [&]{
+                        for (std::size_t i = 0; i < n; i += mix.idEvery)
+                            task.RemoveTaskByID(TaskID(mix, i));
+                        return (n + mix.idEvery - 1) / mix.idEvery;
+                    });
+                }
+            }
+
+            // n個のうち15/16が眠っているシーンのExecute
+            {
+                TaskManager task;
+                PushScene(task, 1);
+                for (std::size_t i = 0; i < n; i++)
+                    task.AddNewTask<IdleBenchTask>(TaskID(mix, i), TaskPriority(mix, i), i % 16 != 0);
+                task.Execute(1.0 / 60);
+                report.Run("ExecuteMostlySleeping", mix, n, [&]{
+                    for (std::size_t f = 0; f < frames; f++)
+                        task.Execute(1.0 / 60);
+                    return frames * n;
+                });
+            }
+
+            // n個のタスクを持つシーンの上に、小さなシーンを積んで外す
+            for (int fallthrough = 0; fallthrough < 2; fallthrough++){
+                TaskManager task;
+                PushScene(task, 1);
+                AddTasks(task, mix, 0, n);
+                const std::size_t cycles = std::max<std::size_t>(10, frames / 10);
+                report.Run(fallthrough ? "ExclusivePushPopFallthrough" : "ExclusivePushPop", mix, n, [&]{
+                    for (std::size_t c = 0; c < cycles; c++){
+                        PushScene(task, 2, fallthrough != 0);
+                        AddTasks(task, mix, 0, 16);
+                        task.Draw();
+                        std::static_pointer_cast<BenchScene>(task.GetTopExclusiveTask().lock())->alive = false;
+                        task.Execute(0);
+                    }
+                    return cycles;
+                });
+            }
+
+            // 8階層に分けたn個のタスクを、ルートまで戻して破棄する。積む処理は計測に含めない
+            {
+                const std::size_t reps = std::max<std::size_t>(1, 100000 / n);
+                const unsigned int depth = 8;
+                std::vector<std::unique_ptr<TaskManager>> managers;
+                for (std::size_t r = 0; r < reps; r++){
+                    managers.emplace_back(new TaskManager());
+                    TaskManager& task = *managers.back();
+                    PushScene(task, 1);
+                    for (unsigned int d = 0; d < depth; d++){
+                        PushScene(task, 2 + d);
+                        AddTasks(task, mix, n * d / depth, n * (d + 1) / depth);
+                    }
+                }
+                report.Run("RevertExclusiveTaskByID", mix, n, [&]{
+                    for (auto&& task : managers)
+                        task->RevertExclusiveTaskByID(1);
+                    return reps * n;
+                });
+            }
+        }
+    }
+    return 0;
+}
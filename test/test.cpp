@@ -1,8 +1,18 @@
 ﻿#define GTF_HEADER_ONLY
 #include "../iutest/include/iutest.hpp"
 #include "../src/system/task.h"
+#include "../src/system/shards.h"
+#include "../src/system/replay.h"
 
 #include <vector>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
 
 using namespace gtf;
 
@@ -262,6 +272,1574 @@ IUTEST(gtfTest, ExTaskSelfDeestruct)
     IUTEST_ASSERT_EQ(2, veve[1]);
     IUTEST_ASSERT_EQ(1, veve[2]);
 }
+IUTEST(gtfTest, ParallelExecute)
+{
+    class pt : public TaskBase
+    {
+    public:
+        pt(int init, bool parallel) : hogehoge(init), isParallel(parallel) {}
+        bool Execute(double /* e */) override { return ++count < hogehoge % 3 + 1; }
+        void Terminate() override { veve.push_back(hogehoge); }
+        bool IsParallelExecutable() const override { return isParallel; }
+
+        int hogehoge;
+        int count = 0;
+        bool isParallel;
+    };
+
+    std::vector<int> result[2];
+    for (int n = 0; n < 2; n++)
+    {
+        TaskManager task;
+        task.SetParallelExecution(n * 3);
+        veve.clear();
+        for (int i = 0; i < 1000; i++)
+            task.AddNewTask<pt>(i, i % 7 != 0);
+        for (int i = 0; i < 3; i++)
+            task.Execute(0);
+        result[n] = veve;
+    }
+    IUTEST_ASSERT_EQ(1000u, result[0].size());
+    IUTEST_ASSERT_EQ(result[0], result[1]);
+}
+IUTEST(gtfTest, ArenaOutlivesScene)
+{
+    TaskManager task;
+    auto ptr = task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    auto ptr2 = task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    IUTEST_ASSERT_TRUE(task.GetTopArena().expired());
+    auto child = task.AddNewTask< CTekitou<int, TaskBase> >(3);
+    auto child2 = task.AddNewTask< CTekitou<int, TaskBase> >(4);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(3).get(), (void*)child.get());
+
+    // 通常タスクは、制御ブロックごと階層のアリーナから1ブロックずつ確保される
+    const std::weak_ptr<const TaskArena> arena = task.GetTopArena();
+    IUTEST_ASSERT_FALSE(arena.expired());
+    IUTEST_ASSERT_EQ(2u, arena.lock()->GetBlockCount());
+
+    // 子タスクを持つ排他タスクがpopされても、保持しているタスクは有効なまま
+    task.RevertExclusiveTaskByID(1);
+    ptr2 = nullptr;
+    IUTEST_ASSERT_EQ((void*)task.GetTopExclusiveTask().lock().get(), (void*)ptr.get());
+    IUTEST_ASSERT_TRUE(task.GetTopArena().expired());
+    IUTEST_ASSERT_EQ(3, child->hogehoge);
+    IUTEST_ASSERT_EQ(4, child2->hogehoge);
+    IUTEST_ASSERT_EQ(2u, arena.lock()->GetBlockCount());
+
+    // 最後のタスクがなくなると、アリーナごと解放される
+    child = nullptr;
+    IUTEST_ASSERT_EQ(1u, arena.lock()->GetBlockCount());
+    child2 = nullptr;
+    IUTEST_ASSERT_TRUE(arena.expired());
+}
+IUTEST(gtfTest, ArenaThreads)
+{
+    // 作ったスレッド以外で確保・解放しても、使用中のブロック数は合う
+    TaskArena arena;
+    std::vector<void*> fromOwner[4];
+    for (auto&& v : fromOwner)
+        for (int i = 0; i < 500; ++i)
+            v.push_back(arena.Allocate(48, 8));
+    std::vector< std::pair<void*, std::size_t> > handed[4];
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t){
+        workers.emplace_back([&arena, &fromOwner, &handed, t]{
+            for (void* p : fromOwner[t])
+                arena.Deallocate(p, 48, 8);
+            std::vector< std::pair<void*, std::size_t> > own;
+            for (int i = 0; i < 1000; ++i){
+                const std::size_t size = 16 + i % 64 * 8;
+                void* p = arena.Allocate(size, 8);
+                std::memset(p, t, size);
+                (i % 2 ? own : handed[t]).emplace_back(p, size);
+            }
+            for (auto&& b : own)
+                arena.Deallocate(b.first, b.second, 8);
+        });
+    }
+    for (auto&& w : workers)
+        w.join();
+    IUTEST_ASSERT_EQ(2000u, arena.GetBlockCount());
+    for (auto&& v : handed)
+        for (auto&& b : v)
+            arena.Deallocate(b.first, b.second, 8);
+    IUTEST_ASSERT_EQ(0u, arena.GetBlockCount());
+
+    // 他のスレッドで解放されたブロックも、作ったスレッドで再利用される
+    std::vector<void*> used;
+    for (auto&& v : fromOwner)
+        used.insert(used.end(), v.begin(), v.end());
+    for (auto&& v : handed)
+        for (auto&& b : v)
+            used.push_back(b.first);
+    std::sort(used.begin(), used.end());
+    std::vector<void*> again;
+    for (int i = 0; i < 2000; ++i){
+        again.push_back(arena.Allocate(48, 8));
+        IUTEST_ASSERT_TRUE(std::binary_search(used.begin(), used.end(), again.back()));
+    }
+    IUTEST_ASSERT_EQ(2000u, arena.GetBlockCount());
+    for (void* p : again)
+        arena.Deallocate(p, 48, 8);
+    IUTEST_ASSERT_EQ(0u, arena.GetBlockCount());
+
+    // アラインメントの厳しい型は、アリーナの外でもアラインメントを守って確保される
+    class alignas(64) wide : public TaskBase
+    {
+    public:
+        char data[8];
+    };
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    auto w = task.AddNewTask<wide>();
+    IUTEST_ASSERT_EQ(0u, reinterpret_cast<std::uintptr_t>(w.get()) % 64);
+    void* p = arena.Allocate(200, 128);
+    IUTEST_ASSERT_EQ(0u, reinterpret_cast<std::uintptr_t>(p) % 128);
+    arena.Deallocate(p, 200, 128);
+}
+IUTEST(gtfTest, CompactKeepsScope)
+{
+    class dies : public TaskBase
+    {
+    public:
+        bool Execute(double /* e */) override { return false; }
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    for (int i = 0; i < 10; i++)
+        task.AddNewTask<dies>();
+    task.AddNewTask< CTekitou2<int, TaskBase> >(100);
+    task.Execute(0);
+
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    task.AddNewTask< CTekitou2<int, TaskBase> >(200);
+    veve.clear();
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(2u, veve.size());
+    IUTEST_ASSERT_EQ(2, veve[0]);
+    IUTEST_ASSERT_EQ(200, veve[1]);
+
+    task.RevertExclusiveTaskByID(1);
+    veve.clear();
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(2u, veve.size());
+    IUTEST_ASSERT_EQ(1, veve[0]);
+    IUTEST_ASSERT_EQ(100, veve[1]);
+}
+IUTEST(gtfTest, RemoveByIDReplaces)
+{
+    class dies : public CTekitou<int, TaskBase>
+    {
+    public:
+        dies(int init) : CTekitou<int, TaskBase>(init) {}
+        bool Execute(double /* e */) override { return false; }
+    };
+
+    TaskManager task;
+    std::shared_ptr<TaskBase> held[100];
+    for (int i = 0; i < 100; i++)
+        held[i] = task.AddNewTask< CTekitou<int, TaskBase> >(i % 10 + 1);
+    for (int i = 0; i < 10; i++)
+        IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(i + 1).get(), (void*)held[90 + i].get());
+
+    task.RemoveTaskByID(5);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(5).get(), (void*)nullptr);
+
+    auto d = task.AddNewTask<dies>(20);
+    task.Execute(0);
+    task.Execute(0);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(20).get(), (void*)nullptr);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(6).get(), (void*)held[95].get());
+}
+IUTEST(gtfTest, RemoveByIDAfterRevert)
+{
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    auto child = task.AddNewTask< CTekitou<int, TaskBase> >(3);
+
+    // popされた階層のタスクの索引は外れ、空いた位置に入ったタスクを指さない
+    task.RevertExclusiveTaskByID(1);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(3).get(), (void*)nullptr);
+    auto next = task.AddNewTask< CTekitou<int, TaskBase> >(5);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(3).get(), (void*)nullptr);
+    task.RemoveTaskByID(3);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(5).get(), (void*)next.get());
+    IUTEST_ASSERT_EQ(3, child->hogehoge);
+}
+template<class B>
+class CDrawPrio : public B
+{
+public:
+    CDrawPrio(int init, int prio) : hogehoge(init), priority(prio) {}
+
+    int hogehoge;
+    int priority;
+    unsigned int GetID() const override { return hogehoge; }
+    int GetDrawPriority() const override { return priority; }
+    void Draw() override { veve.push_back(hogehoge); }
+};
+
+IUTEST(gtfTest, DrawOrder)
+{
+    TaskManager task;
+    task.AddNewTask< CDrawPrio<TaskBase> >(1, 5);
+    task.AddNewTask< CDrawPrio<TaskBase> >(2, 10);
+    task.AddNewTask< CDrawPrio<TaskBase> >(3, 5);
+    task.AddNewTask< CDrawPrio<TaskBase> >(4, 0);
+    task.AddNewTask< CDrawPrio<TaskBase> >(5, -1);
+    task.AddNewTask< CDrawPrio<TaskBase> >(6, 10);
+
+    veve.clear();
+    task.Draw();
+    const int expected[] = { 2, 6, 1, 3, 4 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+
+    task.RemoveTaskByID(6);
+    task.RemoveTaskByID(3);
+    veve.clear();
+    task.Draw();
+    const int expected2[] = { 2, 1, 4 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+}
+IUTEST(gtfTest, DrawFallthroughRemove)
+{
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(100);
+    task.Execute(0);
+    task.AddNewTask< CDrawPrio<TaskBase> >(1, 5);
+    auto lower = task.AddNewTask< CDrawPrio<TaskBase> >(2, 3);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase, bool> >(200, true);
+    task.Execute(0);
+    task.AddNewTask< CDrawPrio<TaskBase> >(3, 4);
+
+    veve.clear();
+    task.Draw();
+    const int expected[] = { 1, 3, 2 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+
+    task.RemoveTaskByID(1);
+    veve.clear();
+    task.Draw();
+    const int expected2[] = { 3, 2 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+
+    // 下の階層の変更も反映される
+    task.SetDrawPriority(lower, 10);
+    veve.clear();
+    task.Draw();
+    const int expected3[] = { 2, 3 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected3), std::end(expected3)), veve);
+}
+IUTEST(gtfTest, DrawPriorityChange)
+{
+    TaskManager task;
+    auto t1 = task.AddNewTask< CDrawPrio<TaskBase> >(1, 5);
+    auto t2 = task.AddNewTask< CDrawPrio<TaskBase> >(2, 3);
+    auto t3 = task.AddNewTask< CDrawPrio<TaskBase> >(3, -1);
+
+    task.SetDrawPriority(t2, 10);
+    task.SetDrawPriority(t3, 5);
+    veve.clear();
+    task.Draw();
+    const int expected[] = { 2, 1, 3 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+
+    task.SetDrawPriority(t2, -1);
+    task.SetDrawPriority(t1, 0);
+    veve.clear();
+    task.Draw();
+    const int expected2[] = { 3, 1 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+
+    // 除去済みのタスクへの変更は無視される
+    task.RemoveTaskByID(3);
+    task.SetDrawPriority(t3, 7);
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(1u, veve.size());
+    IUTEST_ASSERT_EQ(1, veve[0]);
+
+    // 同じバケットの後ろの項目、前の項目の順に外しても、詰めた後の順序は変わらない
+    std::shared_ptr< CDrawPrio<TaskBase> > same[5];
+    for (int i = 0; i < 5; i++)
+        same[i] = task.AddNewTask< CDrawPrio<TaskBase> >(10 + i, 2);
+    task.SetDrawPriority(same[3], 4);
+    task.SetDrawPriority(same[1], 1);
+    for (int n = 0; n < 2; n++){
+        veve.clear();
+        task.Draw();
+        const int expected3[] = { 13, 10, 12, 14, 11, 1 };
+        IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected3), std::end(expected3)), veve);
+    }
+}
+IUTEST(gtfTest, DrawQueueChunks)
+{
+    // チャンクをまたぐ数のタスクを、まばらに・チャンクごとまとめて外しても、残りの描画順は変わらない
+    TaskManager task;
+    std::vector<int> expected;
+    for (int i = 1; i <= 500; i++){
+        task.AddNewTask< CDrawPrio<TaskBase> >(i, 2);
+        if (i % 3 != 0 && (i < 70 || i > 450))
+            expected.push_back(i);
+    }
+    for (int i = 3; i <= 500; i += 3)
+        task.RemoveTaskByID(i);
+    veve.clear();
+    task.Draw();
+    for (int i = 70; i <= 450; i++)
+        task.RemoveTaskByID(i);
+    for (int n = 0; n < 2; n++){
+        veve.clear();
+        task.Draw();
+        IUTEST_ASSERT_EQ(expected, veve);
+    }
+
+    // 空のチャンクが取り除かれた後も、除去・追加できる
+    for (int i = 1; i <= 500; i++){
+        if (i % 2 == 0)
+            task.RemoveTaskByID(i);
+    }
+    task.AddNewTask< CDrawPrio<TaskBase> >(1000, 2);
+    expected.erase(std::remove_if(expected.begin(), expected.end(), [](int id){ return id % 2 == 0; }), expected.end());
+    expected.push_back(1000);
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(expected, veve);
+}
+IUTEST(gtfTest, DeferredCommands)
+{
+    static TaskManager task;
+    class spawner : public CTekitou2<int, TaskBase>
+    {
+    public:
+        spawner(int init) : CTekitou2<int, TaskBase>(init) {}
+        bool Execute(double e) override
+        {
+            CTekitou2<int, TaskBase>::Execute(e);
+            task.AddNewTask< CTekitou2<int, TaskBase> >(hogehoge + 1);
+            task.RemoveTaskByID(hogehoge + 10);
+            return false;
+        }
+    };
+
+    task.Destroy();
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask<spawner>(100);
+    task.AddNewTask< CTekitou2<int, TaskBase> >(110);
+
+    // 追加されたタスクは次のフレームから、除去は走査の後で反映される
+    veve.clear();
+    task.Execute(0);
+    const int expected[] = { 1, 100, 110 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(110).get(), (void*)nullptr);
+
+    veve.clear();
+    task.Execute(0);
+    const int expected2[] = { 1, 101 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+    task.Destroy();
+}
+IUTEST(gtfTest, DeferredRevert)
+{
+    static TaskManager task;
+    class reverter : public CTekitou2<int, TaskBase>
+    {
+    public:
+        reverter(int init) : CTekitou2<int, TaskBase>(init) {}
+        bool Execute(double e) override
+        {
+            task.RevertExclusiveTaskByID(1);
+            // 巻き戻しは同期点まで保留されるので、自分はまだ破棄されていない
+            return CTekitou2<int, TaskBase>::Execute(e);
+        }
+        void Draw() override { task.RevertExclusiveTaskByID(1); }
+        int GetDrawPriority() const override { return 1; }
+    };
+
+    task.Destroy();
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    task.AddNewTask<reverter>(100);
+    task.AddNewTask< CTekitou2<int, TaskBase> >(110);
+
+    // 走査中の巻き戻しは、同じ階層の残りのタスクを実行してから反映される
+    veve.clear();
+    task.Execute(0);
+    const int expected[] = { 2, 100, 110 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ(1u, task.GetTopExclusiveTask().lock()->GetID());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(100).get(), (void*)nullptr);
+
+    // Draw中の巻き戻しも、描画の後で反映される
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    task.AddNewTask<reverter>(100);
+    task.Draw();
+    IUTEST_ASSERT_EQ(1u, task.GetTopExclusiveTask().lock()->GetID());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(100).get(), (void*)nullptr);
+    task.Destroy();
+}
+
+IUTEST(gtfTest, ParallelSpawn)
+{
+    static TaskManager* current;
+    class pt : public TaskBase
+    {
+    public:
+        pt(int init) : hogehoge(init) {}
+        bool Execute(double /* e */) override
+        {
+            if (hogehoge < 1000)
+                current->AddNewTask<pt>(hogehoge + 1000);
+            return hogehoge >= 1000;
+        }
+        void Initialize() override { veve.push_back(hogehoge); }
+        bool IsParallelExecutable() const override { return true; }
+        unsigned int GetID() const override { return hogehoge; }
+
+        int hogehoge;
+    };
+
+    std::vector<int> result[2];
+    for (int n = 0; n < 2; n++)
+    {
+        TaskManager task;
+        current = &task;
+        task.SetParallelExecution(n * 3);
+        for (int i = 0; i < 1000; i++)
+            task.AddNewTask<pt>(i);
+        veve.clear();
+        task.Execute(0);
+        task.Execute(0);
+        result[n] = veve;
+        IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(1500).get() != nullptr, true);
+    }
+    IUTEST_ASSERT_EQ(1000u, result[0].size());
+    IUTEST_ASSERT_EQ(result[0], result[1]);
+}
+
+template<class B>
+class CTyped : public B
+{
+public:
+    CTyped(int init) : hogehoge(init) {}
+    bool Execute(double /* e */) override { veve.push_back(hogehoge); return hogehoge % 2 == 0; }
+    unsigned int GetID() const override { return hogehoge; }
+
+    int hogehoge;
+};
+
+class CTypedA : public CTyped< TypedTask<CTypedA> >
+{
+public:
+    CTypedA(int init) : CTyped< TypedTask<CTypedA> >(init) {}
+};
+
+class CTypedA2 : public CTypedA
+{
+public:
+    CTypedA2(int init) : CTypedA(init) {}
+    bool Execute(double e) override { veve.push_back(-hogehoge); return CTypedA::Execute(e); }
+};
+
+IUTEST(gtfTest, TypeBatchedExecute)
+{
+    TaskManager task;
+    task.SetTypeBatchedExecution(true);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask<CTypedA>(2);
+    task.AddNewTask< CTyped<TaskBase> >(4);
+    task.AddNewTask<CTypedA2>(6);
+    task.AddNewTask<CTypedA>(8);
+    task.AddNewTask< CTyped<TaskBase> >(11);
+    task.AddNewTask<CTypedA>(12);
+
+    // 型ごとに、最初に現れた型から順に実行される。派生クラスは別の型として扱う
+    veve.clear();
+    task.Execute(0);
+    const int expected[] = { 1, 2, 8, 12, 4, 11, -6, 6 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(11).get(), (void*)nullptr);
+
+    // 上の階層では下の階層のタスクは実行されない
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(3);
+    task.Execute(0);
+    task.AddNewTask< CTyped<TaskBase> >(14);
+    task.AddNewTask<CTypedA>(16);
+    veve.clear();
+    task.Execute(0);
+    const int expected2[] = { 3, 14, 16 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+
+    task.RevertExclusiveTaskByID(1);
+    veve.clear();
+    task.Execute(0);
+    const int expected3[] = { 1, 2, 8, 12, 4, -6, 6 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected3), std::end(expected3)), veve);
+}
+
+IUTEST(gtfTest, TickInterval)
+{
+    static std::vector<double> elapsed;
+    class slow : public CTekitou2<int, TaskBase>
+    {
+    public:
+        slow(int init) : CTekitou2<int, TaskBase>(init) {}
+        bool Execute(double e) override
+        {
+            elapsed.push_back(e);
+            return CTekitou2<int, TaskBase>::Execute(e);
+        }
+        unsigned int GetTickInterval() const override { return 3; }
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(1.0);
+    for (int i = 10; i < 16; i++)
+        task.AddNewTask<slow>(i);
+
+    // 3フレームで全てのタスクが1回ずつ、各フレーム2つずつ実行される
+    veve.clear();
+    for (int f = 0; f < 3; f++){
+        const std::size_t before = veve.size();
+        task.Execute(1.0);
+        IUTEST_ASSERT_EQ(3u, veve.size() - before);
+    }
+    std::vector<int> ran(veve.begin(), veve.end());
+    std::sort(ran.begin(), ran.end());
+    const int expected[] = { 1, 1, 1, 10, 11, 12, 13, 14, 15 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), ran);
+
+    // 2回目以降は3フレーム分の経過時間が渡される
+    elapsed.clear();
+    for (int f = 0; f < 3; f++)
+        task.Execute(1.0);
+    IUTEST_ASSERT_EQ(std::vector<double>(6, 3.0), elapsed);
+}
+
+IUTEST(gtfTest, ExecuteBudget)
+{
+    static std::vector<double> elapsed;
+    class deferrable : public CTekitou2<int, TaskBase>
+    {
+    public:
+        deferrable(int init) : CTekitou2<int, TaskBase>(init) {}
+        bool Execute(double e) override
+        {
+            elapsed.push_back(e);
+            return CTekitou2<int, TaskBase>::Execute(e);
+        }
+        bool IsDeferrable() const override { return true; }
+    };
+
+    TaskManager task;
+    task.SetMaxDeferFrames(2);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(1.0);
+    task.AddNewTask< CTekitou2<int, TaskBase> >(2);
+    task.AddNewTask<deferrable>(3);
+    task.AddNewTask<deferrable>(4);
+
+    // 予算がなければ、持ち越せるタスクは2フレームまで持ち越される
+    veve.clear();
+    task.Execute(1.0, std::chrono::nanoseconds(0));
+    task.Execute(1.0, std::chrono::nanoseconds(0));
+    const int expected[] = { 1, 2, 1, 2 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ(2u, task.GetBudgetStats().deferred);
+    IUTEST_ASSERT_EQ(2u, task.GetBudgetStats().maxDeferredFrames);
+
+    // 3フレーム目は予算を超えても実行され、持ち越した分の経過時間が渡される
+    veve.clear();
+    task.Execute(1.0, std::chrono::nanoseconds(0));
+    const int expected2[] = { 1, 2, 3, 4 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+    IUTEST_ASSERT_EQ(2u, task.GetBudgetStats().forced);
+    IUTEST_ASSERT_EQ(std::vector<double>(2, 3.0), elapsed);
+
+    // 予算がある場合や、予算なしのExecuteでは毎フレーム実行される
+    veve.clear();
+    task.Execute(1.0, std::chrono::seconds(10));
+    task.Execute(1.0);
+    const int expected3[] = { 1, 2, 3, 4, 1, 2, 3, 4 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected3), std::end(expected3)), veve);
+}
+IUTEST(gtfTest, ExecuteBudgetRevert)
+{
+    static TaskManager task;
+    class reverter : public CTekitou2<int, TaskBase>
+    {
+    public:
+        reverter(int init) : CTekitou2<int, TaskBase>(init) {}
+        bool Execute(double e) override
+        {
+            task.RevertExclusiveTaskByID(1);
+            return CTekitou2<int, TaskBase>::Execute(e);
+        }
+        bool IsDeferrable() const override { return true; }
+    };
+
+    task.Destroy();
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    auto held = task.AddNewTask<reverter>(3);
+    task.AddNewTask<reverter>(4);
+    task.AddNewTask<reverter>(5);
+
+    // 持ち越せるタスクが排他タスクを戻しても、残りの持ち越せるタスクは無効な位置を実行しない
+    veve.clear();
+    task.Execute(0, std::chrono::seconds(10));
+    const int expected[] = { 2, 3, 4, 5 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ(1u, task.GetTopExclusiveTask().lock()->GetID());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<TaskBase>(3).get(), (void*)nullptr);
+    IUTEST_ASSERT_EQ(3, held->hogehoge);
+
+    veve.clear();
+    task.Execute(0, std::chrono::seconds(10));
+    IUTEST_ASSERT_EQ(1u, veve.size());
+    IUTEST_ASSERT_EQ(1, veve[0]);
+    task.Destroy();
+}
+
+IUTEST(gtfTest, PreloadExclusiveTask)
+{
+    static std::atomic<bool> release;
+    release = false;
+    class preloaded : public CTekitou2<int, ExclusiveTaskBase>
+    {
+    public:
+        preloaded(int init) : CTekitou2<int, ExclusiveTaskBase>(init) {}
+        void Preload() override
+        {
+            SetPreloadProgress(0.5f);
+            while (!release)
+                std::this_thread::yield();
+        }
+        void Initialize() override { veve.push_back(IsPreloaded() ? -hogehoge : 0); }
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    auto next = task.PreloadNewTask<preloaded>(2);
+    IUTEST_ASSERT_EQ(true, task.IsPreloading());
+
+    // Preloadが終わるまでは、今の排他タスクが動き続ける
+    veve.clear();
+    while (next->GetPreloadProgress() < 0.5f)
+        std::this_thread::yield();
+    task.Execute(0);
+    task.Execute(0);
+    const int expected[] = { 1, 1 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ(false, next->IsPreloaded());
+
+    // 終わった後のExecuteで、Initializeされて切り替わる
+    release = true;
+    while (!next->IsPreloaded())
+        std::this_thread::yield();
+    veve.clear();
+    task.Execute(0);
+    const int expected2[] = { -2, 2 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+    IUTEST_ASSERT_EQ((void*)task.GetTopExclusiveTask().lock().get(), (void*)next.get());
+    IUTEST_ASSERT_EQ(false, task.IsPreloading());
+    IUTEST_ASSERT_EQ(1.0f, next->GetPreloadProgress());
+}
+
+#ifdef GTF_COROUTINE
+IUTEST(gtfTest, CoroutineTask)
+{
+    static std::vector<double> elapsed;
+    class sequence : public CoroutineTask
+    {
+    public:
+        std::weak_ptr<TaskBase> target;
+    private:
+        Routine Run() override
+        {
+            veve.push_back(1);
+            co_await NextFrame();
+            veve.push_back(2);
+            co_await WaitSeconds(2.5);
+            veve.push_back(3);
+            elapsed.push_back(GetElapsedTime());
+            co_await WaitTerminate(target);
+            veve.push_back(4);
+        }
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(100);
+    task.Execute(1.0);
+    auto seq = task.AddNewTask<sequence>();
+    seq->target = task.AddNewTask< CTekitou<int, TaskBase> >(10);
+
+    // 2フレーム目に2.5秒待ち始め、3フレーム後に前回からの経過時間の合計で再開する
+    veve.clear();
+    for (int i = 0; i < 5; i++)
+        task.Execute(1.0);
+    const int expected[] = { 1, 2, 3 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_EQ(std::vector<double>(1, 3.0), elapsed);
+
+    // 待っているタスクがTerminateされるまでは再開しない
+    task.Execute(1.0);
+    task.Execute(1.0);
+    IUTEST_ASSERT_EQ(3u, veve.size());
+
+    // 待たれているタスクの複製を破棄しても、待っているタスクは起きない
+    {
+        CTekitou<int, TaskBase> copy(*task.FindTask< CTekitou<int, TaskBase> >(10));
+    }
+    task.Execute(1.0);
+    IUTEST_ASSERT_EQ(3u, veve.size());
+    task.RemoveTaskByID(10);
+    task.Execute(1.0);
+    IUTEST_ASSERT_EQ(4, veve.back());
+    task.Execute(1.0);
+    IUTEST_ASSERT_EQ(4u, veve.size());
+    IUTEST_ASSERT_EQ(1, static_cast<int>(seq.use_count()));
+}
+IUTEST(gtfTest, CoroutineTaskThrow)
+{
+    class thrower : public CoroutineTask
+    {
+        Routine Run() override
+        {
+            veve.push_back(1);
+            co_await NextFrame();
+            veve.push_back(2);
+            throw std::runtime_error("thrower");
+        }
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(100);
+    task.Execute(1.0);
+    std::weak_ptr<TaskBase> t = task.AddNewTask<thrower>();
+
+    // 例外を送出したコルーチンは再開されず、次のExecuteで破棄される
+    veve.clear();
+    for (int i = 0; i < 3; i++){
+        try{
+            task.Execute(1.0);
+        }
+        catch (const std::runtime_error&){
+        }
+    }
+    const int expected[] = { 1, 2 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+    IUTEST_ASSERT_TRUE(t.expired());
+}
+#endif
+
+IUTEST(gtfTest, ShardMailbox)
+{
+    // 複数のスレッドから送ったメッセージは、スレッドごとに送った順に届く
+    Mailbox<int> mailbox;
+    {
+        std::vector<std::thread> senders;
+        for (int t = 0; t < 4; t++)
+            senders.emplace_back([&mailbox, t]{ for (int i = 0; i < 1000; i++) mailbox.Post(t * 1000 + i); });
+        for (auto&& th : senders)
+            th.join();
+    }
+    std::vector<int> last(4, -1);
+    bool ordered = true;
+    IUTEST_ASSERT_EQ(4000u, mailbox.Receive([&](int v){
+        ordered = ordered && last[v / 1000] < v;
+        last[v / 1000] = v;
+    }));
+    IUTEST_ASSERT_EQ(true, ordered);
+    IUTEST_ASSERT_EQ(true, mailbox.Empty());
+
+    // 各マネージャは自分のスレッドで動き、隣のマネージャにタスクの追加を頼む
+    class relay : public TaskBase
+    {
+    public:
+        relay(TaskShards& s, unsigned int i) : shards(s), index(i) {}
+        bool Execute(double /* e */) override
+        {
+            const unsigned int next = (index + 1) % shards.GetCount();
+            const std::thread::id from = std::this_thread::get_id();
+            shards.Post(next, [from](TaskManager& task){
+                if (std::this_thread::get_id() != from)
+                    task.AddNewTask< CTekitou<int, TaskBase> >(7);
+            });
+            return false;
+        }
+    private:
+        TaskShards& shards;
+        unsigned int index;
+    };
+
+    TaskShards shards(3);
+    shards.Run([&shards](TaskManager& task, unsigned int i){
+        task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(100);
+        task.Execute(0);
+        task.AddNewTask<relay>(shards, i);
+    });
+    shards.Execute(0);
+    shards.Execute(0);
+    for (unsigned int i = 0; i < shards.GetCount(); i++)
+        IUTEST_ASSERT_NE((void*)shards.Get(i).FindTask<TaskBase>(7).get(), (void*)nullptr);
+}
+
+IUTEST(gtfTest, EventBus)
+{
+    struct Hit { int damage; };
+    class listener : public CTekitou<int, TaskBase>
+    {
+    public:
+        listener(TaskManager& m, int init) : CTekitou<int, TaskBase>(init), manager(m) {}
+        void Initialize() override
+        {
+            manager.Subscribe<Hit>(*this, [this](const Hit& h){ veve.push_back(hogehoge + h.damage); });
+        }
+    private:
+        TaskManager& manager;
+    };
+    class shooter : public TaskBase
+    {
+    public:
+        shooter(TaskManager& m) : manager(m) {}
+        bool Execute(double /* e */) override { manager.Publish(Hit{ 1 }); manager.Publish(Hit{ 2 }); return true; }
+    private:
+        TaskManager& manager;
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(100);
+    task.Execute(0);
+    task.AddNewTask<listener>(task, 10);
+    task.AddNewTask<shooter>(task);
+
+    // 発行順・購読順に、フレームの最後にまとめて配られる
+    veve.clear();
+    task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(200);
+    task.Execute(0);
+    task.AddNewTask<listener>(task, 20);
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(0u, veve.size());
+
+    // 下の階層に戻ると、上の階層のタスクの購読は解除されている
+    task.RevertExclusiveTaskByID(100);
+    task.Execute(0);
+    const int expected[] = { 11, 12 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), veve);
+
+    veve.clear();
+    task.AddNewTask<listener>(task, 30);
+    task.RemoveTaskByID(10);
+    task.Execute(0);
+    const int expected2[] = { 31, 32 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected2), std::end(expected2)), veve);
+}
+IUTEST(gtfTest, EventBusChain)
+{
+    struct Ping { int n; };
+    struct Pong { int n; };
+    class relay : public TaskBase
+    {
+    public:
+        relay(TaskManager& m) : manager(m) {}
+        void Initialize() override
+        {
+            // Pingの方が先に番号を振られる
+            manager.Subscribe<Ping>(*this, [this](const Ping& p){
+                veve.push_back(p.n);
+                if (p.n < 5)
+                    manager.Publish(Pong{ p.n + 1 });
+            });
+            manager.Subscribe<Pong>(*this, [this](const Pong& p){
+                veve.push_back(-p.n);
+                manager.Publish(Ping{ p.n + 1 });
+            });
+        }
+    private:
+        TaskManager& manager;
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou<int, ExclusiveTaskBase> >(100);
+    task.Execute(0);
+    task.AddNewTask<relay>(task);
+    task.Publish(Ping{ 1 });
+
+    // 配信中に発行されたイベントは、型の番号によらず次のExecuteで配られる
+    for (int i = 1; i <= 5; i++){
+        veve.clear();
+        task.Execute(0);
+        IUTEST_ASSERT_EQ(1u, veve.size());
+        IUTEST_ASSERT_EQ(i % 2 ? i : -i, veve[0]);
+    }
+    veve.clear();
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(0u, veve.size());
+}
+
+IUTEST(gtfTest, TasksOfType)
+{
+    using Normal = CTekitou<int, TaskBase>;
+    using Bg = CTekitou<int, BackgroundTaskBase>;
+    using Scene = CTekitou<int, ExclusiveTaskBase>;
+    using Other = CTekitou<long, TaskBase>;
+
+    TaskManager task;
+    auto scene = task.AddNewTask<Scene>(100);
+    task.Execute(0);
+    for (int i = 1; i <= 5; i++)
+        task.AddNewTask<Normal>(i);
+    task.AddNewTask< CTekitou2<int, TaskBase> >(6);
+    auto bg = task.AddNewTask<Bg>(50);
+
+    // 派生先の型は含まない
+    IUTEST_ASSERT_EQ(5u, task.GetTasksOfType<Normal>().size());
+    IUTEST_ASSERT_EQ(1u, task.GetTasksOfType<Bg>().size());
+    IUTEST_ASSERT_EQ((void*)&task.GetTasksOfType<Scene>()[0], (void*)scene.get());
+    IUTEST_ASSERT_EQ(true, task.GetTasksOfType<Other>().empty());
+
+    task.RemoveTaskByID(2);
+    task.RemoveTaskByID(5);
+    std::vector<int> ids;
+    for (Normal& t : task.GetTasksOfType<Normal>())
+        ids.push_back(t.hogehoge);
+    std::sort(ids.begin(), ids.end());
+    const int expected[] = { 1, 3, 4 };
+    IUTEST_ASSERT_EQ(std::vector<int>(std::begin(expected), std::end(expected)), ids);
+
+    // 排他タスクも、型を指定して探せる
+    IUTEST_ASSERT_EQ((void*)task.FindTask<Scene>(100).get(), (void*)scene.get());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<ExclusiveTaskBase>(100).get(), (void*)scene.get());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<Normal>(3).get(), (void*)task.FindTask<TaskBase>(3).get());
+    IUTEST_ASSERT_EQ((void*)task.FindTask<Normal>(6).get(), (void*)nullptr);
+    IUTEST_ASSERT_EQ((void*)task.FindTask<Bg>(50).get(), (void*)bg.get());
+
+    // 階層ごと破棄されると、索引からも外れる
+    task.RevertExclusiveTaskByID(0);
+    IUTEST_ASSERT_EQ(0u, task.GetTasksOfType<Normal>().size());
+    IUTEST_ASSERT_EQ(0u, task.GetTasksOfType<Scene>().size());
+    IUTEST_ASSERT_EQ(1u, task.GetTasksOfType<Bg>().size());
+}
+
+IUTEST(gtfTest, TwoPhaseDraw)
+{
+    static std::atomic<int> prepared;
+    class prepare : public CDrawPrio<TaskBase>
+    {
+    public:
+        prepare(int init, int prio) : CDrawPrio<TaskBase>(init, prio) {}
+        void PrepareDraw() override { value = hogehoge * 10; ++prepared; }
+        void Draw() override { veve.push_back(value + prepared); }
+    private:
+        int value = 0;
+    };
+    class prepareBG : public CDrawPrio<BackgroundTaskBase>
+    {
+    public:
+        prepareBG(int init, int prio) : CDrawPrio<BackgroundTaskBase>(init, prio) {}
+        void PrepareDraw() override { ++prepared; }
+    };
+
+    // 全てのPrepareDrawが終わってから、通常のDrawと同じ順にDrawされる
+    TaskManager task;
+    task.SetParallelExecution(3);
+    task.SetTwoPhaseDraw(true);
+    for (int i = 0; i < 200; i++)
+        task.AddNewTask<prepare>(i + 1, i % 7);
+    task.AddNewTask<prepareBG>(1000, 3);
+
+    prepared = 0;
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(201, prepared.load());
+    IUTEST_ASSERT_EQ(201u, veve.size());
+
+    std::vector<int> order;
+    order.swap(veve);
+    task.SetTwoPhaseDraw(false);
+    task.Draw();
+    IUTEST_ASSERT_EQ(order, veve);
+}
+
+IUTEST(gtfTest, Rollback)
+{
+    class counter : public TaskBase
+    {
+    public:
+        counter(unsigned int i, bool t, int s) : id(i), tracked(t), step(s) {}
+        bool Execute(double /* e */) override
+        {
+            if (step != 0){
+                value += step;
+                TouchState();
+            }
+            return true;
+        }
+        void Draw() override { veve.push_back(static_cast<int>(id) * 1000 + value); }
+        unsigned int GetID() const override { return id; }
+        int GetDrawPriority() const override { return static_cast<int>(id % 3); }
+        void SaveState(StateWriter& out) const override { out.Write(value); }
+        void LoadState(StateReader& in) override { in.Read(value); }
+        bool IsStateTracked() const override { return tracked; }
+
+        unsigned int id;
+        bool tracked;
+        int step;
+        int value = 0;
+    };
+
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask<counter>(10, true, 1);
+    task.AddNewTask<counter>(11, false, 2);
+    task.AddNewTask<counter>(12, true, 0);
+    task.Execute(0);
+    task.Execute(0);
+
+    TaskSnapshot s0, s1;
+    task.SaveSnapshot(s0);
+    IUTEST_ASSERT_EQ(4u, s0.GetTaskCount());
+    IUTEST_ASSERT_EQ(4u, s0.GetSerializedCount());
+
+    // 状態の変わっていないタスク（12）は、前回の内容がコピーされる
+    task.Execute(0);
+    task.SaveSnapshot(s1);
+    IUTEST_ASSERT_EQ(3u, s1.GetSerializedCount());
+    IUTEST_ASSERT_EQ(s0.GetByteSize(), s1.GetByteSize());
+    veve.clear();
+    task.Draw();
+    std::vector<int> drawn;
+    drawn.swap(veve);
+
+    // 破棄・追加・排他タスクの切り替えを、まとめて巻き戻す
+    task.Execute(0);
+    task.RemoveTaskByID(10);
+    task.AddNewTask<counter>(13, true, 1);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(2u, task.GetTopExclusiveTask().lock()->GetID());
+
+    IUTEST_ASSERT_EQ(3u, task.LoadSnapshot(s1));
+    IUTEST_ASSERT_EQ(1u, task.GetTopExclusiveTask().lock()->GetID());
+    IUTEST_ASSERT_FALSE(task.FindTask<counter>(13));
+    IUTEST_ASSERT_EQ(3, task.FindTask<counter>(10)->value);
+    IUTEST_ASSERT_EQ(6, task.FindTask<counter>(11)->value);
+    IUTEST_ASSERT_EQ(3u, task.GetTasksOfType<counter>().size());
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(drawn, veve);
+
+    // 巻き戻した後も、そのまま進められる
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(4, task.FindTask<counter>(10)->value);
+    IUTEST_ASSERT_EQ(3u, task.LoadSnapshot(s0));
+    IUTEST_ASSERT_EQ(2, task.FindTask<counter>(10)->value);
+    task.SaveSnapshot(s1);
+    IUTEST_ASSERT_EQ(2u, s1.GetSerializedCount());
+}
+
+IUTEST(gtfTest, SnapshotSharesChunks)
+{
+    class cell : public TaskBase
+    {
+    public:
+        explicit cell(unsigned int i) : id(i) {}
+        unsigned int GetID() const override { return id; }
+        void SaveState(StateWriter& out) const override { out.Write(value); }
+        void LoadState(StateReader& in) override { in.Read(value); }
+        bool IsStateTracked() const override { return true; }
+        void Set(int v)
+        {
+            value = v;
+            TouchState();
+        }
+
+        unsigned int id;
+        int value = 0;
+    };
+
+    const std::size_t n = 200;
+    const std::size_t chunk = TaskSnapshot::ChunkSize;
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    std::vector<std::shared_ptr<cell>> cells;
+    for (unsigned int i = 0; i < n; i++)
+        cells.push_back(task.AddNewTask<cell>(i + 10));
+
+    TaskSnapshot s0, s1, s2;
+    task.SaveSnapshot(s0);
+    IUTEST_ASSERT_EQ(n + 1, s0.GetSerializedCount());
+    IUTEST_ASSERT_EQ(0u, s0.GetSharedCount());
+
+    // 何も変わっていなければ、通常タスクは全て共有される（排他タスクは毎回保存する）
+    task.Execute(0);
+    task.SaveSnapshot(s1);
+    IUTEST_ASSERT_EQ(n + 1, s1.GetTaskCount());
+    IUTEST_ASSERT_EQ(n, s1.GetSharedCount());
+    IUTEST_ASSERT_EQ(1u, s1.GetSerializedCount());
+    IUTEST_ASSERT_EQ(s0.GetByteSize(), s1.GetByteSize());
+
+    // 状態の変わったタスクのまとまりだけが作り直される
+    cells[chunk + 3]->Set(5);
+    task.SaveSnapshot(s2);
+    IUTEST_ASSERT_EQ(n - chunk, s2.GetSharedCount());
+    IUTEST_ASSERT_EQ(2u, s2.GetSerializedCount());
+
+    // 破棄も、そのまとまりだけが変わる
+    task.RemoveTaskByID(static_cast<unsigned int>(n) + 9);
+    task.SaveSnapshot(s0);
+    IUTEST_ASSERT_EQ(n, s0.GetTaskCount());
+    IUTEST_ASSERT_EQ(n - n % chunk, s0.GetSharedCount());
+    IUTEST_ASSERT_EQ(1u, s0.GetSerializedCount());
+
+    // 共有したまとまりからも元に戻せる
+    cells[chunk + 3]->Set(7);
+    IUTEST_ASSERT_EQ(3u, task.LoadSnapshot(s1));
+    IUTEST_ASSERT_EQ(0, cells[chunk + 3]->value);
+    IUTEST_ASSERT_TRUE(task.FindTask<cell>(static_cast<unsigned int>(n) + 9));
+    task.SaveSnapshot(s2);
+    IUTEST_ASSERT_EQ(n - chunk - n % chunk, s2.GetSharedCount());
+    IUTEST_ASSERT_EQ(1u, s2.GetSerializedCount());
+    IUTEST_ASSERT_EQ(s1.GetByteSize(), s2.GetByteSize());
+}
+
+IUTEST(gtfTest, RecordReplay)
+{
+    static int input;
+    static double total;
+    class child : public TaskBase
+    {
+    public:
+        explicit child(int v) : value(v) {}
+        bool Execute(double e) override { total += e * value; return ++frames < 3; }
+    private:
+        int value;
+        int frames = 0;
+    };
+    class spawner : public TaskBase
+    {
+    public:
+        explicit spawner(TaskManager& m) : manager(m) {}
+        bool Execute(double /* e */) override
+        {
+            if (input % 2)
+                manager.AddNewTask<child>(input);
+            return true;
+        }
+        unsigned int GetID() const override { return 7; }
+    private:
+        TaskManager& manager;
+    };
+    class scene : public ExclusiveTaskBase {};
+
+    // 入力と、外からのタスクの追加・除去を記録する
+    std::stringstream log;
+    {
+        TaskManager task;
+        TaskRecorder recorder(log);
+        task.SetJournal(&recorder);
+        task.AddNewTask<scene>();
+        task.AddNewTask<spawner>(task);
+        total = 0;
+        for (int i = 0; i < 100; i++){
+            recorder.Input(&i, sizeof(i));
+            input = i;
+            task.Execute(1.0 / 60);
+            if (i == 50)
+                task.RemoveTaskByID(7);
+            if (i == 60)
+                task.AddNewTask<spawner>(task);
+        }
+        IUTEST_ASSERT_EQ(100u, recorder.GetFrameCount());
+    }
+    const double recorded = total;
+
+    // 描画なしで再生すると、同じ結果になる
+    const auto play = [&log](bool sameFactory) -> std::shared_ptr<TaskReplayer>
+    {
+        log.clear();
+        log.seekg(0);
+        auto replay = std::make_shared<TaskReplayer>(log);
+        replay->Register<scene>();
+        if (sameFactory)
+            replay->Register<spawner>([](TaskManager& m, unsigned int){ m.AddNewTask<spawner>(m); });
+        else
+            replay->Register<spawner>([](TaskManager& m, unsigned int){ m.AddNewTask<spawner>(m); m.AddNewTask<child>(1); });
+        replay->SetInputHandler([](TaskManager&, const unsigned char* data, std::size_t size){ std::memcpy(&input, data, size); });
+
+        TaskManager task;
+        task.SetHeadless(true);
+        total = 0;
+        replay->Run(task);
+        return replay;
+    };
+    auto replay = play(true);
+    IUTEST_ASSERT_EQ(100u, replay->GetFrameCount());
+    IUTEST_ASSERT_TRUE(replay->IsEnded());
+    IUTEST_ASSERT_FALSE(replay->HasDiverged());
+    IUTEST_ASSERT_EQ(recorded, total);
+
+    // 記録と違うタスクが追加されたら、そこで止まる
+    replay = play(false);
+    IUTEST_ASSERT_TRUE(replay->HasDiverged());
+    IUTEST_ASSERT_EQ(0u, replay->GetFrameCount());
+
+    // 描画なしモードではDrawせず、戻すと描画キューが作り直される
+    TaskManager task;
+    task.SetHeadless(true);
+    task.AddNewTask< CTekitou<int, TaskBase> >(3);
+    task.AddNewTask< CTekitou<int, TaskBase> >(4);
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(0u, veve.size());
+    task.SetHeadless(false);
+    task.Draw();
+    IUTEST_ASSERT_EQ(2u, veve.size());
+    IUTEST_ASSERT_EQ(3, veve[0]);
+    IUTEST_ASSERT_EQ(4, veve[1]);
+}
+
+IUTEST(gtfTest, GraphExecute)
+{
+    struct Physics {};
+    static std::atomic<int> counter;
+    class node : public TaskBase
+    {
+    public:
+        node(unsigned int i, int w, int r, unsigned int a) : id(i), writes(w), reads(r), after(a) {}
+        bool Execute(double /* e */) override { ran = counter++; return true; }
+        unsigned int GetID() const override { return id; }
+        bool DeclareDependencies(TaskDependencies& deps) const override
+        {
+            if (writes < 0 && reads < 0 && after == 0)
+                return false;
+            if (writes >= 0)
+                deps.Writes<Physics>();
+            if (reads >= 0)
+                deps.Reads<Physics>();
+            if (after != 0)
+                deps.After(after);
+            return true;
+        }
+
+        unsigned int id;
+        int writes;
+        int reads;
+        unsigned int after;
+        int ran = -1;
+    };
+
+    TaskManager task;
+    task.SetParallelExecution(3);
+    task.SetGraphExecution(true);
+    auto first = task.AddNewTask<node>(1, -1, -1, 0);		// 宣言なし
+    auto physics = task.AddNewTask<node>(2, 0, -1, 0);
+    std::vector<std::shared_ptr<node>> readers;
+    for (unsigned int i = 0; i < 4; i++)
+        readers.push_back(task.AddNewTask<node>(10 + i, -1, 0, 0));
+    auto late = task.AddNewTask<node>(3, 0, -1, 0);
+    auto ordered = task.AddNewTask<node>(4, -1, -1, 0);	// 宣言なし
+    auto tail = task.AddNewTask<node>(5, -1, 0, 0);		// 読むだけ。lateの後
+
+    counter = 0;
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(0, first->ran);
+    IUTEST_ASSERT_EQ(1, physics->ran);
+    for (auto&& r : readers){
+        IUTEST_ASSERT_LT(physics->ran, r->ran);
+        IUTEST_ASSERT_LT(r->ran, late->ran);
+    }
+    IUTEST_ASSERT_EQ(7, ordered->ran);
+    IUTEST_ASSERT_EQ(8, tail->ran);
+
+    const TaskGraph::Stats& stats = task.GetGraphStats();
+    IUTEST_ASSERT_EQ(9u, stats.nodes);
+    IUTEST_ASSERT_EQ(6u, stats.levels);
+    IUTEST_ASSERT_FALSE(stats.cyclic);
+    IUTEST_ASSERT_LE(stats.criticalPathTime, stats.workTime);
+
+    // タスクが変わらなければ、グラフは作り直さない
+    const std::uint64_t builds = stats.builds;
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(builds, task.GetGraphStats().builds);
+    task.RemoveTaskByID(12);
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(builds + 1, task.GetGraphStats().builds);
+    IUTEST_ASSERT_EQ(8u, task.GetGraphStats().nodes);
+
+    // 循環していれば追加順
+    TaskManager cyclic;
+    cyclic.SetLogger(std::make_shared<AsyncLogger>(16, [](const std::string&){}));
+    cyclic.SetGraphExecution(true);
+    auto x = cyclic.AddNewTask<node>(20, -1, -1, 21);
+    auto y = cyclic.AddNewTask<node>(21, -1, -1, 20);
+    counter = 0;
+    cyclic.Execute(0);
+    IUTEST_ASSERT_TRUE(cyclic.GetGraphStats().cyclic);
+    IUTEST_ASSERT_EQ(0, x->ran);
+    IUTEST_ASSERT_EQ(1, y->ran);
+}
+
+IUTEST(gtfTest, TaskHandle)
+{
+    using Normal = CTekitou<int, TaskBase>;
+    using Bg = CTekitou2<int, BackgroundTaskBase>;
+    using Ex = CTekitou2<int, ExclusiveTaskBase>;
+
+    TaskManager task;
+    task.AddNewTask<Ex>(7);
+    task.Execute(0);
+    task.AddNewTask<Normal>(5);
+    task.AddNewTask<Bg>(6);
+
+    TaskHandle<Normal> h = task.FindHandle<Normal>(5);
+    IUTEST_ASSERT_TRUE(static_cast<bool>(h));
+    IUTEST_ASSERT_EQ(5, h->hogehoge);
+    IUTEST_ASSERT_EQ(task.FindTask<Normal>(5).get(), h.lock());
+    IUTEST_ASSERT_EQ(6, task.FindHandle<Bg>(6)->hogehoge);
+    IUTEST_ASSERT_EQ(7u, task.GetTopExclusiveHandle()->GetID());
+    IUTEST_ASSERT_TRUE(task.FindHandle<Ex>(7) == task.GetHandle(*task.FindTask<Ex>(7)));
+    IUTEST_ASSERT_TRUE(task.FindHandle<Bg>(5).expired());
+
+    // 除去されたタスクのハンドルは、番号が使い回されても無効のまま
+    TaskManager::TaskRef base = h;
+    task.RemoveTaskByID(5);
+    IUTEST_ASSERT_TRUE(h.expired());
+    IUTEST_ASSERT_TRUE(base.expired());
+    auto added = task.AddNewTask<Normal>(8);
+    TaskManager::TaskRef next = task.GetHandle(*added);
+    IUTEST_ASSERT_TRUE(next != base);
+    IUTEST_ASSERT_TRUE(base.expired());
+    IUTEST_ASSERT_EQ(static_cast<TaskBase*>(added.get()), next.lock());
+
+    // ハンドルで描画プライオリティを変えられる
+    task.SetDrawPriority(next, -1);
+    veve.clear();
+    task.Draw();
+    IUTEST_ASSERT_EQ(0u, veve.size());
+}
+
+IUTEST(gtfTest, CopyLiveTask)
+{
+    static int executed;
+    class bullet : public TypedTask<bullet>
+    {
+    public:
+        explicit bullet(int v) : value(v) {}
+        bool Execute(double /* e */) { ++executed; return value >= 0; }
+        int value;
+    };
+
+    TaskManager task;
+    task.SetTypeBatchedExecution(true);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    auto a = task.AddNewTask<bullet>(1);
+    task.Execute(0);
+
+    // 登録中のタスクを複製しても、別のハンドル・索引の位置が割り当てられる
+    auto b = task.AddNewTask<bullet>(*a);
+    TaskManager::TaskRef hb = task.GetHandle(*b);
+    IUTEST_ASSERT_TRUE(task.GetHandle(*a) != task.GetHandle(*b));
+    IUTEST_ASSERT_EQ(2u, task.GetTasksOfType<bullet>().size());
+    executed = 0;
+    task.Execute(0);
+    IUTEST_ASSERT_EQ(2, executed);
+
+    // 元のタスクが除去され、その番号が使い回されても、複製のハンドルは複製を指したまま
+    a->value = -1;
+    task.Execute(0);
+    auto c = task.AddNewTask<bullet>(3);
+    IUTEST_ASSERT_EQ(static_cast<TaskBase*>(b.get()), hb.lock());
+    IUTEST_ASSERT_EQ(c.get(), task.GetHandle(*c).lock());
+    IUTEST_ASSERT_EQ(2u, task.GetTasksOfType<bullet>().size());
+    a.reset();
+    IUTEST_ASSERT_EQ(static_cast<TaskBase*>(b.get()), hb.lock());
+}
+
+IUTEST(gtfTest, SleepingTasks)
+{
+    static std::vector<int> ran;
+    static std::vector<double> elapsed;
+    class sleeper : public TaskBase
+    {
+    public:
+        sleeper(unsigned int id, double seconds) : id(id), seconds(seconds) {}
+        bool Execute(double e) override
+        {
+            ran.push_back(static_cast<int>(id));
+            elapsed.push_back(e);
+            if (seconds < 0)
+                SleepUntilWoken();
+            else
+                SleepFor(seconds);
+            return true;
+        }
+        unsigned int GetID() const override { return id; }
+
+    private:
+        unsigned int id;
+        double seconds;
+    };
+    using Ints = std::vector<int>;
+    using Doubles = std::vector<double>;
+
+    for (int batched = 0; batched < 2; batched++){
+        TaskManager task;
+        task.SetTypeBatchedExecution(batched != 0);
+        task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+        task.Execute(0.25);
+        task.AddNewTask<sleeper>(10, 1.0);
+        task.AddNewTask<sleeper>(11, -1.0);
+        task.AddNewTask<sleeper>(12, 0.5);
+        task.AddNewTask<sleeper>(13, 20000.0);		// タイマーホイールの最上段より遠い
+
+        ran.clear();
+        task.Execute(0.25);
+        IUTEST_ASSERT_EQ(Ints({ 10, 11, 12, 13 }), ran);
+        IUTEST_ASSERT_EQ(4u, task.GetSleepingCount());
+
+        // 起きる時間が来たフレームで、追加順にExecuteされる。経過時間は前回からの合計
+        ran.clear();
+        elapsed.clear();
+        for (int f = 0; f < 4; f++)
+            task.Execute(0.25);
+        IUTEST_ASSERT_EQ(Ints({ 12, 10, 12 }), ran);
+        IUTEST_ASSERT_EQ(Doubles({ 0.5, 1.0, 0.5 }), elapsed);
+
+        // 起こされるまで眠るタスク
+        ran.clear();
+        elapsed.clear();
+        task.WakeTask(task.FindHandle<sleeper>(11));
+        task.Execute(0.25);
+        IUTEST_ASSERT_EQ(Ints({ 11 }), ran);
+        IUTEST_ASSERT_EQ(Doubles({ 1.25 }), elapsed);
+
+        // 眠っているタスクを除去できる
+        task.RemoveTaskByID(12);
+        IUTEST_ASSERT_EQ(3u, task.GetSleepingCount());
+
+        ran.clear();
+        task.Execute(19998.0);
+        IUTEST_ASSERT_EQ(Ints({ 10 }), ran);
+        ran.clear();
+        elapsed.clear();
+        task.Execute(1.0);
+        IUTEST_ASSERT_EQ(Ints({ 10, 13 }), ran);
+        IUTEST_ASSERT_EQ(Doubles({ 1.0, 20000.25 }), elapsed);
+    }
+
+    // 眠っているタスクの複製は眠っておらず、破棄しても元のタスクはホイールに残る
+    TaskManager task;
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    auto original = task.AddNewTask<sleeper>(20, 1.0);
+    task.Execute(0.25);
+    IUTEST_ASSERT_EQ(1u, task.GetSleepingCount());
+    {
+        sleeper copy(*original);
+    }
+    IUTEST_ASSERT_EQ(1u, task.GetSleepingCount());
+    ran.clear();
+    for (int f = 0; f < 4; f++)
+        task.Execute(0.25);
+    IUTEST_ASSERT_EQ(Ints({ 20 }), ran);
+
+    // 別のマネージャに加えた複製は、元のタスクの起きる時間を待たずに動く
+    TaskManager other;
+    other.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    other.Execute(0);
+    other.AddNewTask<sleeper>(*original);
+    ran.clear();
+    other.Execute(0.25);
+    IUTEST_ASSERT_EQ(Ints({ 20 }), ran);
+}
+
+IUTEST(gtfTest, AsyncLog)
+{
+    auto lines = std::make_shared<std::vector<std::string>>();
+    auto logger = std::make_shared<AsyncLogger>(16, [lines](const std::string& line){ lines->push_back(line); });
+    logger->Log("%d/%u %s %05.1f %x %s%%", -3, 4u, "abc", 2.25, 255, std::string("def"));
+    logger->Log("%s", typeid(int));
+    logger->Flush();
+    IUTEST_ASSERT_EQ(2u, lines->size());
+    IUTEST_ASSERT_EQ(std::string("-3/4 abc 002.2 ff def%"), (*lines)[0]);
+    IUTEST_ASSERT_EQ(std::string("int"), (*lines)[1]);
+
+    // 排他タスクの二重追加の警告は、Destroyまでに出力される
+    {
+        TaskManager task;
+        task.SetLogger(logger);
+        task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+        task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(2);
+        task.Destroy();
+        IUTEST_ASSERT_EQ(3u, lines->size());
+        IUTEST_ASSERT_EQ(0u, (*lines)[2].find("■ALERT■"));
+    }
+    IUTEST_ASSERT_EQ(0u, logger->GetDroppedCount());
+
+    // Flushしなくても、眠っているログのスレッドが起こされて出力される
+    auto count = std::make_shared<std::atomic<int>>(0);
+    AsyncLogger idle(4, [count](const std::string&){ count->fetch_add(1); });
+    for (int i = 0; i < 50; i++){
+        idle.Log("%d", i);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (count->load() <= i && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::yield();
+        IUTEST_ASSERT_EQ(i + 1, count->load());
+    }
+}
+
+#ifdef GTF_PROFILE
+IUTEST(gtfTest, Profile)
+{
+    TaskManager task;
+    task.GetProfiler().EnableTrace(64);
+    task.AddNewTask< CTekitou2<int, ExclusiveTaskBase> >(1);
+    task.Execute(0);
+    task.AddNewTask< CTekitou<int, TaskBase> >(2);
+    task.AddNewTask< CTyped<TaskBase> >(3);
+    task.Execute(0);
+    task.Draw();
+    task.Execute(0);
+
+    const TaskProfiler& p = task.GetProfiler();
+    const TaskProfiler::Stats* s = p.FindTypeStats(typeid(CTyped<TaskBase>));
+    IUTEST_ASSERT_NE((void*)s, (void*)nullptr);
+    IUTEST_ASSERT_EQ(1u, s->calls[static_cast<int>(TaskProfiler::Event::Spawn)]);
+    IUTEST_ASSERT_EQ(1u, s->calls[static_cast<int>(TaskProfiler::Event::Execute)]);
+    IUTEST_ASSERT_EQ(1u, s->calls[static_cast<int>(TaskProfiler::Event::Terminate)]);
+    IUTEST_ASSERT_EQ(1u, p.FindIDStats(2)->calls[static_cast<int>(TaskProfiler::Event::Draw)]);
+    IUTEST_ASSERT_EQ(1u, p.GetFrameHistory().back().calls[static_cast<int>(TaskProfiler::Event::ManagerDraw)]);
+
+    std::ostringstream os;
+    p.WriteChromeTrace(os);
+    IUTEST_ASSERT_EQ(0u, os.str().find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[{\"name\":"));
+}
+#endif
+
 int main(int argc, char** argv)
 {
     IUTEST_INIT(&argc, argv);